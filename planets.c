@@ -1,23 +1,47 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1  /* for pthread_setaffinity_np(); sdl-config usually defines it too */
+#endif
+
+#ifndef PLANETS_LIBRARY
 #include <GL/gl.h>
 #include <GL/glu.h>
 #include <png.h>
 #include "SDL.h"
+#endif
+#include "planets.h"
 
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <float.h>
+#include <inttypes.h>
 #include <libgen.h>
+#include <limits.h>
 #include <math.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
-#include <sys/select.h>
+#include <poll.h>
+#include <signal.h>
+
+#include <linux/perf_event.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/sysinfo.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 
 #define G 50000.0  /* gravitation constant */
@@ -35,10 +59,21 @@
 
 #define SPLIT_DISTANCE 1000.0
 
+#define SPLIT_ANGLE_STEPS 4096  /* resolution of the random orientation of a split */
+#define SPLIT_MOVE_ANGLE (0.0175 * (2.0 * M_PI))  /* children fly off slightly to the side */
+
 #define TOTAL_MASS 1500
 #define PLANET_COUNT_INITIAL 100
 
-#define PLANET_COUNT_MAX ((size_t) (TOTAL_MASS / MASS_MIN))
+#define PLANET_COUNT_MAX ((size_t) (TOTAL_MASS / MASS_MIN))  /* in the usual world; generated ones can be bigger */
+
+#define GENERATOR_CENTER_COUNT 16  /* clusters, or Plummer clumps */
+#define GENERATOR_CLUSTER_SPREAD (WORLD_HEIGHT / 30.0)
+#define GENERATOR_DISK_RADIUS (0.4 * WORLD_HEIGHT)
+#define GENERATOR_PLUMMER_RADIUS (WORLD_HEIGHT / 40.0)
+#define INIT_CHUNK_SIZE 8192  /* planets made at a time by one thread, on one seed */
+#define SCENARIO_MAGIC "PLANETS1"
+#define STATE_HASH_MAGIC "PLANHSH1"
 
 #define PLANET_DENSITY 0.03
 
@@ -47,24 +82,138 @@
 #define WORLD_WIDTH 2458.0
 #define WORLD_HEIGHT (WORLD_WIDTH / WORLD_ASPECT_RATIO)
 
+/* Marks the kernels that take a constant "open" argument.  Each call passes a
+   literal 0 or 1 and is inlined, so the periodic and open worlds each get
+   their own copy with the other one's edge handling folded away. */
+#define BOUNDARY_KERNEL static inline __attribute__((always_inline))
+
+#define FIXED_ONE 4294967296.0  /* a fixed-point position of the far edge of the world, which wraps to 0 */
+
 #define FRAMES_PER_SECOND 60
 #define TICKS_PER_FRAME 5
 
 #define COLLISION_ITERATION_MAX 30
+#define COLLISION_LIST_NONE ((size_t) -1)
+#define COLLISION_LIST_DEAD ((size_t) -2)  /* merged away, and about to be taken off the world */
+#define COLLISION_EVENT_MAX (4 * PLANET_COUNT_MAX)  /* per tick, in case merging and splitting never settles */
 
 #define SCREEN_HEIGHT_INIT 1080  /* initial screen width is calculated from this and the world aspect ratio */
 #define SCREEN_DEPTH 24 /* color depth */
 
-#define CIRCLE_POLY_COUNT 10
-
-#define rand_normal() (rand() / (RAND_MAX + 1.0))
+#define CIRCLE_POLY_COUNT 10  /* vertices of the coarsest circle */
+#define CIRCLE_LOD_COUNT 4  /* each level of detail doubles the vertices */
+#define CIRCLE_POLY_MAX (CIRCLE_POLY_COUNT << (CIRCLE_LOD_COUNT - 1))
+#define LOD_POINT_RADIUS 0.5  /* planets with a smaller radius on screen, in pixels, are drawn as points */
+#define LOD_PIXELS_PER_EDGE 3.0  /* longest edge wanted on a circle's outline, in pixels */
+
+#define CAMERA_ZOOM_MAX 256.0
+#define CAMERA_ZOOM_STEP 1.25
+#define CAMERA_PAN_STEP 0.1  /* of the view, per arrow key press */
+
+#define SPLAT_TILE_SIZE 64  /* pixels across a tile of the density view, whose sums stay in cache */
+#define SPLAT_DENSITY_KNEE 8.0  /* multiple of the world's mean density drawn halfway up the brightness ramp */
+#define HUE_TABLE_SIZE 360
+
+#define QOI_BAND_MAX 64  /* bands of rows a QOI frame is split into, to encode at once */
+#define QOI_BANDS_PER_THREAD 4  /* so a thread with a busy band doesn't hold up the rest */
+#define QOI_HEADER_SIZE 14
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+#define QOI_MASK_2 0xc0
+#define QOI_RUN_MAX 62
+
+#define STATS_WINDOW (2 * FRAMES_PER_SECOND)  /* frames covered by the rolling phase statistics */
+#define STATS_LOG_INTERVAL FRAMES_PER_SECOND  /* frames between lines of the statistics log */
+#define STATS_BUCKETS_PER_OCTAVE 4
+#define STATS_BUCKET_COUNT (20 * STATS_BUCKETS_PER_OCTAVE + 1)  /* 1us up to about 1s */
+
+#define NEIGHBOR_SKIN 20.0  /* extra reach of the neighbor lists, so they survive a few ticks of motion */
+#define COLLISION_SKIN 8.0  /* extra reach of the overlap candidates, so they survive a tick of motion */
+
+#define PACING_BUSY_HIGH 0.9  /* shed load when frames are busier than this share of the budget */
+#define PACING_BUSY_LOW 0.6  /* and restore it after PACING_CALM_FRAMES frames quieter than this */
+#define PACING_CALM_FRAMES FRAMES_PER_SECOND
+#define PACING_SETTLE_FRAMES 10  /* frames to wait after a change before judging it */
+#define PACING_CUTOFF (WORLD_WIDTH / 10.0)
+
+#define REHOME_INTERVAL 64  /* ticks between workers moving their slices of planets into their own memory */
+
+#define REORDER_INTERVAL_BENCHMARK 64  /* ticks between reorders in the benchmark, unless -z says otherwise */
+
+#define RANK_COUNT_MAX 16  /* every pair of ranks holds a socket pair open */
+#define DIST_COLUMNS_PER_RANK 8  /* columns of the aggregate grid in each rank's slab */
+#define DIST_AGGREGATE_ROWS 8
+#define DIST_NEAR_WIDTH_DEFAULT (WORLD_WIDTH / 8.0)
+
+#define TELEMETRY_POLL_INTERVAL 1.0  /* seconds between the -W client's requests */
+#define SNAPSHOT_MAGIC "PLANSNP1"
+#define SNAPSHOT_SLOT_COUNT 3  /* so only a viewer more than a frame behind gets overtaken while copying */
+
+#define TRACE_THREAD_MAX 256
+#define TRACE_RING_SIZE (1 << 15)  /* events kept per thread; older ones are overwritten */
+#define TRACE_NO_COUNT ((size_t) -1)
+
+#define rand_normal() (rand_r(&rand_seed) / (RAND_MAX + 1.0))
 
 int video_flags = 0;
 
+#ifndef PLANETS_LIBRARY
 SDL_Surface *main_window = NULL;
+#endif
 
 unsigned quitting = 0;
 
+__thread unsigned rand_seed;  /* per thread, so ensemble members each have their own stream */
+
+unsigned stats_enabled = 0;
+unsigned hud_visible = 0;
+unsigned density_view = 0;
+unsigned headless = 0;  /* no window:  a -P run is shown by -p viewers instead */
+enum {FRAME_PNG, FRAME_QOI} frame_format = FRAME_PNG;
+
+unsigned tracing = 0;
+
+double force_cutoff = 0.0;  /* 0 means every pair of planets attracts */
+unsigned swept_collisions = 0;
+unsigned single_precision = 0;
+unsigned fixed_point = 0;
+size_t reorder_interval = 0;  /* ticks between sorting the planets into Morton order; 0 for never */
+unsigned adaptive_load = 1;
+
+size_t energy_interval = 0;  /* ticks between energy monitor samples; 0 for never */
+double energy_drift_limit = 0.0;  /* stop once anything drifts further than this; 0 for never */
+double collision_energy = 0.0;  /* added by merging and splitting so far, while -E is on */
+
+unsigned open_world = 0;  /* nothing wraps around the edges */
+double open_margin = 0.0;  /* how far outside an open world planets may go before they're removed */
+size_t escaped_count = 0;  /* planets removed for going past the margin */
+
+long worker_count_option = -1;  /* -1 for one per CPU, less one if the main thread helps */
+unsigned main_helps = 0;
+unsigned partitioned = 0;
+enum {AFFINITY_NONE, AFFINITY_COMPACT, AFFINITY_SCATTER} affinity = AFFINITY_NONE;
+int *cpu_order = NULL;  /* the CPUs we may run on, in the order threads are pinned to them */
+size_t cpu_count = 0;
+
+typedef enum {GENERATOR_UNIFORM, GENERATOR_CLUSTERED, GENERATOR_DISK, GENERATOR_PLUMMER} generator_t;
+generator_t generator = GENERATOR_UNIFORM;
+size_t initial_count = PLANET_COUNT_INITIAL;
+
+unsigned ticks_per_frame = TICKS_PER_FRAME;  /* lowered by the pacing, which lengthens each tick to match */
+unsigned circle_step = 1;  /* draw every this many of the circle's vertices */
+
+__thread size_t next_planet_id = 0;  /* ids are unique across every rank of a distributed run */
+__thread size_t planet_id_stride = 1;
+
+/* The configuration of the world this thread is ticking.  The options above
+   only fill in the program's configurations; the core reads this, which a
+   context points at its own while it steps, and its workers for good. */
+__thread const planets_config_t *physics;
+
 
 typedef struct planet {
   double x_pos, y_pos;
@@ -76,12 +225,19 @@ typedef struct planet {
 
   volatile double x_force, y_force;
 
-  double energy;
+  double energy;  /* kinetic, plus its share of the potential, as of the energy monitor's last sample */
 
   double hue;
   size_t hue_tick;
 
   size_t collision_list;
+
+  size_t index;  /* position in the neighbor list, when there is one */
+
+  size_t generation;  /* changes whenever the planet is reinitialized or merged away */
+
+  size_t id;
+  int ghost;  /* a copy of a planet owned by another rank */
 } planet_t;
 
 
@@ -98,10 +254,166 @@ typedef struct planet_list {
 
 
 typedef struct {
+  /* Verlet neighbor lists:  for each planet, the planets after it in the list
+     that were within force_cutoff + NEIGHBOR_SKIN when the list was built.
+     They stay usable until some planet has moved half the skin, or until the
+     set of planets changes. */
+  planet_t **bodies;
+  double *x_ref, *y_ref;  /* positions at build time */
+  size_t *start;          /* neighbors of bodies[i] are neighbors[start[i]] up to neighbors[start[i + 1]] */
+  planet_t **neighbors;
+  size_t body_count;
+  size_t body_capacity;
+  size_t neighbor_capacity;
+  int valid;
+
+  /* With transposed, each planet's earlier neighbors too:  the planets
+     before bodies[i] whose lists have it, in list order, are
+     earlier[earlier_start[i]] up to earlier[earlier_start[i + 1]]. */
+  int transposed;
+  size_t *earlier_start;
+  planet_t **earlier;
+  size_t earlier_capacity;
+
+  size_t *cell_first;  /* grid used to build the lists without testing every pair */
+  size_t *cell_next;
+  size_t cell_capacity;
+
+  size_t ticks;
+  size_t rebuilds;
+  size_t neighbor_total;  /* summed over all rebuilds */
+  size_t body_total;
+} neighbor_list_t;
+
+
+typedef struct {
+  double time;  /* fraction of the tick at which the planets touch */
+  planet_t *a, *b;
+  size_t a_generation, b_generation;
+} collision_event_t;
+
+
+typedef struct {
+  /* Binary min-heap on time. */
+  collision_event_t *events;
+  size_t size;
+  size_t capacity;
+} event_queue_t;
+
+
+typedef struct {
+  /* Copies of what the single-precision force pass needs, packed into arrays
+     so the inner loop streams through them. */
+  float *x_pos, *y_pos;
+  float *mass;
+  float *radius;
+  size_t size;
+  size_t capacity;
+} float_bodies_t;
+
+
+typedef struct {
+  /* The same for the fixed-point force pass.  A position is the fraction
+     of the way across the world, times 2^32, so the difference of two
+     positions wraps around the world by itself. */
+  uint32_t *x_pos, *y_pos;
+  double *mass;
+  double *radius;
+  size_t size;
+  size_t capacity;
+} fixed_bodies_t;
+
+
+typedef struct {
+  planet_t *a, *b;  /* a is the planet the force pass was working out */
+} candidate_pair_t;
+
+
+typedef struct {
+  /* Pairs the force pass found within touching distance plus
+     COLLISION_SKIN, written by one thread. */
+  candidate_pair_t *pairs;
+  size_t size;
+  size_t capacity;
+} candidate_buffer_t;
+
+
+typedef struct task {
+  /* Resolves a collision group, or splits a planet that came out of one too
+     big.  Whatever it creates is kept on its own lists, and only added to
+     the world when the task tree is committed, in spawn order, so the
+     result doesn't depend on which thread ran what when. */
+  struct thread_arg *pool;
+  planet_list_t *group;  /* the group to merge, or NULL to split planet */
+  planet_t *planet;
+  size_t tick;
+  unsigned seed;
+  planet_list_t born;  /* planets created, to add to the world */
+  planet_list_t split;  /* planets to check for collisions again */
+  double energy;  /* what its merging and splitting added, for collision_energy */
+  struct task *first_child;  /* tasks spawned for the children still too big */
+  struct task *last_child;
+  struct task *next_sibling;
+} task_t;
+
+
+typedef struct {
+  /* The owner pushes and pops at the bottom, thieves take from the top. */
+  task_t **tasks;
+  size_t top;
+  size_t bottom;
+  size_t capacity;
+  pthread_mutex_t mutex;
+} task_deque_t;
+
+
+typedef struct thread_arg {
   planet_list_t *planets;
+  neighbor_list_t *neighbors;
+  planets_config_t config;  /* what physics points at while this world ticks */
+  int single_precision;
+  int fixed_point;
+  int measuring_energy;  /* whether the force pass also leaves each planet's energy in it */
+  float_bodies_t floats;
+  fixed_bodies_t fixed;
+
+  /* While fusing, the force pass also notes the pairs close enough to
+     overlap by the next tick, each thread in its own buffer, the main
+     thread's last.  The next collision pass only checks those, if they're
+     still valid by then, rather than going through every pair again. */
+  int fusing;
+  candidate_buffer_t *candidates;
+  size_t candidate_buffer_count;
+  int candidates_valid;
+
+  int threaded;  /* whether worker threads calculate the forces */
   planet_node_t *planet_node;
+  planet_node_t *planet_node_end;  /* where handing out planets stops; NULL for the end of the list */
   size_t tick;
-  size_t working_planet_count;
+  size_t working_planet_count;  /* with partitioning, the workers yet to finish their slices */
+
+  size_t worker_count;  /* not counting the main thread */
+  size_t next_worker_index;
+  int main_helps;  /* whether the main thread calculates forces too */
+
+  /* With partitioning, every worker always gets the same slice of the list,
+     from slices[index] up to slices[index + 1], the main thread taking the
+     last one if it helps.  Work is released by bumping round. */
+  int partitioned;
+  planet_node_t **slices;
+  size_t round;
+  int rehoming;  /* whether this round moves planets rather than calculating forces */
+
+  /* Collision tasks run on the same threads, each with its own deque, the
+     main thread's last, and so does the density view.  Whichever it is,
+     job is what the workers join in on, while it's set. */
+  task_deque_t *deques;
+  size_t deque_count;
+  volatile size_t tasks_outstanding;
+  void (*job)(struct thread_arg *pool);
+  size_t task_round;
+  size_t task_workers;  /* threads still inside job() */
+
   volatile int running;
   pthread_mutex_t mutex;
   pthread_cond_t cond;
@@ -120,6 +432,436 @@ typedef struct {
 } anim_spec_t;
 
 
+typedef struct transport {
+  /* Moves messages between the ranks of a distributed run.  exchange() sends
+     one message to rank "to" while receiving one from rank "from"; either may
+     be -1 to only receive or only send.  Doing both at once lets every rank
+     send to one neighbor while receiving from another without deadlocking,
+     however big the messages are.  The received message is put in *recv_buf,
+     which is grown with realloc() as needed.  Returns -1 on failure. */
+  int rank;
+  int size;
+  int (*exchange)(struct transport *transport, int to, const void *send_buf, size_t send_len,
+                  int from, void **recv_buf, size_t *recv_capacity, size_t *recv_len);
+  void (*close)(struct transport *transport);
+  void *data;
+} transport_t;
+
+
+typedef struct {
+  uint64_t id;
+  double x_pos, y_pos;
+  double x_vel, y_vel;
+  double mass;
+  double hue;
+  uint64_t hue_tick;
+} body_record_t;
+
+
+typedef struct {
+  /* A scenario file is this header followed by count body records. */
+  char magic[8];
+  uint64_t count;
+} scenario_header_t;
+
+
+typedef struct {
+  /* A -K log is this header, then for every tick a hash_tick_t followed by
+     count hash_body_t, in the order the planets were in memory. */
+  char magic[8];
+  uint64_t seed;
+} hash_header_t;
+
+
+typedef struct {
+  uint64_t tick;
+  uint64_t count;
+  uint64_t hash;  /* the sum of the body hashes, so it doesn't depend on their order */
+} hash_tick_t;
+
+
+typedef struct {
+  uint64_t id;
+  uint64_t hash;
+} hash_body_t;
+
+
+typedef struct {
+  FILE *log;
+  const char *path;
+  hash_body_t *bodies;  /* this tick's, before they're written */
+  size_t capacity;
+} state_hash_t;
+
+
+typedef struct {
+  /* The scenario file given with -l, mapped in once and read by every
+     initialize_planets() call. */
+  const body_record_t *records;
+  size_t count;
+  void *map;
+  size_t map_size;
+} scenario_t;
+
+
+typedef struct {
+  /* A run of the initial planets, which one thread makes into a chain of
+     nodes of its own.  The chains are joined in order afterwards. */
+  size_t first;
+  size_t count;
+  unsigned seed;
+  double mass;  /* of each generated planet */
+  generator_t generator;
+  const double *center_x, *center_y;  /* shared by every chunk */
+  const double *center_x_vel, *center_y_vel;
+  size_t id_base;
+  size_t id_stride;
+  planet_node_t *head;
+  planet_node_t *tail;
+} init_chunk_t;
+
+
+typedef struct {
+  init_chunk_t *chunks;
+  size_t chunk_count;
+  size_t next_chunk;
+} init_job_t;
+
+
+typedef struct {
+  uint64_t migrant_count;
+  uint64_t ghost_count;
+  uint64_t aggregate_count;
+} body_message_header_t;
+
+
+typedef struct {
+  char *data;
+  size_t size;
+  size_t capacity;
+} byte_buffer_t;
+
+
+typedef struct {
+  /* The world is cut into one vertical slab per rank.  Each rank owns the
+     planets in its slab, and sees the planets other ranks own within
+     near_width of its slab as ghosts, exactly.  Everything further away
+     only reaches it through a grid of aggregates:  the total mass and
+     center of mass of each cell, as summed by each rank. */
+  transport_t *transport;
+  pid_t *children;
+  double near_width;
+  size_t columns;  /* of the aggregate grid, across the whole world */
+  size_t near_columns;
+  planet_list_t ghosts;
+  double *aggregates;  /* [rank][column][row][mass, mass * x, mass * y] */
+  byte_buffer_t *send_buffers;
+  void *recv_buffer;
+  size_t recv_capacity;
+} dist_t;
+
+
+typedef struct {
+  /* One step of the adaptive load.  A force cutoff of 0 leaves whatever
+     -c asked for. */
+  unsigned ticks_per_frame;
+  double force_cutoff;
+  unsigned circle_step;
+} pacing_level_t;
+
+
+typedef struct {
+  double deadline;  /* when the current frame should be shown, on the monotonic clock */
+  double woke;  /* when the last wait ended */
+  double busy_average;  /* share of the frame budget spent working, smoothed */
+  size_t level;
+  size_t frames_since_change;
+  size_t calm_frames;
+
+  size_t frames;
+  size_t missed;
+  size_t level_changes;
+  size_t deepest_level;
+  double busy_total;
+  double busy_max;
+} pacing_t;
+
+
+typedef struct {
+  /* Hands out the members of an ensemble run to its threads. */
+  size_t member_count;
+  size_t frame_count;
+  unsigned base_seed;
+  size_t next_member;
+  double sim_seconds;  /* simulated so far by all the members together */
+  pthread_mutex_t mutex;
+} ensemble_t;
+
+
+struct planets_context {
+  /* A world stepped through the library interface in planets.h.  Its random
+     stream, ids and configuration are swapped in for the thread's while it
+     steps. */
+  planet_list_t planets;
+  thread_arg_t thread_arg;  /* holds the configuration */
+  pthread_list_t threads;  /* the workers, if the configuration asks for any */
+  neighbor_list_t neighbors;
+  dist_t *dist;  /* the program's first rank steps its slab of a distributed world */
+  unsigned seed;
+  size_t next_id;
+  size_t id_stride;
+  planets_body_t *bodies;  /* filled by planets_bodies() */
+  size_t body_count;
+  size_t body_capacity;
+  int bodies_stale;  /* whether the world has stepped since they were filled */
+};
+
+
+typedef enum {
+  PHASE_COLLISION,
+  PHASE_FORCE,
+  PHASE_MOVE,
+  PHASE_RENDER,
+  PHASE_READBACK,
+  PHASE_ENCODE,
+  PHASE_WAIT,
+  PHASE_COUNT
+} phase_t;
+
+
+typedef struct {
+  /* Totals for the frame currently being simulated. */
+  double current[PHASE_COUNT];
+  size_t current_passes;
+
+  /* Rolling window over the last STATS_WINDOW frames. */
+  double samples[PHASE_COUNT][STATS_WINDOW];
+  size_t pass_samples[STATS_WINDOW];
+  size_t histogram[PHASE_COUNT][STATS_BUCKET_COUNT];
+  size_t sample_count;
+  size_t next_sample;
+
+  size_t frame;
+
+  FILE *log;
+  int log_json;
+} frame_stats_t;
+
+
+typedef struct {
+  const char *name;
+  double start, end;
+  size_t count;
+} trace_event_t;
+
+
+typedef struct {
+  /* Only the owning thread writes to a ring, and it is only read once
+     that thread has been joined, so no locking is needed. */
+  trace_event_t *events;
+  size_t written;
+  char thread_name[32];
+
+  /* The work span currently open on this thread, if work_count > 0. */
+  double work_start;
+  size_t work_count;
+} trace_ring_t;
+
+
+typedef struct {
+  size_t tick;
+  size_t frame;
+  size_t frame_count;  /* frames to save, or 0 if the run is open-ended */
+  size_t bodies;
+  double mass;
+  double x_momentum, y_momentum;
+  double phase_ms[PHASE_COUNT];  /* means over the statistics window */
+  size_t exported_frames;
+  double exported_bytes;
+  double uptime;
+} telemetry_data_t;
+
+
+typedef struct {
+  /* The main loop publishes a snapshot once a frame and the server thread
+     copies it out, retrying if it changed meanwhile, so neither ever waits
+     on the other.  The sequence is odd while an update is under way. */
+  volatile unsigned sequence;
+  telemetry_data_t data;
+
+  const char *path;  /* of the listening socket, or NULL when there's no server */
+  int listen_fd;
+  pthread_t thread;
+  double start;
+} telemetry_t;
+
+
+typedef struct {
+  double x_pos, y_pos;
+  double radius;
+  double mass;
+  double hue;
+} snapshot_body_t;
+
+
+typedef struct {
+  /* One frame of the ring, followed by room for the header's capacity of
+     bodies.  The sequence is odd while the simulator is writing it. */
+  volatile uint64_t sequence;
+  uint64_t tick;
+  uint64_t count;
+  uint64_t unused;
+} snapshot_slot_t;
+
+
+typedef struct {
+  /* The start of the shared memory a -P run publishes to, followed by
+     SNAPSHOT_SLOT_COUNT slots.  The simulator writes each frame into the
+     slot after the newest and never waits for anyone:  a viewer copies the
+     newest slot out and starts over if the sequence changed meanwhile. */
+  char magic[8];
+  uint64_t capacity;  /* bodies in a slot */
+  uint64_t open_world;
+  volatile uint64_t published;  /* frames so far; the newest is in slot (published - 1) % SNAPSHOT_SLOT_COUNT */
+  volatile uint64_t ended;
+  uint64_t publisher;  /* the -P run's pid, to tell its ring from one a run that died left behind */
+} snapshot_header_t;
+
+
+typedef struct {
+  char name[NAME_MAX];
+  snapshot_header_t *header;
+  size_t map_size;
+  int truncated;  /* there were more planets than a slot holds */
+} snapshot_ring_t;
+
+
+typedef struct {
+  /* What part of the world is on screen.  The world wraps, so the view can
+     run off any edge of it, and shows the other side there. */
+  double x, y;  /* world position at the middle of the screen */
+  double zoom;  /* 1 fits the whole world on screen */
+  int width, height;  /* of the screen, in pixels */
+  double left, right, bottom, top;  /* edges of the view, in world units */
+  double pixels_per_unit;
+} camera_t;
+
+
+typedef struct {
+  /* Planets too small to see as circles, drawn all at once as points. */
+  float *xy;
+  float *rgb;
+  size_t size;
+  size_t capacity;
+} point_batch_t;
+
+
+typedef struct {
+  unsigned pixel;  /* within its tile, row by row */
+  float mass;
+  const float *rgb;
+} splat_point_t;
+
+
+typedef struct {
+  /* The density view.  Every copy of a planet on screen is binned by the
+     tile it lands in, and each tile is then summed and tone mapped by just
+     one thread, so no two threads touch the same sums, and there's no
+     screen of them to clear or add up. */
+  int width, height;
+  size_t columns, rows;  /* of tiles, the last ones cut short by the screen's edge */
+  size_t *tile_starts;  /* where each tile's points start, and one more for the end */
+  size_t *tile_ends;  /* where each tile's next point goes, while binning */
+  splat_point_t *points;
+  size_t point_capacity;
+  unsigned char *pixels;  /* RGB, bottom row first, as glDrawPixels() takes them */
+  double density_scale;  /* turns mass per pixel into a multiple of the world's mean density */
+  volatile size_t next_tile;
+} splat_t;
+
+
+typedef struct {
+  /* A QOI frame being encoded.  Each band of rows starts out as if nothing
+     came before it:  its first pixel is written whole, and it only refers
+     back to colors it wrote itself.  So the bands can be encoded at once,
+     by several threads, and just joined together, and the file is still
+     one that any QOI decoder reads. */
+  const unsigned char *pixels;  /* RGB, bottom row first, as glReadPixels() gives them */
+  int width, height;
+  size_t band_count;
+  unsigned char *out;  /* band_count buffers of band_capacity bytes */
+  size_t band_capacity;
+  size_t band_sizes[QOI_BAND_MAX];
+  size_t next_band;
+} qoi_encoder_t;
+
+
+typedef struct {
+  /* What the energy monitor compares each sample against.  Merging is
+     inelastic and splitting adds energy, so what they change is kept in
+     collision_energy and taken off before comparing. */
+  size_t samples;
+  double cutoff;  /* force_cutoff when the energy baseline was taken, since the potential depends on it */
+  double energy;
+  double energy_scale;  /* kinetic plus the size of the potential energy */
+  double mass;
+  double x_momentum, y_momentum;
+  double momentum_scale;  /* total of every planet's momentum, however it points */
+  double worst_energy_drift;
+  double worst_momentum_drift;
+  double worst_mass_drift;
+  int tripped;
+} energy_monitor_t;
+
+
+frame_stats_t frame_stats;
+telemetry_t telemetry;
+snapshot_ring_t snapshot_ring;
+camera_t camera = {0.5 * WORLD_WIDTH, 0.5 * WORLD_HEIGHT, 1.0};
+point_batch_t point_batch;
+splat_t splat;
+qoi_encoder_t qoi_encoder;
+energy_monitor_t energy_monitor;
+scenario_t scenario;
+state_hash_t state_hash;
+
+size_t exported_frames = 0;
+double exported_bytes = 0.0;
+
+const pacing_level_t pacing_levels[] = {
+  {TICKS_PER_FRAME, 0.0, 1},
+  {TICKS_PER_FRAME, 0.0, 2},
+  {4, 0.0, 2},
+  {3, 0.0, 2},
+  {3, PACING_CUTOFF, 2},
+};
+
+trace_ring_t trace_rings[TRACE_THREAD_MAX];
+size_t trace_ring_count = 0;
+__thread trace_ring_t *thread_trace_ring = NULL;
+
+__thread size_t task_index = 0;  /* which deque this thread's collision tasks go on */
+__thread size_t task_round_seen = 0;  /* the last task round this thread joined */
+__thread task_t *running_task = NULL;  /* the collision task this thread is in, if any */
+double trace_epoch;
+
+/* Lookup tables, filled in by init_tables(), so that splitting and drawing
+   planets needs no trigonometry. */
+double split_energy_sums[SPLIT_COUNT_MAX + 1];
+double split_cos[SPLIT_COUNT_MAX + 1][SPLIT_COUNT_MAX];  /* unit vectors i/count of the way around */
+double split_sin[SPLIT_COUNT_MAX + 1][SPLIT_COUNT_MAX];
+double split_angle_cos[SPLIT_ANGLE_STEPS];
+double split_angle_sin[SPLIT_ANGLE_STEPS];
+double split_move_cos, split_move_sin;
+float circle_cos[CIRCLE_LOD_COUNT][CIRCLE_POLY_MAX];  /* level l has CIRCLE_POLY_COUNT << l vertices */
+float circle_sin[CIRCLE_LOD_COUNT][CIRCLE_POLY_MAX];
+float hue_rgb[HUE_TABLE_SIZE][3];  /* hue_to_rgb() of each whole degree */
+
+const char *phase_names[PHASE_COUNT] = {
+  "collision", "force", "move", "render", "readback", "encode", "wait"
+};
+
+
 void die_usage(const char *prog);
 size_t parse_frames(char *spec);
 int prepare_anim_dir(anim_spec_t anim);
@@ -130,69 +872,314 @@ int set_up_pixel_format(void);
 int create_window(const char *window_name, int width, int height, int video_flags);
 int initialize_openGL(int width, int height);
 void size_openGL_screen(int width, int height);
-int run_simulation(anim_spec_t anim);
+void camera_apply(void);
+void camera_zoom(double factor, double x, double y);
+void camera_pan(double x_offset, double y_offset);
+void camera_limit(void);
+void camera_reset(void);
+void camera_screen_to_world(int x, int y, double *world_x, double *world_y);
+int run_simulation(anim_spec_t anim, dist_t *dist);
+int run_rank(dist_t *dist);
+int run_dist_validation(dist_t *dist, size_t frame_count);
+int run_validation(size_t frame_count);
+int compare_runs(size_t frame, const planet_list_t *planets_double, const planet_list_t *planets_float);
+int run_ensemble(size_t member_count, size_t frame_count);
+void *t_ensemble_runner(void *void_arg);
+void run_member(ensemble_t *ensemble, size_t member);
+void planets_update_bodies(planets_context_t *context);
+planets_context_t *context_new(size_t count, int generator, unsigned seed, size_t first_id, size_t id_stride,
+                               const planets_config_t *config);
+int config_valid(const planets_config_t *config);
+void config_from_options(planets_config_t *config);
+int compare_doubles(const void *a, const void *b);
+int run_benchmark(size_t frame_count);
+int open_cache_miss_counter(void);
+void total_momentum(const planet_list_t *planets, double *x_momentum, double *y_momentum);
 int start_threads(pthread_list_t *threads, thread_arg_t *arg);
 void stop_threads(pthread_list_t *threads, thread_arg_t *arg);
 int pthread_list_init(pthread_list_t *list, size_t size);
 void pthread_list_delete(pthread_list_t *list);
 void *t_planet_ticker(void *void_arg);
+void build_cpu_order(int scatter);
+int cpu_package(int cpu);
+void pin_thread(pthread_t thread, size_t slot);
+#ifndef PLANETS_LIBRARY
 int handle_sdl_event(SDL_Event *event);
 void handle_key_press_event(SDL_keysym *keysym);
-void initialize_planets(planet_list_t *planets);
-void display_planets(const planet_list_t *planets);
-void draw_planet(planet_t *planet);
-void color_planet(planet_t *planet);
-void hue_to_rgb(double hue, double *r, double *g, double *b);
+void handle_mouse_event(SDL_Event *event);
+#endif
+void initialize_planets(planet_list_t *planets, size_t count, generator_t kind);
+void *t_initialize_chunks(void *void_job);
+void initialize_chunk(init_chunk_t *chunk);
+planet_t *generate_planet(const init_chunk_t *chunk);
+void plummer_offset(double *x_offset, double *y_offset, double *x_vel, double *y_vel);
+int scenario_load(const char *path);
+int scenario_save(const char *path);
+#ifndef PLANETS_LIBRARY
+void display_planets(const planet_list_t *planets, thread_arg_t *pool);
+BOUNDARY_KERNEL void draw_planet(planet_t *planet, const int open);
+void planet_color(const planet_t *planet, float *rgb);
+void point_batch_add(float x, float y, const float *rgb);
+void point_batch_draw(void);
+void splat_planets(const planet_list_t *planets, thread_arg_t *pool);
+BOUNDARY_KERNEL void splat_planet(const planet_t *planet, const int open, const int placing);
+void splat_tiles(thread_arg_t *pool);
+void splat_tile(size_t tile);
+void splat_tone_map(const float *sum, unsigned char *pixel);
+void splat_draw(void);
 void scale_color(double brightness, double *r, double *g, double *b);
-void draw_circle(double cx, double cy, double radius);
-int write_anim_frame(anim_spec_t anim, size_t frame_num);
+void draw_circle(double cx, double cy, double radius, int lod);
+void draw_hud(void);
+void draw_hud_bar(double y, double height, double value, const float *color);
+int write_anim_frame(anim_spec_t anim, size_t frame_num, thread_arg_t *pool);
 int anim_frame_pathname(char *dest, size_t size, size_t num, anim_spec_t anim);
-int dump_screen_PNG(const char *path, int width, int height);
+int dump_screen(const char *path, int width, int height, thread_arg_t *pool);
 size_t digit_count(size_t num);
 int write_PNG(const char *path, char *pixels_rgb, int width, int height);
+int write_QOI(const char *path, const unsigned char *pixels_rgb, int width, int height, thread_arg_t *pool);
+void qoi_encode_bands(thread_arg_t *pool);
+size_t qoi_encode_band(unsigned char *out, int first_row, int end_row);
+void qoi_put_u32(unsigned char *out, uint32_t value);
+int read_QOI(const char *path, unsigned char **pixels_rgb, int *width, int *height);
+int convert_QOI_frames(const char *dir);
+#endif
 void tick_planets(thread_arg_t *thread_arg);
-void resolve_collisions(planet_list_t *planets, size_t tick);
-void resolve_collision_group(planet_list_t *planets, planet_list_t *collision, planet_list_t *new_planets, size_t tick);
+size_t resolve_collisions(thread_arg_t *thread_arg);
+planet_t *resolve_collision_group(planet_list_t *planets, planet_list_t *collision, planet_list_t *new_planets, size_t tick, planet_list_t *dead);
+planet_t *merge_collision_group(planet_list_t *collision);
+task_t *task_new(thread_arg_t *pool, planet_list_t *group, planet_t *planet, size_t tick, unsigned seed);
+void task_run(task_t *task);
+void task_commit(task_t *task, planet_list_t *planets, planet_list_t *new_planets);
+void task_spawn(task_t *parent, planet_t *planet);
+void run_tasks(thread_arg_t *pool);
+void run_pool_job(thread_arg_t *pool, void (*job)(thread_arg_t *pool));
+void run_task_round(thread_arg_t *pool, planet_list_t *collision_lists, size_t collision_count, planet_list_t *new_planets);
+void task_deques_init(thread_arg_t *pool, size_t count);
+void task_deques_delete(thread_arg_t *pool);
+void task_push(task_deque_t *deque, task_t *task);
+task_t *task_pop(task_deque_t *deque);
+task_t *task_steal(task_deque_t *deque);
 void find_oldest_hue(const planet_list_t *planets, double *hue, size_t *hue_tick);
-void split_planet(planet_list_t *planets, planet_t *planet, planet_list_t *new_planets, size_t tick);
+void split_planet(planet_list_t *planets, planet_t *planet, planet_list_t *new_planets, size_t tick, task_t *spawner);
 double calculate_split_energy(double mass, size_t count, double r1, double r2);
+double split_energy_sum(size_t count);
 void delete_planets(planet_list_t *planets);
-void find_collision_groups(planet_list_t *planets, planet_list_t *new_planets, planet_list_t *collision_lists, size_t *collision_count);
-void resolve_collision_pair(planet_t *p1, planet_t *p2, planet_list_t *collision_lists, size_t *collision_count);
+void find_collision_groups(planet_list_t *planets, neighbor_list_t *neighbors, planet_list_t *new_planets, planet_list_t *collision_lists, size_t *collision_count);
+BOUNDARY_KERNEL void find_collision_groups_kernel(planet_list_t *planets, neighbor_list_t *neighbors, planet_list_t *new_planets,
+                                                  planet_list_t *collision_lists, size_t *collision_count, const int open);
+BOUNDARY_KERNEL int find_new_planet_collisions(planet_list_t *planets, planet_list_t *new_planets,
+                                               planet_list_t *collision_lists, size_t *collision_count, const int open);
+BOUNDARY_KERNEL void resolve_collision_pair(planet_t *p1, planet_t *p2, planet_list_t *collision_lists, size_t *collision_count, const int open);
+void find_candidate_collisions(thread_arg_t *thread_arg, planet_list_t *collision_lists, size_t *collision_count);
+BOUNDARY_KERNEL void find_candidate_collisions_kernel(const candidate_pair_t *pairs, size_t count,
+                                                      planet_list_t *collision_lists, size_t *collision_count, const int open);
+int compare_candidates(const void *a, const void *b);
 void merge_collision_lists(planet_list_t *collision_lists, size_t list_a, size_t list_b);
+size_t resolve_swept_collisions(planet_list_t *planets, neighbor_list_t *neighbors, size_t tick);
+void find_first_contacts(planet_list_t *planets, neighbor_list_t *neighbors, event_queue_t *queue);
+void queue_contacts_with(planet_list_t *planets, planet_t *planet, double start, event_queue_t *queue);
+void queue_contact(event_queue_t *queue, planet_t *a, planet_t *b, double start);
+void planets_advance(planet_list_t *planets, double time);
+void event_queue_init(event_queue_t *queue);
+void event_queue_delete(event_queue_t *queue);
+void event_queue_push(event_queue_t *queue, const collision_event_t *event);
+int event_queue_pop(event_queue_t *queue, collision_event_t *event);
 void calculate_forces(thread_arg_t *thread_arg);
-void calculate_planet_forces(planet_node_t *node);
-void calculate_force_pair(planet_t *p1, planet_t *p2);
+void run_partitioned(thread_arg_t *thread_arg, int rehoming);
+void partition_planets(thread_arg_t *thread_arg, size_t slice_count);
+void process_slice(thread_arg_t *thread_arg, size_t index);
+void rehome_planets(thread_arg_t *thread_arg);
+void calculate_planet_forces(thread_arg_t *thread_arg, planet_node_t *node);
+BOUNDARY_KERNEL void calculate_planet_forces_kernel(thread_arg_t *thread_arg, planet_node_t *node, const int open);
+BOUNDARY_KERNEL void calculate_force_pair(planet_t *p1, planet_t *p2, double max_distance_squared, double *potential,
+                                          candidate_buffer_t *candidates, const int open);
+BOUNDARY_KERNEL int pair_force(planet_t *p1, planet_t *p2, double max_distance_squared, double *potential,
+                               candidate_buffer_t *candidates, const int open, double *x_force, double *y_force);
+int forces_single_writer(const thread_arg_t *thread_arg);
+void candidate_buffers_reset(thread_arg_t *thread_arg);
+void candidate_buffers_delete(thread_arg_t *thread_arg);
+void candidate_add(candidate_buffer_t *buffer, planet_t *a, planet_t *b);
+void float_bodies_update(float_bodies_t *floats, planet_list_t *planets);
+void float_bodies_delete(float_bodies_t *floats);
+BOUNDARY_KERNEL double calculate_planet_forces_float(const float_bodies_t *floats, planet_t *planet, const int open, const int measuring);
+void fixed_bodies_update(fixed_bodies_t *fixed, planet_list_t *planets);
+void fixed_bodies_delete(fixed_bodies_t *fixed);
+BOUNDARY_KERNEL double calculate_planet_forces_fixed(const fixed_bodies_t *fixed, planet_t *planet, const int measuring);
+int energy_monitor_sample(size_t tick, const planet_list_t *planets);
+double group_energy(const planet_list_t *group);
+double pair_potential(planet_t *p1, planet_t *p2);
+double split_potential(double mass, size_t count, double distance, double radius);
+void collision_energy_add(double energy);
+void energy_monitor_report(void);
+int state_hash_open(const char *path, unsigned seed);
+void state_hash_close(void);
+int state_hash_record(size_t tick, const planet_list_t *planets);
+uint64_t planet_hash(const planet_t *planet);
+uint64_t hash_mix(uint64_t hash, double value);
+int compare_body_ids(const void *a, const void *b);
+int read_hash_tick(FILE *file, const char *path, hash_tick_t *tick, hash_body_t **bodies, size_t *capacity);
+int run_hash_compare(const char *path_a, const char *path_b);
+void round_to_float(planet_list_t *planets);
+void round_to_fixed(planet_list_t *planets);
+uint32_t fixed_from_double(double value, double size);
 void position_mod(planet_t *p1, planet_t *p2, double *p2_x, double *p2_y);
-void move_planets(planet_list_t *planets);
+BOUNDARY_KERNEL void separation(const planet_t *p1, const planet_t *p2, double *x_diff, double *y_diff, const int open);
+double move_planets(planet_list_t *planets);
+void accelerate_planets(planet_list_t *planets);
+double drift_planets(planet_list_t *planets);
+BOUNDARY_KERNEL double drift_planets_kernel(planet_list_t *planets, const int open);
+void remove_escaped_planets(thread_arg_t *thread_arg);
 double mod_double(double value, double min, double max);
-void wait_for_next_tick(struct timeval *start);
+void neighbor_list_init(neighbor_list_t *list);
+void neighbor_list_delete(neighbor_list_t *list);
+void neighbor_list_update(neighbor_list_t *list, planet_list_t *planets, int transposed);
+int neighbor_list_moved_too_far(const neighbor_list_t *list);
+void neighbor_list_build(neighbor_list_t *list, planet_list_t *planets);
+size_t neighbor_cell(double offset, double extent, size_t cells);
+void neighbor_list_add(neighbor_list_t *list, size_t *count, planet_t *a, planet_t *b, double reach_squared);
+void neighbor_list_report(const neighbor_list_t *list);
+void reorder_planets(planet_list_t *planets, neighbor_list_t *neighbors);
+uint32_t morton_code(const planet_t *planet);
+uint32_t spread_bits(uint32_t value);
+void radix_sort(uint32_t *keys, size_t *order, size_t count);
+int compare_addresses(const void *a, const void *b);
+void pacing_init(pacing_t *pacing);
+void pacing_wait(pacing_t *pacing);
+void pacing_adapt(pacing_t *pacing, planets_context_t *context);
+void pacing_set_level(pacing_t *pacing, size_t level, planets_context_t *context);
+void pacing_report(const pacing_t *pacing);
+void sleep_until(double deadline);
+double monotonic_time(void);
+double phase_begin(void);
+void phase_end(phase_t phase, double start);
+void stats_add_collision_passes(size_t passes);
+int stats_open_log(const char *path);
+void stats_close_log(void);
+void stats_end_frame(size_t tick, size_t body_count);
+size_t stats_bucket(double seconds);
+double stats_bucket_limit(size_t bucket);
+double stats_mean(phase_t phase);
+double stats_max(phase_t phase);
+double stats_percentile(phase_t phase, double fraction);
+void stats_passes(double *mean, size_t *max);
+void stats_write_log(size_t tick, size_t body_count);
+int telemetry_start(const char *path);
+void telemetry_stop(void);
+void telemetry_publish(size_t tick, size_t frame, size_t frame_count, const planet_list_t *planets);
+void telemetry_read(telemetry_data_t *data);
+void *t_telemetry_server(void *unused);
+int telemetry_format(const telemetry_data_t *data, char *buf, size_t size);
+int run_telemetry_client(const char *path);
+int snapshot_start(const char *name, size_t capacity);
+int snapshot_abandoned(const char *shm_name);
+void snapshot_stop(void);
+void snapshot_publish(size_t tick, const planet_list_t *planets);
+snapshot_slot_t *snapshot_slot(snapshot_header_t *header, size_t slot);
+int snapshot_read(snapshot_header_t *header, planet_t *planets, planet_node_t *nodes, planet_list_t *list);
+int snapshot_name(char *dest, const char *name);
+int run_viewer(const char *name);
+void handle_quit_signal(int signum);
+int trace_open(void);
+void trace_register_thread(const char *name_format, size_t num);
+double trace_begin(void);
+void trace_end(const char *name, double start, size_t count);
+void trace_add(const char *name, double start, double end, size_t count);
+void trace_count_work(void);
+void trace_flush_work(void);
+int trace_write(const char *path);
 planet_t *planet_new(double x_pos, double y_pos, double x_vel, double y_vel, double mass, double hue, size_t tick);
 void planet_init(planet_t *planet, double x_pos, double y_pos, double x_vel, double y_vel, double mass, double hue, size_t tick);
 void planet_add_force(planet_t *planet, double x_force, double y_force);
 double radius_for_mass(double mass);
+double fast_cbrt(double value);
+void init_tables(void);
+void hue_to_rgb(double hue, double *r, double *g, double *b);
+int check_tables(void);
 void list_init(planet_list_t *list);
 void list_add(planet_list_t *list, planet_t *planet);
 planet_t *list_remove_first(planet_list_t *list);
 void list_remove_all(planet_list_t *list, planet_list_t *removing);
 int list_contains(planet_list_t *list, planet_t *planet);
 void list_delete(planet_list_t *list);
+void list_copy(planet_list_t *dest, const planet_list_t *src);
+void list_move_all(planet_list_t *dest, planet_list_t *src);
+void list_remove_dead(planet_list_t *list);
 void thread_arg_init(thread_arg_t *arg, planet_list_t *planets);
 planet_node_t *thread_arg_get_planet_node(thread_arg_t *arg, int finished_one);
+planet_node_t *thread_arg_take_planet_node(thread_arg_t *arg, int finished_one);
+int thread_arg_wait_for_round(thread_arg_t *arg, size_t *round);
+int thread_arg_join_tasks(thread_arg_t *arg);
+void thread_arg_finish_slice(thread_arg_t *arg);
 void thread_arg_reset_planet_node(thread_arg_t *arg);
 void thread_arg_wait_till_zero_working(thread_arg_t *arg);
 void thread_arg_stop_running(thread_arg_t *arg);
+int start_ranks(dist_t *dist, int rank_count, double near_width);
+void stop_ranks(dist_t *dist);
+void distributed_tick(dist_t *dist, thread_arg_t *thread_arg);
+void distributed_exchange(dist_t *dist, planet_list_t *planets, int with_aggregates);
+void distributed_drop_ghosts(dist_t *dist);
+void distributed_transfer(dist_t *dist, int to, const void *send_buf, size_t send_len, int from, size_t *recv_len);
+int planet_rank(const dist_t *dist, const planet_t *planet);
+size_t planet_column(const dist_t *dist, const planet_t *planet);
+size_t planet_row(const planet_t *planet);
+int column_near_rank(const dist_t *dist, size_t column, int rank);
+void distributed_collisions(dist_t *dist, planet_list_t *planets, size_t tick);
+void sort_planet_list(planet_list_t *list, int (*compare)(const void *, const void *));
+int compare_planet_ids(const void *a, const void *b);
+int compare_planet_positions(const void *a, const void *b);
+int group_owner(const dist_t *dist, const planet_list_t *group);
+void distributed_forces(dist_t *dist, thread_arg_t *thread_arg);
+void aggregate_forces(dist_t *dist, planet_list_t *planets);
+int distributed_gather(dist_t *dist, planet_list_t *planets, planet_list_t *all);
+void distributed_send_continue(dist_t *dist, int keep_going);
+int distributed_recv_continue(dist_t *dist);
+void planet_to_record(const planet_t *planet, body_record_t *record);
+planet_t *planet_from_record(const body_record_t *record);
+void buffer_append(byte_buffer_t *buffer, const void *data, size_t size);
+transport_t *socket_transport_create(int size, pid_t *children);
+int socket_transport_exchange(transport_t *transport, int to, const void *send_buf, size_t send_len,
+                              int from, void **recv_buf, size_t *recv_capacity, size_t *recv_len);
+void socket_transport_close(transport_t *transport);
 void *my_malloc(size_t size);
+void *my_realloc(void *ptr, size_t size);
+
 
+#ifndef PLANETS_LIBRARY
+/* The program:  everything from here to the library interface needs SDL,
+   OpenGL or libpng, so libplanets.a is built without it.  Its runs step
+   their worlds through the interface, configured from the options. */
 
 int main(int argc, char **argv) {
   anim_spec_t anim = {0};
+  const char *stats_path = NULL;
+  const char *trace_path = NULL;
+  const char *telemetry_path = NULL;
+  const char *watch_path = NULL;
+  const char *load_path = NULL;
+  const char *save_path = NULL;
+  const char *hash_path = NULL;
+  const char *compare_path = NULL;
+  const char *convert_dir = NULL;
+  const char *publish_name = NULL;
+  const char *view_name = NULL;
+  unsigned long seed = 0;
+  int seeded = 0;
+  int generated = 0;
+  size_t validate_frames = 0;
+  long member_count = 0;
+  size_t benchmark_frames = 0;
+  long rank_count = 1;
+  double near_width = DIST_NEAR_WIDTH_DEFAULT;
+  dist_t dist;
+  int status;
+  char *endptr;
+  char trailing;
   int c;
   const char *prog_name;
 
   prog_name = basename(argv[0]);
 
-  while ((c = getopt(argc, argv, "t:d:")) != -1) {
+  while ((c = getopt(argc, argv, "t:d:Hs:T:c:C:fxV:r:G:e:z:b:Fj:A:MNS:W:g:n:l:w:v:DE:X:O:R:K:k:o:q:P:p:")) != -1) {
     switch (c) {
       case 't':
         if (anim.frame_count > 0) {
@@ -212,1150 +1199,7804 @@ int main(int argc, char **argv) {
           die_usage(prog_name);
         }
         break;
-      default:
-        die_usage(prog_name);
-    }
-  }
-
-  if ((anim.frame_count > 0) ^ (anim.dir != NULL)) {
-    fputs("-t and -d must be provided together.\n", stderr);
-    die_usage(prog_name);
-  }
-
-  argv += optind;
-  argc -= optind;
-
-  if (argc != 0) {
-    die_usage(prog_name);
-    return 1;
-  }
-
-  srand(time(NULL));
-
-  if (SDL_Init(SDL_INIT_VIDEO) < 0) {
-    fprintf(stderr, "SDL_Init() failed: %s\n", SDL_GetError());
-    return 1;
-  }
-
-  atexit(SDL_Quit);
-
-  SDL_ShowCursor(SDL_DISABLE);
-
-  if (initialize_display() < 0) {
-    return 1;
-  }
-
-  if (anim.dir) {
-    if (prepare_anim_dir(anim) < 0) {
-      return 1;
-    }
-  }
-
-  return run_simulation(anim) == 0 ? 0 : 1;
-}
-
-
-void die_usage(const char *prog) {
-  fprintf(stderr, "Usage: %s [-d <anim_dir> -t <anim_duration>]\n", prog);
-  fprintf(stderr, "\n");
-  fprintf(stderr, "Options:\n");
-  fprintf(stderr, "  -d <anim_dir>    Directory to save animation frames in.  It must not already exist.\n");
-  fprintf(stderr, "  -t <num>[s|m|h]  Duration of animation.  Units are s=seconds, m=minutes, h=hours, or <omitted>=frames.\n");
-  fprintf(stderr, "\n");
-  fprintf(stderr, "If either -d or -t is given, then the other must be provided as well.\n");
-  fprintf(stderr, "If neither option is provided, then no animation frames are saved.\n");
-
-  exit(1);
-}
-
-
-size_t parse_frames(char *spec) {
-  char unit;
-  size_t factor = 1;
-  size_t count;
-  char *endptr;
-
-  if (strlen(spec) == 0) {
-    return 0;
-  }
-
-  unit = spec[strlen(spec) - 1];
-  if (unit == 'h') {
-    factor *= 60;
-    unit = 'm';
-  }
-  if (unit == 'm') {
-    factor *= 60;
-    unit = 's';
-  }
-  if (unit == 's') {
-    factor *= FRAMES_PER_SECOND;
-  }
-
+      case 'o':
+        if (strcmp(optarg, "png") == 0) {
+          frame_format = FRAME_PNG;
+        } else if (strcmp(optarg, "qoi") == 0) {
+          frame_format = FRAME_QOI;
+        } else {
+          die_usage(prog_name);
+        }
+        break;
+      case 'q':
+        if (convert_dir != NULL || strlen(optarg) == 0) {
+          die_usage(prog_name);
+        }
+        convert_dir = optarg;
+        break;
+      case 'P':
+        if (publish_name != NULL || strlen(optarg) == 0) {
+          die_usage(prog_name);
+        }
+        publish_name = optarg;
+        headless = 1;
+        break;
+      case 'p':
+        if (view_name != NULL || strlen(optarg) == 0) {
+          die_usage(prog_name);
+        }
+        view_name = optarg;
+        break;
+      case 'H':
+        hud_visible = 1;
+        stats_enabled = 1;
+        break;
+      case 'D':
+        density_view = 1;
+        break;
+      case 'E':
+        energy_interval = strtoul(optarg, &endptr, 10);
+        if (*endptr || strchr(optarg, '-') || energy_interval == 0) {
+          fputs("The energy monitor interval must be a positive number of ticks.\n", stderr);
+          die_usage(prog_name);
+        }
+        break;
+      case 'X':
+        energy_drift_limit = strtod(optarg, &endptr);
+        if (*endptr || energy_drift_limit <= 0.0) {
+          fputs("The drift limit must be a positive number.\n", stderr);
+          die_usage(prog_name);
+        }
+        break;
+      case 's':
+        if (stats_path != NULL || strlen(optarg) == 0) {
+          die_usage(prog_name);
+        }
+        stats_path = optarg;
+        break;
+      case 'T':
+        if (trace_path != NULL || strlen(optarg) == 0) {
+          die_usage(prog_name);
+        }
+        trace_path = optarg;
+        break;
+      case 'S':
+        if (telemetry_path != NULL || strlen(optarg) == 0) {
+          die_usage(prog_name);
+        }
+        telemetry_path = optarg;
+        break;
+      case 'W':
+        if (watch_path != NULL || strlen(optarg) == 0) {
+          die_usage(prog_name);
+        }
+        watch_path = optarg;
+        break;
+      case 'g':
+        if (strcmp(optarg, "uniform") == 0) {
+          generator = GENERATOR_UNIFORM;
+        } else if (strcmp(optarg, "clustered") == 0) {
+          generator = GENERATOR_CLUSTERED;
+        } else if (strcmp(optarg, "disk") == 0) {
+          generator = GENERATOR_DISK;
+        } else if (strcmp(optarg, "plummer") == 0) {
+          generator = GENERATOR_PLUMMER;
+        } else {
+          die_usage(prog_name);
+        }
+        generated = 1;
+        break;
+      case 'n':
+        initial_count = strtoul(optarg, &endptr, 10);
+        if (*endptr || strchr(optarg, '-') || initial_count == 0) {
+          fputs("The number of planets must be a positive number.\n", stderr);
+          die_usage(prog_name);
+        }
+        generated = 1;
+        break;
+      case 'l':
+        if (load_path != NULL || strlen(optarg) == 0) {
+          die_usage(prog_name);
+        }
+        load_path = optarg;
+        break;
+      case 'w':
+        if (save_path != NULL || strlen(optarg) == 0) {
+          die_usage(prog_name);
+        }
+        save_path = optarg;
+        break;
+      case 'v':
+        if (sscanf(optarg, "%lf,%lf,%lf%c", &camera.x, &camera.y, &camera.zoom, &trailing) != 3 ||
+            camera.zoom < 1.0 || camera.zoom > CAMERA_ZOOM_MAX) {
+          fprintf(stderr, "The view must be <x>,<y>,<zoom>, with a zoom from 1 to %g.\n", CAMERA_ZOOM_MAX);
+          die_usage(prog_name);
+        }
+        break;
+      case 'R':
+        seed = strtoul(optarg, &endptr, 10);
+        if (*endptr || strchr(optarg, '-') || !*optarg || seed > UINT_MAX) {
+          fputs("The seed must be a number from 0 to 4294967295.\n", stderr);
+          die_usage(prog_name);
+        }
+        seeded = 1;
+        break;
+      case 'K':
+        if (hash_path != NULL || strlen(optarg) == 0) {
+          die_usage(prog_name);
+        }
+        hash_path = optarg;
+        break;
+      case 'k':
+        if (compare_path != NULL || strlen(optarg) == 0) {
+          die_usage(prog_name);
+        }
+        compare_path = optarg;
+        break;
+      case 'O':
+        open_margin = strtod(optarg, &endptr);
+        if (*endptr || open_margin < 0.0) {
+          fputs("The margin must be a number, 0 or more.\n", stderr);
+          die_usage(prog_name);
+        }
+        open_world = 1;
+        break;
+      case 'c':
+        force_cutoff = strtod(optarg, &endptr);
+        if (*endptr || force_cutoff < 2.0 * radius_for_mass(MASS_MAX)) {
+          fprintf(stderr, "The cutoff must be a number no smaller than %g.\n", 2.0 * radius_for_mass(MASS_MAX));
+          die_usage(prog_name);
+        }
+        break;
+      case 'C':
+        if (strcmp(optarg, "swept") == 0) {
+          swept_collisions = 1;
+        } else if (strcmp(optarg, "overlap") != 0) {
+          die_usage(prog_name);
+        }
+        break;
+      case 'f':
+        single_precision = 1;
+        break;
+      case 'x':
+        fixed_point = 1;
+        break;
+      case 'V':
+        validate_frames = parse_frames(optarg);
+        if (validate_frames == 0) {
+          die_usage(prog_name);
+        }
+        break;
+      case 'r':
+        rank_count = strtol(optarg, &endptr, 10);
+        if (*endptr || rank_count < 1 || rank_count > RANK_COUNT_MAX) {
+          fprintf(stderr, "The number of ranks must be from 1 to %d.\n", RANK_COUNT_MAX);
+          die_usage(prog_name);
+        }
+        break;
+      case 'e':
+        member_count = strtol(optarg, &endptr, 10);
+        if (*endptr || member_count < 1) {
+          fputs("The number of ensemble members must be a positive number.\n", stderr);
+          die_usage(prog_name);
+        }
+        break;
+      case 'F':
+        adaptive_load = 0;
+        break;
+      case 'j':
+        worker_count_option = strtol(optarg, &endptr, 10);
+        if (*endptr || worker_count_option < 0) {
+          fputs("The number of worker threads must be a number, 0 or more.\n", stderr);
+          die_usage(prog_name);
+        }
+        break;
+      case 'A':
+        if (strcmp(optarg, "compact") == 0) {
+          affinity = AFFINITY_COMPACT;
+        } else if (strcmp(optarg, "scatter") == 0) {
+          affinity = AFFINITY_SCATTER;
+        } else {
+          die_usage(prog_name);
+        }
+        break;
+      case 'M':
+        main_helps = 1;
+        break;
+      case 'N':
+        partitioned = 1;
+        break;
+      case 'z':
+        reorder_interval = strtoul(optarg, &endptr, 10);
+        if (*endptr || strchr(optarg, '-') || reorder_interval == 0) {
+          fputs("The reorder interval must be a positive number of ticks.\n", stderr);
+          die_usage(prog_name);
+        }
+        break;
+      case 'b':
+        benchmark_frames = parse_frames(optarg);
+        if (benchmark_frames == 0) {
+          die_usage(prog_name);
+        }
+        break;
+      case 'G':
+        near_width = strtod(optarg, &endptr);
+        if (*endptr || near_width < 2.0 * radius_for_mass(MASS_MAX)) {
+          fprintf(stderr, "The near width must be a number no smaller than %g.\n", 2.0 * radius_for_mass(MASS_MAX));
+          die_usage(prog_name);
+        }
+        break;
+      default:
+        die_usage(prog_name);
+    }
+  }
+
+  if (member_count > 0) {
+    if (!anim.frame_count || anim.dir || stats_path || hud_visible || validate_frames || rank_count > 1) {
+      fputs("-e needs -t, and can't be combined with -d, -H, -s, -V or -r.\n", stderr);
+      die_usage(prog_name);
+    }
+  } else if ((anim.frame_count > 0) ^ (anim.dir != NULL)) {
+    fputs("-t and -d must be provided together.\n", stderr);
+    die_usage(prog_name);
+  }
+
+  argv += optind;
+  argc -= optind;
+
+  if (compare_path) {
+    /* The other log is the one argument. */
+    if (argc != 1) {
+      die_usage(prog_name);
+    }
+    return run_hash_compare(compare_path, argv[0]) == 0 ? 0 : 1;
+  }
+
+  if (argc != 0) {
+    die_usage(prog_name);
+    return 1;
+  }
+
+  if (watch_path) {
+    return run_telemetry_client(watch_path) == 0 ? 0 : 1;
+  }
+
+  if (convert_dir) {
+    return convert_QOI_frames(convert_dir) == 0 ? 0 : 1;
+  }
+
+  if (load_path && generated) {
+    fputs("-l can't be combined with -g or -n.\n", stderr);
+    die_usage(prog_name);
+  }
+
+  if (telemetry_path && (member_count > 0 || validate_frames || benchmark_frames)) {
+    fputs("-S can't be combined with -e, -V or -b.\n", stderr);
+    die_usage(prog_name);
+  }
+
+  if (energy_drift_limit > 0.0 && !energy_interval) {
+    fputs("-X needs -E.\n", stderr);
+    die_usage(prog_name);
+  }
+
+  if (energy_interval && (member_count > 0 || validate_frames || benchmark_frames || rank_count > 1)) {
+    fputs("-E can't be combined with -e, -V, -b or -r.\n", stderr);
+    die_usage(prog_name);
+  }
+
+  if (force_cutoff > 0.0 && (single_precision || fixed_point || validate_frames)) {
+    fputs("-c can't be combined with -f, -x or -V.\n", stderr);
+    die_usage(prog_name);
+  }
+
+  if (fixed_point && (single_precision || validate_frames || open_world)) {
+    fputs("-x can't be combined with -f, -V or -O.\n", stderr);
+    die_usage(prog_name);
+  }
+
+  if (worker_count_option == 0 && !main_helps) {
+    fputs("-j 0 needs -M, or nothing would calculate the forces.\n", stderr);
+    die_usage(prog_name);
+  }
+
+  if (benchmark_frames && (member_count > 0 || validate_frames || rank_count > 1 || anim.dir)) {
+    fputs("-b can't be combined with -d, -e, -V or -r.\n", stderr);
+    die_usage(prog_name);
+  }
+
+  if (rank_count > 1 && (force_cutoff > 0.0 || swept_collisions || single_precision || fixed_point)) {
+    fputs("-r can't be combined with -c, -C swept, -f or -x.\n", stderr);
+    die_usage(prog_name);
+  }
+
+  if (open_world && (rank_count > 1 || energy_interval)) {
+    fputs("-O can't be combined with -r or -E.\n", stderr);
+    die_usage(prog_name);
+  }
+
+  if (hash_path && (member_count > 0 || validate_frames || benchmark_frames || rank_count > 1)) {
+    fputs("-K can't be combined with -e, -V, -b or -r.\n", stderr);
+    die_usage(prog_name);
+  }
+
+  if (publish_name && (anim.dir || hud_visible || member_count > 0 || validate_frames || benchmark_frames)) {
+    fputs("-P has no window, so it can't be combined with -d, -H, -e, -V or -b.\n", stderr);
+    die_usage(prog_name);
+  }
+
+  camera_limit();
+
+  rand_seed = seeded ? (unsigned) seed : (unsigned) time(NULL);
+
+  if (hash_path) {
+    /* How many ticks make a frame can't depend on how fast the run is. */
+    adaptive_load = 0;
+    if (state_hash_open(hash_path, rand_seed) < 0) {
+      return 1;
+    }
+    atexit(state_hash_close);
+  }
+
+  init_tables();
+  if (check_tables() < 0) {
+    return 1;
+  }
+
+  if (view_name) {
+    return run_viewer(view_name) == 0 ? 0 : 1;
+  }
+
+  if (affinity != AFFINITY_NONE) {
+    build_cpu_order(affinity == AFFINITY_SCATTER);
+  }
+
+  if (load_path) {
+    if (scenario_load(load_path) < 0) {
+      return 1;
+    }
+  }
+
+  if (save_path) {
+    return scenario_save(save_path) == 0 ? 0 : 1;
+  }
+
+  if (stats_path) {
+    if (stats_open_log(stats_path) < 0) {
+      return 1;
+    }
+    atexit(stats_close_log);
+  }
+
+  if (trace_path) {
+    if (trace_open() < 0) {
+      return 1;
+    }
+  }
+
+  if (validate_frames && rank_count == 1) {
+    return run_validation(validate_frames) == 0 ? 0 : 1;
+  }
+
+  if (benchmark_frames) {
+    return run_benchmark(benchmark_frames) == 0 ? 0 : 1;
+  }
+
+  if (member_count > 0) {
+    if (run_ensemble(member_count, anim.frame_count) < 0) {
+      return 1;
+    }
+    if (trace_path) {
+      return trace_write(trace_path) == 0 ? 0 : 1;
+    }
+    return 0;
+  }
+
+  if (rank_count > 1) {
+    /* The other ranks are started before SDL and any threads, and never
+       return from here. */
+    if (start_ranks(&dist, (int) rank_count, near_width) < 0) {
+      return 1;
+    }
+    if (dist.transport->rank != 0) {
+      _exit(run_rank(&dist) == 0 ? 0 : 1);
+    }
+    if (validate_frames) {
+      status = run_dist_validation(&dist, validate_frames);
+      stop_ranks(&dist);
+      return status == 0 ? 0 : 1;
+    }
+  }
+
+  if (publish_name) {
+    /* With no window to close, the run ends on a signal. */
+    signal(SIGINT, handle_quit_signal);
+    signal(SIGTERM, handle_quit_signal);
+    if (snapshot_start(publish_name, scenario.records && scenario.count > PLANET_COUNT_MAX ? scenario.count :
+                                     initial_count > PLANET_COUNT_MAX ? initial_count : PLANET_COUNT_MAX) < 0) {
+      return 1;
+    }
+  } else {
+    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+      fprintf(stderr, "SDL_Init() failed: %s\n", SDL_GetError());
+      return 1;
+    }
+
+    atexit(SDL_Quit);
+
+    SDL_ShowCursor(SDL_DISABLE);
+
+    if (initialize_display() < 0) {
+      return 1;
+    }
+  }
+
+  if (anim.dir) {
+    if (prepare_anim_dir(anim) < 0) {
+      return 1;
+    }
+  }
+
+  if (telemetry_path) {
+    if (telemetry_start(telemetry_path) < 0) {
+      return 1;
+    }
+  }
+
+  status = run_simulation(anim, rank_count > 1 ? &dist : NULL);
+  if (rank_count > 1) {
+    stop_ranks(&dist);
+  }
+  if (telemetry_path) {
+    telemetry_stop();
+  }
+  if (publish_name) {
+    snapshot_stop();
+  }
+  if (status != 0) {
+    return 1;
+  }
+
+  if (trace_path) {
+    if (trace_write(trace_path) < 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+void die_usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-d <anim_dir> -t <anim_duration> [-o png|qoi]] [-H] [-s <stats_file>] [-T <trace_file>] [-c <cutoff>] [-C overlap|swept] [-f|-x] [-z <ticks>] [-F]\n"
+                  "       [-j <workers>] [-A compact|scatter] [-M] [-N] [-r <ranks> [-G <width>]] [-S <socket>]\n"
+                  "       [-g <generator>] [-n <planets>] [-l <scenario>] [-v <x>,<y>,<zoom>] [-D] [-E <ticks> [-X <drift>]] [-O <margin>]\n"
+                  "       [-R <seed>] [-K <log>] [-P <name>]\n", prog);
+  fprintf(stderr, "       %s -V <duration> [-C overlap|swept] [-O <margin>]\n", prog);
+  fprintf(stderr, "       %s -V <duration> -r <ranks> [-G <width>]\n", prog);
+  fprintf(stderr, "       %s -b <duration> [-z <ticks>] [-c <cutoff>] [-C overlap|swept] [-f|-x] [-j <workers>] [-A compact|scatter] [-M] [-N] [-O <margin>]\n", prog);
+  fprintf(stderr, "       %s -e <members> -t <duration> [-T <trace_file>] [-c <cutoff>] [-C overlap|swept] [-f|-x] [-O <margin>]\n", prog);
+  fprintf(stderr, "       %s -W <socket>\n", prog);
+  fprintf(stderr, "       %s -p <name> [-v <x>,<y>,<zoom>] [-D]\n", prog);
+  fprintf(stderr, "       %s -q <anim_dir>\n", prog);
+  fprintf(stderr, "       %s -w <scenario> [-g <generator>] [-n <planets>] [-l <scenario>] [-R <seed>]\n", prog);
+  fprintf(stderr, "       %s -k <log> <log>\n", prog);
+  fprintf(stderr, "\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -d <anim_dir>    Directory to save animation frames in.  It must not already exist.\n");
+  fprintf(stderr, "  -t <num>[s|m|h]  Duration of animation.  Units are s=seconds, m=minutes, h=hours, or <omitted>=frames.\n");
+  fprintf(stderr, "  -o <format>      Save frames as \"png\" (the default) or \"qoi\", which is lossless too,\n");
+  fprintf(stderr, "                   encoded on every CPU at once, and many times faster.\n");
+  fprintf(stderr, "  -q <anim_dir>    Write a PNG next to every QOI frame in the directory, and exit.\n");
+  fprintf(stderr, "  -H               Show the per-phase timing overlay.  It can also be toggled with the H key.\n");
+  fprintf(stderr, "  -s <stats_file>  Log per-phase timing statistics once a second.  The log is JSON lines if\n");
+  fprintf(stderr, "                   the name ends in .json, and CSV otherwise.\n");
+  fprintf(stderr, "  -T <trace_file>  Record what every thread is doing and write it as Chrome trace JSON on exit.\n");
+  fprintf(stderr, "                   Open it in chrome://tracing or ui.perfetto.dev.\n");
+  fprintf(stderr, "  -S <socket>      Serve live progress on this Unix socket:  every connection gets one JSON\n");
+  fprintf(stderr, "                   line with the tick, frame, bodies, mass, momentum, phase timings and export rate.\n");
+  fprintf(stderr, "  -W <socket>      Poll a run started with -S once a second, printing each line, until it ends.\n");
+  fprintf(stderr, "  -P <name>        Run without a window, and publish every frame to this POSIX shared memory\n");
+  fprintf(stderr, "                   for -p viewers to show.  Stop the run with Ctrl-C.\n");
+  fprintf(stderr, "  -p <name>        Show what a -P run is publishing, until it ends.  -v, -D and the view\n");
+  fprintf(stderr, "                   keys work as in a run of its own; any number of viewers can watch at once.\n");
+  fprintf(stderr, "  -g <generator>   How the planets start out:  \"uniform\" (the default) scatters them evenly,\n");
+  fprintf(stderr, "                   \"clustered\" in Gaussian blobs, \"disk\" in a rotating disk, and \"plummer\"\n");
+  fprintf(stderr, "                   in %d Plummer-sphere clumps.\n", GENERATOR_CENTER_COUNT);
+  fprintf(stderr, "  -n <planets>     How many planets to start with, sharing the same total mass.  (Default %d.)\n", PLANET_COUNT_INITIAL);
+  fprintf(stderr, "                   Past a few thousand, -c keeps the force pass from checking every pair.\n");
+  fprintf(stderr, "  -l <scenario>    Start from the planets in a scenario file made by -w.\n");
+  fprintf(stderr, "  -w <scenario>    Write the starting planets to a scenario file and exit.\n");
+  fprintf(stderr, "  -v <x>,<y>,<zoom>  Start the view centered on world position x,y and zoomed in this many\n");
+  fprintf(stderr, "                   times, up to %g.  The world is %g by %g.  In the window, the arrow keys\n", CAMERA_ZOOM_MAX, WORLD_WIDTH, WORLD_HEIGHT);
+  fprintf(stderr, "                   and dragging pan, + and - and the wheel zoom, and 0 or Home resets.\n");
+  fprintf(stderr, "  -D               Draw how much mass is under each pixel, and its average color, instead of\n");
+  fprintf(stderr, "                   every planet as a circle.  Much faster for a million planets.  The D key toggles it.\n");
+  fprintf(stderr, "  -E <ticks>       Every this many ticks, print a CSV line of the total kinetic and potential\n");
+  fprintf(stderr, "                   energy, momentum and mass, and how far each has drifted.  Merging loses\n");
+  fprintf(stderr, "                   energy and splitting adds it, so what they've changed is kept as its own\n");
+  fprintf(stderr, "                   total, printed as collision_energy, and left out of the energy drift.\n");
+  fprintf(stderr, "                   The energy is only marked again, with rebased set, when far gravity is\n");
+  fprintf(stderr, "                   cut off or brought back for a late frame (see -F), which changes the potential.\n");
+  fprintf(stderr, "  -X <drift>       With -E, stop with an error once the energy, momentum or mass drifts\n");
+  fprintf(stderr, "                   by more than this fraction.\n");
+  fprintf(stderr, "  -O <margin>      Make the world open:  nothing wraps around its edges, and planets that\n");
+  fprintf(stderr, "                   get further than this outside it are removed.\n");
+  fprintf(stderr, "  -R <seed>        Start the random number generator from this seed, instead of the time,\n");
+  fprintf(stderr, "                   so the same options make the same world.\n");
+  fprintf(stderr, "  -K <log>         After every tick, write a hash of each planet's position, velocity, mass\n");
+  fprintf(stderr, "                   and hue to this file, 16 bytes a planet, and of the whole world.  Implies -F.\n");
+  fprintf(stderr, "                   Runs with the same -R and physics log the same whatever -j and -M are,\n");
+  fprintf(stderr, "                   and -N too unless -c is on, as moving the planets rebuilds the neighbor lists.\n");
+  fprintf(stderr, "  -k <log> <log>   Compare two -K logs, and print the first tick and planet where they\n");
+  fprintf(stderr, "                   differ.  Exits with 0 only if they're the same.\n");
+  fprintf(stderr, "  -c <cutoff>      Ignore gravity between planets further apart than this, and find nearby\n");
+  fprintf(stderr, "                   planets with neighbor lists instead of checking every pair.\n");
+  fprintf(stderr, "  -C <method>      How collisions are found.  \"overlap\" (the default) merges planets that\n");
+  fprintf(stderr, "                   overlap at the start of a tick.  \"swept\" finds when during the tick each\n");
+  fprintf(stderr, "                   pair first touches and merges them in that order, so nothing tunnels.\n");
+  fprintf(stderr, "  -f               Keep positions and velocities in single precision and do the pairwise\n");
+  fprintf(stderr, "                   force math in floats, still summing each planet's forces in doubles.\n");
+  fprintf(stderr, "  -x               Keep positions on a 32-bit fixed-point grid spanning the world, so the\n");
+  fprintf(stderr, "                   pairwise force pass finds the nearest wrapped copy of each planet with one\n");
+  fprintf(stderr, "                   integer subtraction.\n");
+  fprintf(stderr, "  -V <duration>    Run the same world in double and single precision side by side, without\n");
+  fprintf(stderr, "                   a window, and print how far their trajectories and momentum drift apart.\n");
+  fprintf(stderr, "                   With -r, compare the world split across the ranks with it in one process\n");
+  fprintf(stderr, "                   instead.  With -G at least the world's width, every rank sees every planet\n");
+  fprintf(stderr, "                   exactly, and the two should agree to rounding until a planet splits.\n");
+  fprintf(stderr, "  -r <ranks>       Split the world into this many slabs, each simulated by its own process.\n");
+  fprintf(stderr, "  -G <width>       With -r, how far past its slab a process sees other planets exactly.\n");
+  fprintf(stderr, "                   Beyond that, it only sees their total mass per grid cell.  (Default %g.)\n", DIST_NEAR_WIDTH_DEFAULT);
+  fprintf(stderr, "  -F               Keep the full simulation and drawing load even when frames run late.\n");
+  fprintf(stderr, "                   Otherwise, when frames are nearly over budget, fewer and longer ticks\n");
+  fprintf(stderr, "                   are simulated, circles are drawn coarser and, last, far gravity is cut off.\n");
+  fprintf(stderr, "  -j <workers>     Number of worker threads for the force and collision passes.  (Default: one per CPU, or one\n");
+  fprintf(stderr, "                   fewer with -M.)\n");
+  fprintf(stderr, "  -A <placement>   Pin the main thread and then the workers to CPUs.  \"compact\" fills one\n");
+  fprintf(stderr, "                   socket before the next; \"scatter\" takes a CPU from each socket in turn.\n");
+  fprintf(stderr, "  -M               Have the main thread calculate forces alongside the workers.\n");
+  fprintf(stderr, "  -N               Give each worker a fixed slice of the planets, and have it copy them into\n");
+  fprintf(stderr, "                   memory it touched first, so they live on its own NUMA node.\n");
+  fprintf(stderr, "  -z <ticks>       Every this many ticks, sort the planets in memory by their position along\n");
+  fprintf(stderr, "                   a Z-order curve, so planets near each other are near each other in memory.\n");
+  fprintf(stderr, "  -b <duration>    Without a window, run the same world without and then with -z reordering\n");
+  fprintf(stderr, "                   (every %d ticks if -z isn't given), and print the time and cache misses per tick.\n", REORDER_INTERVAL_BENCHMARK);
+  fprintf(stderr, "  -e <members>     Run this many independent worlds for the -t duration, without a window,\n");
+  fprintf(stderr, "                   one per thread at a time, and print a CSV line of final masses for each.\n");
+  fprintf(stderr, "\n");
+  fprintf(stderr, "If either -d or -t is given, then the other must be provided as well, except with -e.\n");
+  fprintf(stderr, "If neither option is provided, then no animation frames are saved.\n");
+
+  exit(1);
+}
+
+
+size_t parse_frames(char *spec) {
+  char unit;
+  size_t factor = 1;
+  size_t count;
+  char *endptr;
+
+  if (strlen(spec) == 0) {
+    return 0;
+  }
+
+  unit = spec[strlen(spec) - 1];
+  if (unit == 'h') {
+    factor *= 60;
+    unit = 'm';
+  }
+  if (unit == 'm') {
+    factor *= 60;
+    unit = 's';
+  }
+  if (unit == 's') {
+    factor *= FRAMES_PER_SECOND;
+  }
+
   if (factor > 1) {
     spec[strlen(spec) - 1] = '\0';
   }
 
-  count = strtoul(spec, &endptr, 10);
-  if (*endptr || strchr(spec, '-')) {
-    return 0;
+  count = strtoul(spec, &endptr, 10);
+  if (*endptr || strchr(spec, '-')) {
+    return 0;
+  }
+  if (errno == ERANGE || (size_t) count != count) {
+    fprintf(stderr, "Tick count %s too large!\n", spec);
+    return 0;
+  }
+  if ((count * factor) / factor != count) {
+    fprintf(stderr, "Tick count too large!\n");
+    return 0;
+  }
+  return count * factor;
+}
+
+
+int prepare_anim_dir(anim_spec_t anim) {
+  int err;
+
+  if (file_exists(anim.dir)) {
+    fprintf(stderr, "%s already exists.\n", anim.dir);
+    return -1;
+  }
+
+  if ((err = mkdir(anim.dir, 0777)) != 0) {
+    fprintf(stderr, "Couldn't create directory %s: ", anim.dir);
+    perror(NULL);
+    return -1;
+  }
+  return 0;
+}
+
+
+int file_exists(const char *path) {
+  struct stat buf;
+  return stat(path, &buf) == 0;
+}
+
+
+int run_simulation(anim_spec_t anim, dist_t *dist) {
+  /* In a distributed run this is rank 0, which shows and saves the whole
+     world as well as simulating its own slab. */
+  pacing_t pacing;
+  SDL_Event event;
+  size_t i;
+  planets_config_t config;
+  planets_context_t *context;
+  thread_arg_t *thread_arg;
+  size_t anim_frame = 1;
+  planet_list_t *planets;
+  planet_list_t all_planets;
+  planet_list_t *shown;
+  size_t body_count;
+  double start;
+  double frame_start;
+  size_t tick;
+
+  config_from_options(&config);
+  context = context_new(initial_count, generator, rand_seed, next_planet_id, planet_id_stride, &config);
+  if (!context) {
+    return -1;
+  }
+  /* The window and the frames are drawn on the context's workers too. */
+  thread_arg = &context->thread_arg;
+  planets = &context->planets;
+  shown = planets;
+
+  if (dist) {
+    /* Hands the planets out to the ranks whose slabs they're in. */
+    distributed_exchange(dist, planets, 0);
+    context->dist = dist;
+    shown = &all_planets;
+  }
+
+  pacing_init(&pacing);
+
+  for (tick = 0;  !quitting;  ) {
+    frame_start = trace_begin();
+
+    if (dist) {
+      distributed_gather(dist, planets, &all_planets);
+    }
+
+    if (!headless) {
+      start = phase_begin();
+      display_planets(shown, thread_arg);
+      phase_end(PHASE_RENDER, start);
+    }
+    body_count = shown->size;
+
+    if (anim.dir) {
+      if (write_anim_frame(anim, anim_frame, thread_arg) == -1) {
+        quitting = 1;
+      }
+      ++anim_frame;
+      if (anim_frame > anim.frame_count) {
+        quitting = 1;
+      }
+    }
+
+    if (telemetry.path) {
+      telemetry_publish(tick, anim.dir ? anim_frame - 1 : frame_stats.frame, anim.frame_count, shown);
+    }
+
+    if (snapshot_ring.header) {
+      snapshot_publish(tick, shown);
+    }
+
+    if (dist) {
+      distributed_send_continue(dist, !quitting);
+      delete_planets(&all_planets);
+      list_delete(&all_planets);
+    }
+    if (quitting) {
+      break;
+    }
+
+    if (state_hash.log) {
+      /* The log gets every tick's hash. */
+      for (i = 0;  i < ticks_per_frame;  ++i) {
+        tick = planets_step(context, 1);
+        if (state_hash_record(tick - 1, planets) < 0) {
+          quitting = 1;
+        }
+      }
+    } else {
+      tick = planets_step(context, ticks_per_frame);
+    }
+
+    while (!headless && SDL_PollEvent(&event)) {
+      handle_sdl_event(&event);
+    }
+
+    if (!anim.dir) {
+      /* Every other rank ticks in step with us, so only a run in one
+         process can change how many ticks make a frame. */
+      if (adaptive_load && !dist) {
+        pacing_adapt(&pacing, context);
+      }
+      start = phase_begin();
+      pacing_wait(&pacing);
+      phase_end(PHASE_WAIT, start);
+    }
+
+    trace_end("frame", frame_start, anim_frame - 1);
+
+    if (stats_enabled) {
+      stats_end_frame(tick, body_count);
+    }
+  }
+
+  if (!anim.dir) {
+    pacing_report(&pacing);
+  }
+  energy_monitor_report();
+  if (open_world) {
+    fprintf(stderr, "%lu planets left the world.\n", escaped_count);
+  }
+
+  if (thread_arg->neighbors) {
+    neighbor_list_report(thread_arg->neighbors);
+  }
+  planets_delete(context);
+
+  return energy_monitor.tripped ? -1 : 0;
+}
+#endif
+
+
+int run_rank(dist_t *dist) {
+  /* The main loop of every rank but 0, which runs without a window. */
+  pthread_list_t threads;
+  thread_arg_t thread_arg;
+  planet_list_t planets;
+  size_t i;
+
+  list_init(&planets);
+
+  thread_arg_init(&thread_arg, &planets);
+  config_from_options(&thread_arg.config);
+  physics = &thread_arg.config;
+  if (start_threads(&threads, &thread_arg) < 0) {
+    return -1;
+  }
+
+  distributed_exchange(dist, &planets, 0);
+
+  for (thread_arg.tick = 0;  ;  ) {
+    /* Rank 0 going away between frames means the run is over too. */
+    if (distributed_gather(dist, &planets, NULL) < 0 || !distributed_recv_continue(dist)) {
+      break;
+    }
+
+    for (i = 0;  i < TICKS_PER_FRAME;  ++i) {
+      distributed_tick(dist, &thread_arg);
+      ++thread_arg.tick;
+    }
+  }
+
+  stop_threads(&threads, &thread_arg);
+  delete_planets(&planets);
+  list_delete(&planets);
+
+  return 0;
+}
+
+
+int run_dist_validation(dist_t *dist, size_t frame_count) {
+  /* Rank 0's side of -V with -r:  runs the world split across the ranks
+     and a copy of it in this process alone, in lockstep, and compares the
+     whole distributed world with the copy after every frame.  The ranks
+     number planets made by splits differently and draw different random
+     numbers, so the planets are matched up by position rather than id. */
+  planet_list_t planets;
+  planet_list_t reference;
+  planet_list_t all;
+  thread_arg_t thread_arg;
+  thread_arg_t reference_arg;
+  unsigned seed, reference_seed;
+  size_t next_id, reference_next_id;
+  size_t id_stride;
+  size_t frame;
+  size_t diverged = 0;
+  size_t i;
+
+  initialize_planets(&planets, initial_count, generator);
+  list_copy(&reference, &planets);
+
+  thread_arg_init(&thread_arg, &planets);
+  thread_arg_init(&reference_arg, &reference);
+  config_from_options(&thread_arg.config);
+  reference_arg.config = thread_arg.config;
+  physics = &thread_arg.config;
+  thread_arg.tick = reference_arg.tick = 0;
+  reference_seed = rand_seed;
+  reference_next_id = next_planet_id;
+  id_stride = planet_id_stride;
+
+  distributed_exchange(dist, &planets, 0);
+
+  printf("frame,bodies_single,bodies_distributed,position_rms_error,position_max_error,"
+         "x_momentum_single,y_momentum_single,x_momentum_distributed,y_momentum_distributed,momentum_relative_error\n");
+
+  for (frame = 0;  ;  ++frame) {
+    distributed_gather(dist, &planets, &all);
+    if (frame > 0) {
+      sort_planet_list(&reference, compare_planet_positions);
+      sort_planet_list(&all, compare_planet_positions);
+      if (!compare_runs(frame, &reference, &all) && !diverged) {
+        diverged = frame;
+      }
+    }
+    distributed_send_continue(dist, frame < frame_count);
+    delete_planets(&all);
+    list_delete(&all);
+    if (frame == frame_count) {
+      break;
+    }
+
+    for (i = 0;  i < TICKS_PER_FRAME;  ++i) {
+      distributed_tick(dist, &thread_arg);
+      ++thread_arg.tick;
+    }
+
+    seed = rand_seed;
+    next_id = next_planet_id;
+    rand_seed = reference_seed;
+    next_planet_id = reference_next_id;
+    for (i = 0;  i < TICKS_PER_FRAME;  ++i) {
+      tick_planets(&reference_arg);
+      ++reference_arg.tick;
+    }
+    reference_seed = rand_seed;
+    reference_next_id = next_planet_id;
+    rand_seed = seed;
+    next_planet_id = next_id;
+    planet_id_stride = id_stride;
+  }
+
+  if (diverged) {
+    fprintf(stderr, "The runs stopped having the same planets at frame %lu.\n", diverged);
+  } else {
+    fprintf(stderr, "The runs had the same planets for all %lu frames.\n", frame_count);
+  }
+
+  task_deques_delete(&thread_arg);
+  candidate_buffers_delete(&thread_arg);
+  task_deques_delete(&reference_arg);
+  candidate_buffers_delete(&reference_arg);
+  delete_planets(&planets);
+  list_delete(&planets);
+  delete_planets(&reference);
+  list_delete(&reference);
+
+  return 0;
+}
+
+
+int run_validation(size_t frame_count) {
+  /* Runs a double and a single precision copy of the same world in lockstep,
+     each with its own random numbers starting from the same seed, so as long
+     as they make the same collisions they stay comparable planet by planet. */
+  planet_list_t planets[2];
+  thread_arg_t thread_args[2];
+  unsigned seeds[2];
+  size_t frame;
+  size_t diverged = 0;
+  size_t run;
+  size_t i;
+
+  initialize_planets(&planets[0], initial_count, generator);
+  list_copy(&planets[1], &planets[0]);
+  round_to_float(&planets[1]);
+
+  for (run = 0;  run < 2;  ++run) {
+    thread_arg_init(&thread_args[run], &planets[run]);
+    config_from_options(&thread_args[run].config);
+    thread_args[run].config.single_precision = run == 1;
+    thread_args[run].single_precision = run == 1;
+    thread_args[run].tick = 0;
+    seeds[run] = rand_seed;
+  }
+
+  printf("frame,bodies_double,bodies_float,position_rms_error,position_max_error,"
+         "x_momentum_double,y_momentum_double,x_momentum_float,y_momentum_float,momentum_relative_error\n");
+
+  for (frame = 1;  frame <= frame_count;  ++frame) {
+    for (run = 0;  run < 2;  ++run) {
+      rand_seed = seeds[run];
+      physics = &thread_args[run].config;
+      for (i = 0;  i < TICKS_PER_FRAME;  ++i) {
+        tick_planets(&thread_args[run]);
+        ++thread_args[run].tick;
+      }
+      seeds[run] = rand_seed;
+    }
+
+    if (!compare_runs(frame, &planets[0], &planets[1]) && !diverged) {
+      diverged = frame;
+    }
+  }
+
+  if (diverged) {
+    fprintf(stderr, "The runs stopped having the same collisions at frame %lu.\n", diverged);
+  } else {
+    fprintf(stderr, "The runs had the same collisions for all %lu frames.\n", frame_count);
+  }
+
+  for (run = 0;  run < 2;  ++run) {
+    float_bodies_delete(&thread_args[run].floats);
+    task_deques_delete(&thread_args[run]);
+    candidate_buffers_delete(&thread_args[run]);
+    delete_planets(&planets[run]);
+    list_delete(&planets[run]);
+  }
+
+  return 0;
+}
+
+
+PLANETS_API void planets_config_default(planets_config_t *config) {
+  config->force_cutoff = 0.0;
+  config->swept_collisions = 0;
+  config->open_world = 0;
+  config->open_margin = 0.0;
+  config->reorder_interval = 0;
+  config->ticks_per_frame = TICKS_PER_FRAME;
+  config->single_precision = 0;
+  config->fixed_point = 0;
+  config->worker_count = 0;
+  config->main_helps = 0;
+  config->partitioned = 0;
+}
+
+
+PLANETS_API planets_context_t *planets_new(size_t count, int generator, unsigned seed) {
+  planets_config_t config;
+
+  planets_config_default(&config);
+  return planets_new_with_config(count, generator, seed, &config);
+}
+
+
+PLANETS_API planets_context_t *planets_new_with_config(size_t count, int generator, unsigned seed,
+                                                       const planets_config_t *config) {
+  if (!count) {
+    return NULL;
+  }
+  return context_new(count, generator, seed, 0, 1, config);
+}
+
+
+planets_context_t *context_new(size_t count, int generator, unsigned seed, size_t first_id, size_t id_stride,
+                               const planets_config_t *config) {
+  /* The program makes its worlds here, so that a distributed run's first
+     rank can number its planets as every rank does, and a scenario with no
+     planets still runs. */
+  static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+  planets_context_t *context;
+  unsigned saved_seed;
+  size_t saved_id;
+  size_t saved_stride;
+
+  if (generator < PLANETS_GENERATOR_UNIFORM || generator > PLANETS_GENERATOR_PLUMMER) {
+    return NULL;
+  }
+
+  pthread_once(&tables_once, init_tables);
+
+  if (!config_valid(config)) {
+    return NULL;
+  }
+
+  context = my_malloc(sizeof(*context));
+
+  saved_seed = rand_seed;
+  saved_id = next_planet_id;
+  saved_stride = planet_id_stride;
+  rand_seed = seed;
+  next_planet_id = first_id;
+  planet_id_stride = id_stride;
+
+  initialize_planets(&context->planets, count, (generator_t) generator);
+
+  context->seed = rand_seed;
+  context->next_id = next_planet_id;
+  context->id_stride = id_stride;
+  rand_seed = saved_seed;
+  next_planet_id = saved_id;
+  planet_id_stride = saved_stride;
+
+  thread_arg_init(&context->thread_arg, &context->planets);
+  context->thread_arg.config = *config;
+  context->thread_arg.single_precision = config->single_precision;
+  context->thread_arg.fixed_point = config->fixed_point;
+  if (config->force_cutoff > 0.0) {
+    neighbor_list_init(&context->neighbors);
+    context->thread_arg.neighbors = &context->neighbors;
+  }
+  context->thread_arg.tick = 0;
+  context->dist = NULL;
+
+  context->bodies = NULL;
+  context->body_count = 0;
+  context->body_capacity = 0;
+  context->bodies_stale = 1;
+
+  context->threads.array = NULL;
+  context->threads.size = 0;
+  if ((config->worker_count || config->main_helps) && start_threads(&context->threads, &context->thread_arg) < 0) {
+    planets_delete(context);
+    return NULL;
+  }
+
+  return context;
+}
+
+
+PLANETS_API void planets_delete(planets_context_t *context) {
+  if (!context) {
+    return;
+  }
+
+  if (context->thread_arg.threaded) {
+    stop_threads(&context->threads, &context->thread_arg);
+  }
+  if (context->thread_arg.neighbors) {
+    neighbor_list_delete(context->thread_arg.neighbors);
+  }
+  float_bodies_delete(&context->thread_arg.floats);
+  fixed_bodies_delete(&context->thread_arg.fixed);
+  task_deques_delete(&context->thread_arg);
+  candidate_buffers_delete(&context->thread_arg);
+  pthread_mutex_destroy(&context->thread_arg.mutex);
+  pthread_cond_destroy(&context->thread_arg.cond);
+  delete_planets(&context->planets);
+  list_delete(&context->planets);
+  free(context->bodies);
+  free(context);
+}
+
+
+PLANETS_API int planets_configure(planets_context_t *context, const planets_config_t *config) {
+  const planets_config_t *old = &context->thread_arg.config;
+
+  if (!config_valid(config) ||
+      config->worker_count != old->worker_count || config->main_helps != old->main_helps ||
+      config->partitioned != old->partitioned ||
+      config->single_precision != old->single_precision || config->fixed_point != old->fixed_point) {
+    return -1;
+  }
+
+  /* Candidates found with the old lists, or without any, may be missing
+     pairs the new ones would have. */
+  if (config->force_cutoff != old->force_cutoff) {
+    if (old->force_cutoff > 0.0) {
+      neighbor_list_delete(&context->neighbors);
+      context->thread_arg.neighbors = NULL;
+    }
+    if (config->force_cutoff > 0.0) {
+      neighbor_list_init(&context->neighbors);
+      context->thread_arg.neighbors = &context->neighbors;
+    }
+    context->thread_arg.candidates_valid = 0;
+  }
+
+  context->thread_arg.config = *config;
+
+  return 0;
+}
+
+
+PLANETS_API size_t planets_step(planets_context_t *context, size_t ticks) {
+  const planets_config_t *saved_physics;
+  unsigned saved_seed;
+  size_t saved_id;
+  size_t saved_stride;
+  double tick_start;
+  size_t i;
+
+  saved_physics = physics;
+  saved_seed = rand_seed;
+  saved_id = next_planet_id;
+  saved_stride = planet_id_stride;
+  physics = &context->thread_arg.config;
+  rand_seed = context->seed;
+  next_planet_id = context->next_id;
+  planet_id_stride = context->id_stride;
+
+  for (i = 0;  i < ticks;  ++i) {
+    tick_start = trace_begin();
+    if (context->dist) {
+      distributed_tick(context->dist, &context->thread_arg);
+    } else {
+      tick_planets(&context->thread_arg);
+    }
+    trace_end("tick", tick_start, context->thread_arg.tick);
+    ++context->thread_arg.tick;
+  }
+
+  context->seed = rand_seed;
+  context->next_id = next_planet_id;
+  physics = saved_physics;
+  rand_seed = saved_seed;
+  next_planet_id = saved_id;
+  planet_id_stride = saved_stride;
+
+  if (ticks) {
+    context->bodies_stale = 1;
+  }
+
+  return context->thread_arg.tick;
+}
+
+
+PLANETS_API const planets_body_t *planets_bodies(planets_context_t *context, size_t *count) {
+  if (context->bodies_stale) {
+    planets_update_bodies(context);
+    context->bodies_stale = 0;
+  }
+  *count = context->body_count;
+  return context->bodies;
+}
+
+
+PLANETS_API void planets_world_size(double *width, double *height) {
+  *width = WORLD_WIDTH;
+  *height = WORLD_HEIGHT;
+}
+
+
+int config_valid(const planets_config_t *config) {
+  /* The same combinations main() turns away, and for the same reasons. */
+  if (config->force_cutoff != 0.0 &&
+      (!(config->force_cutoff >= 2.0 * radius_for_mass(MASS_MAX)) || config->single_precision || config->fixed_point)) {
+    return 0;
+  }
+  if (config->fixed_point && (config->single_precision || config->open_world)) {
+    return 0;
+  }
+  if (!(config->open_margin >= 0.0) || !config->ticks_per_frame || config->worker_count < -1) {
+    return 0;
+  }
+  return 1;
+}
+
+
+void config_from_options(planets_config_t *config) {
+  planets_config_default(config);
+  config->force_cutoff = force_cutoff;
+  config->swept_collisions = swept_collisions;
+  config->open_world = open_world;
+  config->open_margin = open_margin;
+  config->reorder_interval = reorder_interval;
+  config->ticks_per_frame = ticks_per_frame;
+  config->single_precision = single_precision;
+  config->fixed_point = fixed_point;
+  config->worker_count = worker_count_option;
+  config->main_helps = main_helps;
+  config->partitioned = partitioned;
+}
+
+
+void planets_update_bodies(planets_context_t *context) {
+  /* Fills the array planets_bodies() hands out, at most once a step, and
+     only for the steps somebody asks about. */
+  const planet_node_t *node;
+  const planet_t *planet;
+  planets_body_t *body;
+
+  if (context->planets.size > context->body_capacity) {
+    context->body_capacity = context->planets.size;
+    context->bodies = my_realloc(context->bodies, context->body_capacity * sizeof(*context->bodies));
+  }
+
+  body = context->bodies;
+  for (node = context->planets.first;  node;  node = node->next, ++body) {
+    planet = node->planet;
+    body->id = planet->id;
+    body->x_pos = planet->x_pos;
+    body->y_pos = planet->y_pos;
+    body->x_vel = planet->x_vel;
+    body->y_vel = planet->y_vel;
+    body->mass = planet->mass;
+    body->radius = planet->radius;
+    body->hue = planet->hue;
+  }
+  context->body_count = context->planets.size;
+}
+
+
+int run_ensemble(size_t member_count, size_t frame_count) {
+  /* Many small worlds are cheaper to run side by side, each on one thread,
+     than one after another each spread over every thread. */
+  ensemble_t ensemble;
+  pthread_list_t threads;
+  double start;
+  double elapsed;
+  size_t i;
+
+  ensemble.member_count = member_count;
+  ensemble.frame_count = frame_count;
+  ensemble.base_seed = rand_seed;
+  ensemble.next_member = 0;
+  ensemble.sim_seconds = 0.0;
+  pthread_mutex_init(&ensemble.mutex, 0);
+
+  if (pthread_list_init(&threads, (size_t) get_nprocs() < member_count ? (size_t) get_nprocs() : member_count) < 0) {
+    return -1;
+  }
+
+  printf("member,seed,bodies,largest_mass,median_mass,largest_mass_fraction,wall_seconds\n");
+
+  start = monotonic_time();
+  for (i = 0;  i < threads.size;  ++i) {
+    pthread_create(&threads.array[i], 0, t_ensemble_runner, &ensemble);
+  }
+  for (i = 0;  i < threads.size;  ++i) {
+    pthread_join(threads.array[i], 0);
+  }
+  elapsed = monotonic_time() - start;
+
+  fprintf(stderr, "%lu members on %lu threads simulated %.1f s in %.1f s:  %.2f simulated seconds per second.\n",
+          member_count, threads.size, ensemble.sim_seconds, elapsed, ensemble.sim_seconds / elapsed);
+
+  pthread_list_delete(&threads);
+  pthread_mutex_destroy(&ensemble.mutex);
+
+  return 0;
+}
+
+
+void *t_ensemble_runner(void *void_arg) {
+  ensemble_t *ensemble;
+  size_t member;
+
+  ensemble = (ensemble_t *) void_arg;
+
+  trace_register_thread("ensemble %lu", (size_t) -1);
+
+  for (;;) {
+    pthread_mutex_lock(&ensemble->mutex);
+      member = ensemble->next_member++;
+    pthread_mutex_unlock(&ensemble->mutex);
+
+    if (member >= ensemble->member_count) {
+      break;
+    }
+    run_member(ensemble, member);
+  }
+
+  trace_flush_work();
+
+  return 0;
+}
+
+
+void run_member(ensemble_t *ensemble, size_t member) {
+  /* Runs one member start to finish on the calling thread, through the
+     library interface, then prints its line of the summary. */
+  planets_config_t config;
+  planets_context_t *context;
+  const planets_body_t *bodies;
+  double *masses;
+  double largest = 0.0;
+  double median = 0.0;
+  double start;
+  size_t count;
+  size_t i;
+
+  start = monotonic_time();
+
+  config_from_options(&config);
+  config.worker_count = 0;
+  config.main_helps = 0;
+  context = context_new(initial_count, generator, ensemble->base_seed + member, 0, 1, &config);
+  planets_step(context, ensemble->frame_count * TICKS_PER_FRAME);
+
+  bodies = planets_bodies(context, &count);
+  masses = my_malloc((count ? count : 1) * sizeof(*masses));
+  for (i = 0;  i < count;  ++i) {
+    masses[i] = bodies[i].mass;
+  }
+  qsort(masses, count, sizeof(*masses), compare_doubles);
+  /* An open world can lose every planet, and a scenario can have none. */
+  if (count > 0) {
+    largest = masses[count - 1];
+    median = masses[count / 2];
+  }
+
+  pthread_mutex_lock(&ensemble->mutex);
+    printf("%lu,%u,%lu,%.6f,%.6f,%.6f,%.3f\n", member, ensemble->base_seed + (unsigned) member, count,
+           largest, median, largest / TOTAL_MASS, monotonic_time() - start);
+    fflush(stdout);
+    ensemble->sim_seconds += (double) ensemble->frame_count / FRAMES_PER_SECOND;
+  pthread_mutex_unlock(&ensemble->mutex);
+
+  free(masses);
+  planets_delete(context);
+}
+
+
+int compare_doubles(const void *a, const void *b) {
+  const double d1 = *(const double *) a;
+  const double d2 = *(const double *) b;
+
+  return d1 < d2 ? -1 : d1 > d2;
+}
+
+
+int run_benchmark(size_t frame_count) {
+  /* Runs the same world twice with the worker threads, as a normal run
+     would, first without reordering and then with it. */
+  const size_t intervals[2] = {0, reorder_interval ? reorder_interval : REORDER_INTERVAL_BENCHMARK};
+  planets_config_t config;
+  planets_context_t *context;
+  unsigned seed;
+  uint64_t misses;
+  size_t count;
+  size_t ticks;
+  size_t run;
+  double start;
+  double elapsed;
+  int counter;
+
+  seed = rand_seed;
+  config_from_options(&config);
+
+  for (run = 0;  run < 2;  ++run) {
+    config.reorder_interval = intervals[run];
+
+    /* The counter is opened first so that the workers inherit it. */
+    counter = open_cache_miss_counter();
+    context = context_new(initial_count, generator, seed, 0, 1, &config);
+    if (!context) {
+      return -1;
+    }
+
+    if (counter >= 0) {
+      ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+      ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    start = monotonic_time();
+
+    ticks = frame_count * TICKS_PER_FRAME;
+    planets_step(context, ticks);
+
+    elapsed = monotonic_time() - start;
+    if (counter >= 0) {
+      ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    planets_bodies(context, &count);
+    planets_delete(context);
+
+    if (config.reorder_interval) {
+      printf("reorder every %lu ticks:  ", config.reorder_interval);
+    } else {
+      printf("no reordering:  ");
+    }
+    printf("%lu bodies at the end, %.3f ms per tick", count, 1000.0 * elapsed / ticks);
+    if (counter >= 0 && read(counter, &misses, sizeof(misses)) == sizeof(misses)) {
+      printf(", %.0f cache misses per tick\n", (double) misses / ticks);
+    } else {
+      printf(", cache misses not available\n");
+    }
+    if (counter >= 0) {
+      close(counter);
+    }
+  }
+
+  return 0;
+}
+
+
+int open_cache_miss_counter(void) {
+  /* Counts cache misses in this process and any threads it starts from
+     now on.  Returns -1, after saying why, if the kernel won't allow it. */
+  struct perf_event_attr attr;
+  int fd;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.disabled = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  if (fd < 0) {
+    perror("perf_event_open");
+  }
+
+  return fd;
+}
+
+
+int compare_runs(size_t frame, const planet_list_t *planets_double, const planet_list_t *planets_float) {
+  /* Prints one line of the report.  Returns 0 once the runs no longer have
+     the same planets. */
+  const planet_node_t *node_d;
+  const planet_node_t *node_f;
+  double x_diff, y_diff;
+  double error_squared;
+  double total_squared = 0.0;
+  double max_squared = 0.0;
+  double x_momentum_d, y_momentum_d;
+  double x_momentum_f, y_momentum_f;
+  double momentum_error;
+
+  total_momentum(planets_double, &x_momentum_d, &y_momentum_d);
+  total_momentum(planets_float, &x_momentum_f, &y_momentum_f);
+
+  momentum_error = hypot(x_momentum_f - x_momentum_d, y_momentum_f - y_momentum_d) / hypot(x_momentum_d, y_momentum_d);
+
+  printf("%lu,%lu,%lu,", frame, planets_double->size, planets_float->size);
+
+  if (planets_double->size != planets_float->size) {
+    /* A collision went differently, so there's no matching planets up any more. */
+    printf(",,%.10g,%.10g,%.10g,%.10g,%g\n", x_momentum_d, y_momentum_d, x_momentum_f, y_momentum_f, momentum_error);
+    return 0;
+  } else {
+    for (node_d = planets_double->first, node_f = planets_float->first;  node_d;  node_d = node_d->next, node_f = node_f->next) {
+      x_diff = fabs(node_f->planet->x_pos - node_d->planet->x_pos);
+      y_diff = fabs(node_f->planet->y_pos - node_d->planet->y_pos);
+      if (x_diff > 0.5 * WORLD_WIDTH) {
+        x_diff = WORLD_WIDTH - x_diff;
+      }
+      if (y_diff > 0.5 * WORLD_HEIGHT) {
+        y_diff = WORLD_HEIGHT - y_diff;
+      }
+
+      error_squared = x_diff * x_diff + y_diff * y_diff;
+      total_squared += error_squared;
+      if (error_squared > max_squared) {
+        max_squared = error_squared;
+      }
+    }
+    printf("%g,%g,", sqrt(total_squared / planets_double->size), sqrt(max_squared));
+  }
+
+  printf("%.10g,%.10g,%.10g,%.10g,%g\n", x_momentum_d, y_momentum_d, x_momentum_f, y_momentum_f, momentum_error);
+
+  return 1;
+}
+
+
+void total_momentum(const planet_list_t *planets, double *x_momentum, double *y_momentum) {
+  const planet_node_t *node;
+
+  *x_momentum = *y_momentum = 0.0;
+
+  for (node = planets->first;  node;  node = node->next) {
+    *x_momentum += node->planet->mass * node->planet->x_vel;
+    *y_momentum += node->planet->mass * node->planet->y_vel;
+  }
+}
+
+
+int start_threads(pthread_list_t *threads, thread_arg_t *arg) {
+  /* Starts the workers arg's configuration asks for. */
+  size_t thread_count;
+  size_t i;
+
+  if (arg->config.worker_count >= 0) {
+    thread_count = (size_t) arg->config.worker_count;
+  } else {
+    thread_count = (size_t) get_nprocs();
+    if (arg->config.main_helps && thread_count > 1) {
+      --thread_count;
+    }
+  }
+
+  if (pthread_list_init(threads, thread_count) < 0) {
+    return -1;
+  }
+  arg->running = 1;
+  arg->threaded = 1;
+  arg->worker_count = thread_count;
+  arg->next_worker_index = 0;
+  arg->main_helps = arg->config.main_helps;
+  arg->partitioned = arg->config.partitioned;
+  arg->slices = my_realloc(arg->slices, (thread_count + 2) * sizeof(*arg->slices));
+  arg->round = 0;
+
+  if (cpu_order) {
+    pin_thread(pthread_self(), 0);
+  }
+
+  for (i = 0;  i < thread_count;  ++i) {
+    pthread_create(&threads->array[i], 0, t_planet_ticker, arg);
+    if (cpu_order) {
+      pin_thread(threads->array[i], i + 1);
+    }
+  }
+
+  return 0;
+}
+
+
+void stop_threads(pthread_list_t *threads, thread_arg_t *arg) {
+  size_t i;
+
+  thread_arg_stop_running(arg);
+
+  for (i = 0;  i < threads->size;  ++i) {
+    pthread_join(threads->array[i], 0);
+  }
+
+  pthread_list_delete(threads);
+  free(arg->slices);
+  arg->slices = NULL;
+  task_deques_delete(arg);
+  candidate_buffers_delete(arg);
+}
+
+
+int pthread_list_init(pthread_list_t *list, size_t size) {
+  list->array = calloc(size ? size : 1, sizeof(list->array[0]));
+  if (list->array == NULL) {
+    perror("calloc()");
+    return -1;
+  }
+  list->size = size;
+  return 0;
+}
+
+
+void pthread_list_delete(pthread_list_t *list) {
+  free(list->array);
+  list->array = 0;
+  list->size = 0;
+}
+
+
+void *t_planet_ticker(void *void_arg) {
+  thread_arg_t *arg;
+  planet_node_t *node = NULL;
+  size_t index;
+  size_t round = 0;
+
+  arg = (thread_arg_t *) void_arg;
+
+  trace_register_thread("worker %lu", (size_t) -1);
+
+  index = __sync_fetch_and_add(&arg->next_worker_index, 1);
+  task_index = index;
+  physics = &arg->config;
+
+  if (arg->partitioned) {
+    while (thread_arg_wait_for_round(arg, &round)) {
+      process_slice(arg, index);
+      thread_arg_finish_slice(arg);
+    }
+    trace_flush_work();
+    return 0;
+  }
+
+  while (arg->running) {
+    node = thread_arg_get_planet_node(arg, node != NULL);
+    if (node) {
+      trace_count_work();
+      calculate_planet_forces(arg, node);
+    }
+  }
+
+  trace_flush_work();
+
+  return 0;
+}
+
+
+void build_cpu_order(int scatter) {
+  /* Lists the CPUs we're allowed on, grouped by socket for compact
+     placement, or dealt out one socket at a time for scatter. */
+  cpu_set_t allowed;
+  int *packages;
+  size_t *ranks;
+  int cpu;
+  int swap;
+  size_t swap_rank;
+  size_t i, j;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+    perror("sched_getaffinity");
+    return;
+  }
+
+  cpu_order = my_malloc(CPU_COUNT(&allowed) * sizeof(*cpu_order));
+  packages = my_malloc(CPU_COUNT(&allowed) * sizeof(*packages));
+  ranks = my_malloc(CPU_COUNT(&allowed) * sizeof(*ranks));
+
+  cpu_count = 0;
+  for (cpu = 0;  cpu < CPU_SETSIZE;  ++cpu) {
+    if (CPU_ISSET(cpu, &allowed)) {
+      cpu_order[cpu_count] = cpu;
+      packages[cpu_count] = cpu_package(cpu);
+      ++cpu_count;
+    }
+  }
+
+  /* An insertion sort is plenty for a list of CPUs.  First by socket... */
+  for (i = 1;  i < cpu_count;  ++i) {
+    for (j = i;  j > 0 && packages[j - 1] > packages[j];  --j) {
+      swap = packages[j];  packages[j] = packages[j - 1];  packages[j - 1] = swap;
+      swap = cpu_order[j];  cpu_order[j] = cpu_order[j - 1];  cpu_order[j - 1] = swap;
+    }
+  }
+
+  if (scatter) {
+    /* ...then, for scatter, by place within the socket. */
+    for (i = 0;  i < cpu_count;  ++i) {
+      ranks[i] = i > 0 && packages[i] == packages[i - 1] ? ranks[i - 1] + 1 : 0;
+    }
+    for (i = 1;  i < cpu_count;  ++i) {
+      for (j = i;  j > 0 && ranks[j - 1] > ranks[j];  --j) {
+        swap_rank = ranks[j];  ranks[j] = ranks[j - 1];  ranks[j - 1] = swap_rank;
+        swap = cpu_order[j];  cpu_order[j] = cpu_order[j - 1];  cpu_order[j - 1] = swap;
+      }
+    }
+  }
+
+  free(packages);
+  free(ranks);
+}
+
+
+int cpu_package(int cpu) {
+  /* The socket the CPU is on, or 0 if the kernel doesn't say. */
+  char path[128];
+  FILE *file;
+  int package = 0;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+  file = fopen(path, "r");
+  if (file) {
+    if (fscanf(file, "%d", &package) != 1) {
+      package = 0;
+    }
+    fclose(file);
+  }
+
+  return package;
+}
+
+
+void pin_thread(pthread_t thread, size_t slot) {
+  /* Slots beyond the number of CPUs wrap around. */
+  cpu_set_t cpus;
+  int err;
+
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu_order[slot % cpu_count], &cpus);
+
+  err = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+  if (err) {
+    fprintf(stderr, "pthread_setaffinity_np: %s\n", strerror(err));
+  }
+}
+
+
+#ifndef PLANETS_LIBRARY
+int handle_sdl_event(SDL_Event *event) {
+  switch (event->type) {
+    case SDL_QUIT:
+      quitting = 1;
+      break;
+
+    case SDL_KEYDOWN:
+      handle_key_press_event(&event->key.keysym);
+      break;
+
+    case SDL_MOUSEBUTTONDOWN:
+    case SDL_MOUSEMOTION:
+      handle_mouse_event(event);
+      break;
+
+    default:
+      break;
+  }
+
+  return 0;
+}
+
+
+void handle_key_press_event(SDL_keysym *keysym) {
+  switch (keysym->sym) {
+    case SDLK_ESCAPE:
+      quitting = 1;
+      break;
+
+    case SDLK_h:
+      hud_visible = !hud_visible;
+      stats_enabled |= hud_visible;
+      break;
+
+    case SDLK_d:
+      density_view = !density_view;
+      break;
+
+    case SDLK_PLUS:
+    case SDLK_EQUALS:
+    case SDLK_KP_PLUS:
+      camera_zoom(CAMERA_ZOOM_STEP, camera.x, camera.y);
+      break;
+
+    case SDLK_MINUS:
+    case SDLK_KP_MINUS:
+      camera_zoom(1.0 / CAMERA_ZOOM_STEP, camera.x, camera.y);
+      break;
+
+    case SDLK_LEFT:
+      camera_pan(-CAMERA_PAN_STEP * (camera.right - camera.left), 0.0);
+      break;
+
+    case SDLK_RIGHT:
+      camera_pan(CAMERA_PAN_STEP * (camera.right - camera.left), 0.0);
+      break;
+
+    case SDLK_UP:
+      camera_pan(0.0, CAMERA_PAN_STEP * (camera.top - camera.bottom));
+      break;
+
+    case SDLK_DOWN:
+      camera_pan(0.0, -CAMERA_PAN_STEP * (camera.top - camera.bottom));
+      break;
+
+    case SDLK_0:
+    case SDLK_HOME:
+      camera_reset();
+      break;
+
+    default:
+      break;
+  }
+}
+
+
+void handle_mouse_event(SDL_Event *event) {
+  /* The wheel zooms about the pointer, and dragging with the left button
+     held moves the world along with it. */
+  double x, y;
+
+  if (event->type == SDL_MOUSEBUTTONDOWN) {
+    if (event->button.button == SDL_BUTTON_WHEELUP || event->button.button == SDL_BUTTON_WHEELDOWN) {
+      camera_screen_to_world(event->button.x, event->button.y, &x, &y);
+      camera_zoom(event->button.button == SDL_BUTTON_WHEELUP ? CAMERA_ZOOM_STEP : 1.0 / CAMERA_ZOOM_STEP, x, y);
+    }
+  } else if (event->motion.state & SDL_BUTTON(SDL_BUTTON_LEFT)) {
+    camera_pan(-event->motion.xrel / camera.pixels_per_unit, event->motion.yrel / camera.pixels_per_unit);
+  }
+}
+
+
+int initialize_display(void) {
+  int screen_width, screen_height;
+
+  screen_size(&screen_width, &screen_height);
+
+  if (set_up_pixel_format() < 0) {
+    return -1;
+  }
+
+  if (create_window("Planets", screen_width, screen_height, video_flags) < 0) {
+    return -1;
+  }
+
+  if (initialize_openGL(screen_width, screen_height) < 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+
+void screen_size(int *w, int *h) {
+  *h = SCREEN_HEIGHT_INIT;
+  *w = (int) (WORLD_ASPECT_RATIO * *h + 0.5);
+}
+
+
+int set_up_pixel_format(void) {
+  const SDL_VideoInfo *video_info;
+
+  video_flags = SDL_OPENGL;
+  video_flags |= SDL_HWPALETTE;
+
+  video_info = SDL_GetVideoInfo();
+  if (video_info == NULL) {
+    fprintf(stderr, "Failed to get video info: %s", SDL_GetError());
+    return -1;
+  }
+
+  if (video_info->hw_available) {
+    video_flags |= SDL_HWSURFACE;
+  } else {
+    video_flags |= SDL_SWSURFACE;
+  }
+
+  if (video_info->blit_hw) {
+    video_flags |= SDL_HWACCEL;
+  }
+
+  SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+  SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, SCREEN_DEPTH);
+  SDL_GL_SetAttribute(SDL_GL_STENCIL_SIZE, 0);
+  SDL_GL_SetAttribute(SDL_GL_ACCUM_RED_SIZE, 0);
+  SDL_GL_SetAttribute(SDL_GL_ACCUM_GREEN_SIZE, 0);
+  SDL_GL_SetAttribute(SDL_GL_ACCUM_BLUE_SIZE, 0);
+  SDL_GL_SetAttribute(SDL_GL_ACCUM_ALPHA_SIZE, 0);
+
+  return 0;
+}
+
+
+int create_window(const char *window_name, int width, int height, int video_flags) {
+  main_window = SDL_SetVideoMode(width, height, SCREEN_DEPTH, video_flags);
+  if ( main_window == NULL ) {
+    fprintf(stderr, "Failed to create window: %s", SDL_GetError());
+    return -1;
+  }
+  SDL_WM_SetCaption(window_name, window_name);
+  return 0;
+}
+
+
+int initialize_openGL(int width, int height) {
+  size_openGL_screen(width, height);
+  return 0;
+}
+
+
+void size_openGL_screen(int width, int height) {
+  if ( height == 0 ) {
+    height = 1;
+  }
+
+  glViewport(0, 0, width, height);
+
+  camera.width = width;
+  camera.height = height;
+
+  camera_apply();
+}
+
+
+void camera_apply(void) {
+  /* Works out the view from the camera and loads it.  At a zoom of 1 the
+     whole world just fits on screen. */
+  const double world_aspect = WORLD_WIDTH / WORLD_HEIGHT;
+  double screen_aspect;
+  double view_width, view_height;
+
+  screen_aspect = (double) camera.width / camera.height;
+
+  if (screen_aspect > world_aspect) {
+    view_height = WORLD_HEIGHT / camera.zoom;
+  } else {
+    view_height = WORLD_WIDTH / screen_aspect / camera.zoom;
+  }
+  view_width = view_height * screen_aspect;
+
+  camera.left = camera.x - 0.5 * view_width;
+  camera.right = camera.x + 0.5 * view_width;
+  camera.bottom = camera.y - 0.5 * view_height;
+  camera.top = camera.y + 0.5 * view_height;
+  camera.pixels_per_unit = camera.height / view_height;
+
+  glMatrixMode(GL_MODELVIEW);
+  glLoadIdentity();
+  glScalef((float) (2.0 / view_width), (float) (2.0 / view_height), 1.0f);
+  glTranslatef((float) -camera.x, (float) -camera.y, 0.0f);
+}
+
+
+void camera_zoom(double factor, double x, double y) {
+  /* Zooms keeping the world position (x, y) where it is on screen. */
+  double zoom;
+
+  zoom = camera.zoom * factor;
+  if (zoom < 1.0) {
+    zoom = 1.0;
+  }
+  if (zoom > CAMERA_ZOOM_MAX) {
+    zoom = CAMERA_ZOOM_MAX;
+  }
+  factor = zoom / camera.zoom;
+
+  camera.x = x + (camera.x - x) / factor;
+  camera.y = y + (camera.y - y) / factor;
+  camera.zoom = zoom;
+  camera_pan(0.0, 0.0);
+}
+
+
+void camera_pan(double x_offset, double y_offset) {
+  camera.x += x_offset;
+  camera.y += y_offset;
+  camera_limit();
+  camera_apply();
+}
+
+
+void camera_limit(void) {
+  /* Wraps the camera around a periodic world, or keeps it over an open
+     world and its margin. */
+  if (open_world) {
+    camera.x = fmin(fmax(camera.x, -open_margin), WORLD_WIDTH + open_margin);
+    camera.y = fmin(fmax(camera.y, -open_margin), WORLD_HEIGHT + open_margin);
+  } else {
+    camera.x = mod_double(camera.x, 0.0, WORLD_WIDTH);
+    camera.y = mod_double(camera.y, 0.0, WORLD_HEIGHT);
+  }
+}
+
+
+void camera_reset(void) {
+  camera.x = 0.5 * WORLD_WIDTH;
+  camera.y = 0.5 * WORLD_HEIGHT;
+  camera.zoom = 1.0;
+  camera_apply();
+}
+
+
+void camera_screen_to_world(int x, int y, double *world_x, double *world_y) {
+  /* Screen positions count down from the top, like SDL's. */
+  *world_x = camera.left + (camera.right - camera.left) * (x + 0.5) / camera.width;
+  *world_y = camera.top - (camera.top - camera.bottom) * (y + 0.5) / camera.height;
+}
+#endif
+
+
+void initialize_planets(planet_list_t *planets, size_t count, generator_t kind) {
+  /* Loads the -l scenario, or generates a world of count planets.  Big worlds are made in
+     chunks on several threads, each allocating its own planets and nodes,
+     so that starting a million-planet world isn't one thread's malloc()
+     loop.  The chunks are a fixed size and get their seeds and ids up
+     front, so the world is the same however many threads there are. */
+  double center_x[GENERATOR_CENTER_COUNT], center_y[GENERATOR_CENTER_COUNT];
+  double center_x_vel[GENERATOR_CENTER_COUNT], center_y_vel[GENERATOR_CENTER_COUNT];
+  double speed, angle;
+  init_chunk_t *chunks;
+  init_job_t job;
+  pthread_t *threads;
+  planet_node_t **tail;
+  size_t thread_count;
+  size_t chunk_count;
+  size_t i;
+
+  list_init(planets);
+
+  if (scenario.records) {
+    count = scenario.count;
+  }
+  if (!count) {
+    return;
+  }
+
+  for (i = 0;  i < GENERATOR_CENTER_COUNT;  ++i) {
+    center_x[i] = rand_normal() * WORLD_WIDTH;
+    center_y[i] = rand_normal() * WORLD_HEIGHT;
+
+    speed = rand_normal() * VEL_INIT_MAX;
+    angle = rand_normal() * 2.0 * M_PI;
+    center_x_vel[i] = speed * cos(angle);
+    center_y_vel[i] = speed * sin(angle);
+  }
+
+  chunk_count = (count + INIT_CHUNK_SIZE - 1) / INIT_CHUNK_SIZE;
+  thread_count = get_nprocs();
+  if (thread_count > chunk_count) {
+    thread_count = chunk_count;
+  }
+
+  chunks = my_malloc(chunk_count * sizeof(*chunks));
+  threads = my_malloc(thread_count * sizeof(*threads));
+
+  for (i = 0;  i < chunk_count;  ++i) {
+    chunks[i].first = i * INIT_CHUNK_SIZE;
+    chunks[i].count = i + 1 < chunk_count ? INIT_CHUNK_SIZE : count - chunks[i].first;
+    chunks[i].seed = rand_r(&rand_seed);
+    chunks[i].mass = TOTAL_MASS / (double) count;
+    chunks[i].generator = kind;
+    chunks[i].center_x = center_x;
+    chunks[i].center_y = center_y;
+    chunks[i].center_x_vel = center_x_vel;
+    chunks[i].center_y_vel = center_y_vel;
+    chunks[i].id_base = next_planet_id;
+    chunks[i].id_stride = planet_id_stride;
+  }
+
+  job.chunks = chunks;
+  job.chunk_count = chunk_count;
+  job.next_chunk = 0;
+
+  for (i = 1;  i < thread_count;  ++i) {
+    pthread_create(&threads[i], 0, t_initialize_chunks, &job);
+  }
+  t_initialize_chunks(&job);
+  for (i = 1;  i < thread_count;  ++i) {
+    pthread_join(threads[i], 0);
+  }
+
+  tail = &planets->first;
+  for (i = 0;  i < chunk_count;  ++i) {
+    *tail = chunks[i].head;
+    tail = &chunks[i].tail->next;
+  }
+  planets->size = count;
+
+  next_planet_id += count * planet_id_stride;
+
+  free(chunks);
+  free(threads);
+}
+
+
+void *t_initialize_chunks(void *void_job) {
+  init_job_t *job;
+  unsigned saved_seed;
+  size_t saved_id;
+  size_t i;
+
+  job = (init_job_t *) void_job;
+
+  /* The main thread takes part too, and its own stream and ids must carry
+     on from where they were, however many chunks it happened to make;
+     planet_new() numbers every planet it makes before the chunk's id
+     replaces it. */
+  saved_seed = rand_seed;
+  saved_id = next_planet_id;
+  while ((i = __sync_fetch_and_add(&job->next_chunk, 1)) < job->chunk_count) {
+    initialize_chunk(&job->chunks[i]);
+  }
+  rand_seed = saved_seed;
+  next_planet_id = saved_id;
+
+  return 0;
+}
+
+
+void initialize_chunk(init_chunk_t *chunk) {
+  planet_node_t *node;
+  planet_t *planet;
+  size_t i;
+
+  rand_seed = chunk->seed;
+
+  chunk->head = chunk->tail = NULL;
+
+  for (i = chunk->first;  i < chunk->first + chunk->count;  ++i) {
+    if (scenario.records) {
+      planet = planet_from_record(&scenario.records[i]);
+      planet->x_pos = mod_double(planet->x_pos, 0.0, WORLD_WIDTH);
+      planet->y_pos = mod_double(planet->y_pos, 0.0, WORLD_HEIGHT);
+    } else {
+      planet = generate_planet(chunk);
+    }
+    planet->id = chunk->id_base + i * chunk->id_stride;
+
+    node = my_malloc(sizeof(*node));
+    node->planet = planet;
+    node->next = NULL;
+    if (chunk->tail) {
+      chunk->tail->next = node;
+    } else {
+      chunk->head = node;
+    }
+    chunk->tail = node;
+  }
+}
+
+
+planet_t *generate_planet(const init_chunk_t *chunk) {
+  double x_pos, y_pos;
+  double x_vel, y_vel;
+  double x_offset, y_offset;
+  double speed, angle;
+  double distance;
+  size_t center;
+
+  switch (chunk->generator) {
+    case GENERATOR_CLUSTERED:
+      /* Gaussian blobs, each drifting as a whole. */
+      center = (size_t) (rand_normal() * GENERATOR_CENTER_COUNT);
+      distance = GENERATOR_CLUSTER_SPREAD * sqrt(-2.0 * log(1.0 - rand_normal()));
+      angle = rand_normal() * 2.0 * M_PI;
+      x_pos = chunk->center_x[center] + distance * cos(angle);
+      y_pos = chunk->center_y[center] + distance * sin(angle);
+
+      speed = rand_normal() * VEL_INIT_MAX;
+      angle = rand_normal() * 2.0 * M_PI;
+      x_vel = chunk->center_x_vel[center] + speed * cos(angle);
+      y_vel = chunk->center_y_vel[center] + speed * sin(angle);
+      break;
+
+    case GENERATOR_DISK:
+      /* An even disk in the middle of the world, every planet on the
+         circular orbit for the mass inside it. */
+      distance = GENERATOR_DISK_RADIUS * sqrt(rand_normal());
+      angle = rand_normal() * 2.0 * M_PI;
+      x_pos = 0.5 * WORLD_WIDTH + distance * cos(angle);
+      y_pos = 0.5 * WORLD_HEIGHT + distance * sin(angle);
+
+      speed = sqrt(G * TOTAL_MASS * distance) / GENERATOR_DISK_RADIUS;
+      x_vel = -speed * sin(angle);
+      y_vel = speed * cos(angle);
+      break;
+
+    case GENERATOR_PLUMMER:
+      center = (size_t) (rand_normal() * GENERATOR_CENTER_COUNT);
+      plummer_offset(&x_offset, &y_offset, &x_vel, &y_vel);
+      x_pos = chunk->center_x[center] + x_offset;
+      y_pos = chunk->center_y[center] + y_offset;
+      x_vel += chunk->center_x_vel[center];
+      y_vel += chunk->center_y_vel[center];
+      break;
+
+    default:
+      x_pos = rand_normal() * WORLD_WIDTH;
+      y_pos = rand_normal() * WORLD_HEIGHT;
+
+      speed = rand_normal() * VEL_INIT_MAX;
+      angle = rand_normal() * 2.0 * M_PI;
+      x_vel = speed * cos(angle);
+      y_vel = speed * sin(angle);
+      break;
+  }
+
+  x_pos = mod_double(x_pos, 0.0, WORLD_WIDTH);
+  y_pos = mod_double(y_pos, 0.0, WORLD_HEIGHT);
+
+  return planet_new(x_pos, y_pos, x_vel, y_vel, chunk->mass, 0.0, 0);
+}
+
+
+void plummer_offset(double *x_offset, double *y_offset, double *x_vel, double *y_vel) {
+  /* Samples a Plummer sphere, as in Aarseth, Henon and Wielen (1974), and
+     flattens it onto the world by dropping the third coordinate.  Each of
+     the GENERATOR_CENTER_COUNT clumps holds an equal share of the mass. */
+  const double scale = GENERATOR_PLUMMER_RADIUS;
+  const double clump_mass = TOTAL_MASS / GENERATOR_CENTER_COUNT;
+  double distance;
+  double escape_speed;
+  double ratio, limit;
+  double cos_theta, sin_theta, phi;
+  double u;
+
+  do {
+    u = rand_normal();
+    distance = u > 0.0 ? scale / sqrt(pow(u, -2.0 / 3.0) - 1.0) : HUGE_VAL;
+  } while (distance > 10.0 * scale);
+
+  cos_theta = 2.0 * rand_normal() - 1.0;
+  sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+  phi = rand_normal() * 2.0 * M_PI;
+  *x_offset = distance * sin_theta * cos(phi);
+  *y_offset = distance * sin_theta * sin(phi);
+
+  /* The speed, as a fraction of the escape speed, by rejection from
+     q^2 (1 - q^2)^3.5, whose maximum is under 0.1. */
+  do {
+    ratio = rand_normal();
+    limit = 0.1 * rand_normal();
+  } while (limit > ratio * ratio * pow(1.0 - ratio * ratio, 3.5));
+
+  escape_speed = sqrt(2.0 * G * clump_mass / sqrt(distance * distance + scale * scale));
+
+  cos_theta = 2.0 * rand_normal() - 1.0;
+  sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+  phi = rand_normal() * 2.0 * M_PI;
+  *x_vel = ratio * escape_speed * sin_theta * cos(phi);
+  *y_vel = ratio * escape_speed * sin_theta * sin(phi);
+}
+
+
+int scenario_load(const char *path) {
+  /* Maps the file in for initialize_planets() to read.  With several
+     threads reading their chunks of it at once, starting up is about as
+     fast as the disk. */
+  const scenario_header_t *header;
+  const body_record_t *record;
+  struct stat buf;
+  size_t i;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &buf) < 0) {
+    fprintf(stderr, "Couldn't open scenario %s: ", path);
+    perror(NULL);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+
+  if ((size_t) buf.st_size < sizeof(*header)) {
+    fprintf(stderr, "Scenario %s is too short.\n", path);
+    close(fd);
+    return -1;
+  }
+
+  scenario.map_size = buf.st_size;
+  scenario.map = mmap(NULL, scenario.map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (scenario.map == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  madvise(scenario.map, scenario.map_size, MADV_WILLNEED);
+
+  header = scenario.map;
+  if (memcmp(header->magic, SCENARIO_MAGIC, sizeof(header->magic)) != 0 ||
+      scenario.map_size != sizeof(*header) + header->count * sizeof(body_record_t)) {
+    fprintf(stderr, "%s isn't a scenario file.\n", path);
+    munmap(scenario.map, scenario.map_size);
+    return -1;
+  }
+
+  scenario.records = (const body_record_t *) (header + 1);
+  scenario.count = header->count;
+
+  /* Everything from here on takes the records at their word, so anything
+     that would poison the forces, or never wrap, is turned away now. */
+  for (i = 0;  i < scenario.count;  ++i) {
+    record = &scenario.records[i];
+    if (!isfinite(record->x_pos) || !isfinite(record->y_pos) || !isfinite(record->x_vel) || !isfinite(record->y_vel) ||
+        !isfinite(record->hue) || !isfinite(record->mass) || record->mass <= 0.0) {
+      fprintf(stderr, "Planet %lu of scenario %s has a position, velocity or hue that isn't finite, or no mass.\n", i, path);
+      munmap(scenario.map, scenario.map_size);
+      scenario.records = NULL;
+      scenario.count = 0;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+int scenario_save(const char *path) {
+  /* Writes the world initialize_planets() makes, for -l to load later. */
+  scenario_header_t header;
+  body_record_t record;
+  planet_list_t planets;
+  planet_node_t *node;
+  FILE *file;
+  int status = 0;
+
+  file = fopen(path, "wb");
+  if (!file) {
+    fprintf(stderr, "Couldn't create scenario %s: ", path);
+    perror(NULL);
+    return -1;
+  }
+
+  initialize_planets(&planets, initial_count, generator);
+
+  memcpy(header.magic, SCENARIO_MAGIC, sizeof(header.magic));
+  header.count = planets.size;
+  if (fwrite(&header, sizeof(header), 1, file) != 1) {
+    status = -1;
+  }
+
+  for (node = planets.first;  node && status == 0;  node = node->next) {
+    planet_to_record(node->planet, &record);
+    if (fwrite(&record, sizeof(record), 1, file) != 1) {
+      status = -1;
+    }
+  }
+
+  if (fclose(file) != 0) {
+    status = -1;
+  }
+  if (status < 0) {
+    fprintf(stderr, "Couldn't write scenario %s: ", path);
+    perror(NULL);
+  }
+
+  delete_planets(&planets);
+  list_delete(&planets);
+
+  return status;
+}
+
+
+#ifndef PLANETS_LIBRARY
+void display_planets(const planet_list_t *planets, thread_arg_t *pool) {
+  /* pool, if there is one, has its workers help with the density view. */
+  planet_node_t *node;
+
+  glClear(GL_COLOR_BUFFER_BIT);
+
+  if (density_view) {
+    splat_planets(planets, pool);
+    splat_draw();
+  } else {
+    if (open_world) {
+      for (node = planets->first;  node;  node = node->next) {
+        draw_planet(node->planet, 1);
+      }
+    } else {
+      for (node = planets->first;  node;  node = node->next) {
+        draw_planet(node->planet, 0);
+      }
+    }
+    point_batch_draw();
+  }
+
+  if (hud_visible) {
+    draw_hud();
+  }
+
+  SDL_GL_SwapBuffers();
+}
+
+
+BOUNDARY_KERNEL void draw_planet(planet_t *planet, const int open) {
+  /* Draws each copy of the planet, wrapped around the world, that is in
+     view, or in an open world just the one:  as a point if it's under a
+     pixel across, or else as a circle with enough vertices to look round
+     at its size on screen. */
+  const double radius = planet->radius;
+  double screen_radius;
+  double x, y;
+  float rgb[3];
+  int lod = 0;
+  int drawn = 0;
+  int i, j;
+
+  screen_radius = radius * camera.pixels_per_unit;
+  if (screen_radius >= LOD_POINT_RADIUS) {
+    while (lod + 1 < CIRCLE_LOD_COUNT &&
+           2.0 * M_PI * screen_radius / (CIRCLE_POLY_COUNT << lod) > LOD_PIXELS_PER_EDGE) {
+      ++lod;
+    }
+  }
+
+  for (i = open ? 0 : -1;  i <= (open ? 0 : 1);  ++i) {
+    x = planet->x_pos + i * WORLD_WIDTH;
+    if (x + radius < camera.left || x - radius > camera.right) {
+      continue;
+    }
+    for (j = open ? 0 : -1;  j <= (open ? 0 : 1);  ++j) {
+      y = planet->y_pos + j * WORLD_HEIGHT;
+      if (y + radius < camera.bottom || y - radius > camera.top) {
+        continue;
+      }
+
+      if (!drawn) {
+        planet_color(planet, rgb);
+        glColor3fv(rgb);
+        drawn = 1;
+      }
+      if (screen_radius < LOD_POINT_RADIUS) {
+        point_batch_add((float) x, (float) y, rgb);
+      } else {
+        draw_circle(x, y, radius, lod);
+      }
+    }
+  }
+}
+
+
+void point_batch_add(float x, float y, const float *rgb) {
+  if (point_batch.size == point_batch.capacity) {
+    point_batch.capacity = point_batch.capacity ? 2 * point_batch.capacity : 1024;
+    point_batch.xy = my_realloc(point_batch.xy, 2 * point_batch.capacity * sizeof(*point_batch.xy));
+    point_batch.rgb = my_realloc(point_batch.rgb, 3 * point_batch.capacity * sizeof(*point_batch.rgb));
+  }
+
+  point_batch.xy[2 * point_batch.size] = x;
+  point_batch.xy[2 * point_batch.size + 1] = y;
+  memcpy(&point_batch.rgb[3 * point_batch.size], rgb, 3 * sizeof(*rgb));
+  ++point_batch.size;
+}
+
+
+void point_batch_draw(void) {
+  if (!point_batch.size) {
+    return;
+  }
+
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_COLOR_ARRAY);
+  glVertexPointer(2, GL_FLOAT, 0, point_batch.xy);
+  glColorPointer(3, GL_FLOAT, 0, point_batch.rgb);
+  glDrawArrays(GL_POINTS, 0, (GLsizei) point_batch.size);
+  glDisableClientState(GL_COLOR_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+
+  point_batch.size = 0;
+}
+
+
+void splat_planets(const planet_list_t *planets, thread_arg_t *pool) {
+  /* Draws the density view into splat.pixels, in time proportional to the
+     planets plus the pixels, however big the planets are. */
+  const planet_node_t *node;
+  size_t tile_count;
+  size_t i;
+
+  if (splat.width != camera.width || splat.height != camera.height) {
+    splat.width = camera.width;
+    splat.height = camera.height;
+    splat.columns = ((size_t) splat.width + SPLAT_TILE_SIZE - 1) / SPLAT_TILE_SIZE;
+    splat.rows = ((size_t) splat.height + SPLAT_TILE_SIZE - 1) / SPLAT_TILE_SIZE;
+    splat.tile_starts = my_realloc(splat.tile_starts, (splat.columns * splat.rows + 1) * sizeof(*splat.tile_starts));
+    splat.tile_ends = my_realloc(splat.tile_ends, splat.columns * splat.rows * sizeof(*splat.tile_ends));
+    splat.pixels = my_realloc(splat.pixels, 3 * (size_t) splat.width * splat.height);
+  }
+  tile_count = splat.columns * splat.rows;
+  splat.density_scale = camera.pixels_per_unit * camera.pixels_per_unit * WORLD_WIDTH * WORLD_HEIGHT / TOTAL_MASS;
+
+  /* A counting sort:  how many points each tile gets, where that puts each
+     tile's first, and then the points themselves. */
+  memset(splat.tile_starts, 0, (tile_count + 1) * sizeof(*splat.tile_starts));
+  for (node = planets->first;  node;  node = node->next) {
+    splat_planet(node->planet, open_world, 0);
+  }
+  for (i = 0;  i < tile_count;  ++i) {
+    splat.tile_starts[i + 1] += splat.tile_starts[i];
+    splat.tile_ends[i] = splat.tile_starts[i];
+  }
+  if (splat.tile_starts[tile_count] > splat.point_capacity) {
+    splat.point_capacity = 2 * splat.tile_starts[tile_count];
+    splat.points = my_realloc(splat.points, splat.point_capacity * sizeof(*splat.points));
+  }
+  for (node = planets->first;  node;  node = node->next) {
+    splat_planet(node->planet, open_world, 1);
+  }
+
+  splat.next_tile = 0;
+  if (pool && pool->threaded && pool->worker_count) {
+    run_pool_job(pool, splat_tiles);
+  } else {
+    splat_tiles(pool);
+  }
+}
+
+
+BOUNDARY_KERNEL void splat_planet(const planet_t *planet, const int open, const int placing) {
+  /* Bins the planet by the pixel under its middle, in every wrapped copy of
+     the world on screen, or in an open world if it's on screen at all.
+     Until it's placing them, it only counts them. */
+  const float *rgb = NULL;
+  double x_start, x, y;
+  double hue;
+  splat_point_t *point;
+  size_t column, row;
+  size_t tile;
+
+  if (placing) {
+    hue = planet->hue;
+    if (hue < 0.0 || hue >= 360.0) {
+      hue = mod_double(hue, 0.0, 360.0);
+    }
+    rgb = hue_rgb[(size_t) (hue * (HUE_TABLE_SIZE / 360.0)) % HUE_TABLE_SIZE];
+  }
+
+  if (open) {
+    x_start = (planet->x_pos - camera.left) * camera.pixels_per_unit;
+    y = (planet->y_pos - camera.bottom) * camera.pixels_per_unit;
+    if (x_start < 0.0 || y < 0.0 || x_start >= splat.width || y >= splat.height) {
+      return;
+    }
+  } else {
+    x_start = mod_double(planet->x_pos - camera.left, 0.0, WORLD_WIDTH) * camera.pixels_per_unit;
+    y = mod_double(planet->y_pos - camera.bottom, 0.0, WORLD_HEIGHT) * camera.pixels_per_unit;
+  }
+
+  /* An open world's one copy is already known to be on screen, so the
+     loops stop after it. */
+  for (;  y < splat.height;  y += open ? splat.height : WORLD_HEIGHT * camera.pixels_per_unit) {
+    row = (size_t) y;
+    for (x = x_start;  x < splat.width;  x += open ? splat.width : WORLD_WIDTH * camera.pixels_per_unit) {
+      column = (size_t) x;
+      tile = row / SPLAT_TILE_SIZE * splat.columns + column / SPLAT_TILE_SIZE;
+      if (!placing) {
+        ++splat.tile_starts[tile + 1];
+        continue;
+      }
+      point = &splat.points[splat.tile_ends[tile]++];
+      point->pixel = (unsigned) ((row % SPLAT_TILE_SIZE) * SPLAT_TILE_SIZE + column % SPLAT_TILE_SIZE);
+      point->mass = (float) planet->mass;
+      point->rgb = rgb;
+    }
+  }
+}
+
+
+void splat_tiles(thread_arg_t *pool) {
+  /* Takes tiles until there are none left.  Run by the main thread and any
+     workers in pool alike. */
+  const size_t tile_count = splat.columns * splat.rows;
+  size_t tile;
+
+  for (;;) {
+    tile = __sync_fetch_and_add(&splat.next_tile, 1);
+    if (tile >= tile_count) {
+      return;
+    }
+    splat_tile(tile);
+  }
+}
+
+
+void splat_tile(size_t tile) {
+  /* Adds up the mass and mass-weighted color landing on each of the tile's
+     pixels, and tone maps them. */
+  float sums[4 * SPLAT_TILE_SIZE * SPLAT_TILE_SIZE];
+  const splat_point_t *point;
+  const splat_point_t *end;
+  float *sum;
+  size_t first_column, first_row;
+  size_t width, height;
+  size_t column, row;
+
+  first_column = tile % splat.columns * SPLAT_TILE_SIZE;
+  first_row = tile / splat.columns * SPLAT_TILE_SIZE;
+  width = (size_t) splat.width - first_column;
+  if (width > SPLAT_TILE_SIZE) {
+    width = SPLAT_TILE_SIZE;
+  }
+  height = (size_t) splat.height - first_row;
+  if (height > SPLAT_TILE_SIZE) {
+    height = SPLAT_TILE_SIZE;
+  }
+
+  memset(sums, 0, sizeof(sums));
+  end = &splat.points[splat.tile_starts[tile + 1]];
+  for (point = &splat.points[splat.tile_starts[tile]];  point < end;  ++point) {
+    sum = &sums[4 * point->pixel];
+    sum[0] += point->mass;
+    sum[1] += point->mass * point->rgb[0];
+    sum[2] += point->mass * point->rgb[1];
+    sum[3] += point->mass * point->rgb[2];
+  }
+
+  for (row = 0;  row < height;  ++row) {
+    for (column = 0;  column < width;  ++column) {
+      splat_tone_map(&sums[4 * (row * SPLAT_TILE_SIZE + column)],
+                     &splat.pixels[3 * ((first_row + row) * splat.width + first_column + column)]);
+    }
+  }
+}
+
+
+void splat_tone_map(const float *sum, unsigned char *pixel) {
+  /* Brightens the pixel with its density, along the same ramp
+     planet_color() uses for mass, so that a dense pixel goes white the way
+     a heavy planet does. */
+  double mass, density;
+  double r, g, b;
+
+  mass = sum[0];
+  if (mass <= 0.0) {
+    pixel[0] = pixel[1] = pixel[2] = 0;
+    return;
+  }
+
+  r = sum[1] / mass;
+  g = sum[2] / mass;
+  b = sum[3] / mass;
+  density = mass * splat.density_scale;
+  scale_color(MIN_BRIGHTNESS + (MAX_BRIGHTNESS - MIN_BRIGHTNESS) * density / (density + SPLAT_DENSITY_KNEE), &r, &g, &b);
+
+  pixel[0] = (unsigned char) (255.0 * r + 0.5);
+  pixel[1] = (unsigned char) (255.0 * g + 0.5);
+  pixel[2] = (unsigned char) (255.0 * b + 0.5);
+}
+
+
+void splat_draw(void) {
+  glMatrixMode(GL_MODELVIEW);
+  glPushMatrix();
+  glLoadIdentity();
+
+  glRasterPos2f(-1.0f, -1.0f);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glDrawPixels(splat.width, splat.height, GL_RGB, GL_UNSIGNED_BYTE, splat.pixels);
+
+  glPopMatrix();
+}
+
+
+void planet_color(const planet_t *planet, float *rgb) {
+  float value;
+  double r, g, b;
+
+  value = MIN_BRIGHTNESS + (MAX_BRIGHTNESS - MIN_BRIGHTNESS) * (planet->mass - MASS_MIN) / (MASS_MAX - MASS_MIN);
+
+  if (value < 0.0f) {
+    value = 0.0f;
+  }
+  if (value > 2.0f) {
+    value = 2.0f;
+  }
+
+  hue_to_rgb(planet->hue, &r, &g, &b);
+  scale_color(value, &r, &g, &b);
+
+  rgb[0] = (float) r;
+  rgb[1] = (float) g;
+  rgb[2] = (float) b;
+}
+
+
+void scale_color(double brightness, double *r, double *g, double *b) {
+  if (brightness < 1.0) {
+    *r *= brightness;
+    *g *= brightness;
+    *b *= brightness;
+  } else {
+    brightness = 2.0 - brightness;
+    *r = (1.0 - ((1.0 - *r) * brightness));
+    *g = (1.0 - ((1.0 - *g) * brightness));
+    *b = (1.0 - ((1.0 - *b) * brightness));
+  }
+}
+
+
+void draw_circle(double cx, double cy, double radius, int lod) {
+  size_t i;
+  float x, y;
+
+  glBegin(GL_TRIANGLE_FAN);
+    for (i = 0;  i < (CIRCLE_POLY_COUNT << lod);  i += circle_step) {
+      x = (float) (cx + radius * circle_cos[lod][i]);
+      y = (float) (cy + radius * circle_sin[lod][i]);
+      glVertex2f(x, y);
+    }
+  glEnd();
+}
+
+
+void draw_hud(void) {
+  /* One bar per phase, then one for the collision passes.  Bars are scaled so
+     that the full width of the overlay is one frame's worth of time (or every
+     allowed collision pass); the thin mark on each bar is its 99th percentile. */
+  static const float colors[PHASE_COUNT + 1][3] = {
+    {1.0f, 0.3f, 0.3f},  /* collision */
+    {1.0f, 0.7f, 0.2f},  /* force */
+    {1.0f, 1.0f, 0.3f},  /* move */
+    {0.3f, 1.0f, 0.3f},  /* render */
+    {0.3f, 0.8f, 1.0f},  /* readback */
+    {0.4f, 0.4f, 1.0f},  /* encode */
+    {0.5f, 0.5f, 0.5f},  /* wait */
+    {1.0f, 0.4f, 1.0f},  /* collision passes */
+  };
+  static const float mark_color[3] = {1.0f, 1.0f, 1.0f};
+  const double budget = 1.0 / FRAMES_PER_SECOND;
+  const double row = 0.03;
+  double passes_mean;
+  size_t passes_max;
+  double y;
+  int phase;
+
+  glMatrixMode(GL_MODELVIEW);
+  glPushMatrix();
+  glLoadIdentity();
+
+  y = -0.95;
+  for (phase = PHASE_COUNT - 1;  phase >= 0;  --phase, y += row) {
+    draw_hud_bar(y, 0.7 * row, stats_mean(phase) / budget, colors[phase]);
+    draw_hud_bar(y, 0.7 * row, stats_percentile(phase, 0.99) / budget, NULL);
+  }
+
+  stats_passes(&passes_mean, &passes_max);
+  draw_hud_bar(-0.95 - row, 0.7 * row, passes_mean / (COLLISION_ITERATION_MAX * ticks_per_frame), colors[PHASE_COUNT]);
+
+  /* The right edge of the overlay marks the frame budget. */
+  glColor3fv(mark_color);
+  glBegin(GL_LINES);
+    glVertex2f(-0.55f, (float) (-0.95 - row));
+    glVertex2f(-0.55f, (float) y);
+  glEnd();
+
+  glPopMatrix();
+}
+
+
+void draw_hud_bar(double y, double height, double value, const float *color) {
+  /* With no color, draws only a thin mark at the end of where the bar would be. */
+  const double left = -0.95;
+  const double width = 0.4;
+  double right;
+
+  if (value > 1.0) {
+    value = 1.0;
+  }
+  right = left + width * value;
+
+  if (color) {
+    glColor3fv(color);
+    glRectf((float) left, (float) y, (float) right, (float) (y + height));
+  } else {
+    glColor3f(1.0f, 1.0f, 1.0f);
+    glRectf((float) (right - 0.002), (float) y, (float) right, (float) (y + height));
+  }
+}
+
+
+int write_anim_frame(anim_spec_t anim, size_t frame_num, thread_arg_t *pool) {
+  /* pool, if there is one, has its workers help encode a QOI frame. */
+  char frame_path[64];
+  int width, height;
+  struct stat buf;
+
+  if (anim_frame_pathname(frame_path, sizeof(frame_path), frame_num, anim) == -1) {
+    return -1;
+  }
+  screen_size(&width, &height);
+  if (dump_screen(frame_path, width, height, pool) == -1) {
+    return -1;
+  }
+
+  ++exported_frames;
+  if (stat(frame_path, &buf) == 0) {
+    exported_bytes += buf.st_size;
+  }
+
+  return 0;
+}
+
+
+int anim_frame_pathname(char *dest, size_t size, size_t num, anim_spec_t anim) {
+  size_t dc;
+
+  dc = digit_count(anim.frame_count);
+  if (snprintf(dest, size, "%s/frame%0*lu.%s", anim.dir, (int) dc, num, frame_format == FRAME_QOI ? "qoi" : "png") >= size) {
+    fputs("Buffer to small to store frame path name!\n", stderr);
+    return -1;
+  }
+  return 0;
+}
+
+
+int dump_screen(const char *path, int width, int height, thread_arg_t *pool) {
+  static char *pixel_data = NULL;
+  double start;
+  int status;
+
+  if (pixel_data == NULL) {
+    pixel_data = my_malloc(3 * width * height);
+  }
+
+  start = phase_begin();
+  glReadBuffer(GL_FRONT);
+  glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixel_data);
+  phase_end(PHASE_READBACK, start);
+
+  start = phase_begin();
+  if (frame_format == FRAME_QOI) {
+    status = write_QOI(path, (unsigned char *) pixel_data, width, height, pool);
+  } else {
+    status = write_PNG(path, pixel_data, width, height);
+  }
+  phase_end(PHASE_ENCODE, start);
+
+  return status;
+}
+
+
+size_t digit_count(size_t num) {
+  size_t count = 0;
+
+  if (num == 0) {
+    return 1;
+  }
+
+  while (num > 0) {
+    ++count;
+    num /= 10;
+  }
+  return count;
+}
+
+
+int write_PNG(const char *path, char *pixels_rgb, int width, int height) {
+  /* Adapted from https://www.lemoda.net/c/write-png/ */
+
+  FILE * fp;
+  png_structp png_ptr = NULL;
+  png_infop info_ptr = NULL;
+  size_t y;
+  png_byte ** row_pointers = NULL;
+  /* "status" contains the return value of this function. At first
+     it is set to a value which means 'failure'. When the routine
+     has finished its work, it is set to a value which means 'success'. */
+  int status = -1;
+
+  int pixel_size = 3;
+  int depth = 8;
+  
+  fp = fopen(path, "wb");
+  if (!fp) {
+    goto fopen_failed;
+  }
+
+  png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (png_ptr == NULL) {
+    goto png_create_write_struct_failed;
+  }
+  
+  info_ptr = png_create_info_struct(png_ptr);
+  if (info_ptr == NULL) {
+    goto png_create_info_struct_failed;
+  }
+  
+  /* Set up error handling. */
+  if (setjmp (png_jmpbuf (png_ptr))) {
+      goto png_failure;
+  }
+  
+  png_set_IHDR (png_ptr,
+                info_ptr,
+                width,
+                height,
+                depth,
+                PNG_COLOR_TYPE_RGB,
+                PNG_INTERLACE_NONE,
+                PNG_COMPRESSION_TYPE_DEFAULT,
+                PNG_FILTER_TYPE_DEFAULT);
+  
+  /* Initialize rows of PNG. */
+  row_pointers = png_malloc(png_ptr, height * sizeof (png_byte *));
+  for (y = 0; y < height; y++) {
+      png_byte *row = png_malloc (png_ptr, sizeof (uint8_t) * width * pixel_size);
+      memcpy(row, pixels_rgb + y*width*pixel_size, width*pixel_size);
+      row_pointers[height - 1 - y] = row;
+  }
+  
+  /* Write the image data to "fp". */
+  png_init_io(png_ptr, fp);
+  png_set_rows(png_ptr, info_ptr, row_pointers);
+  png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+
+  /* The routine has successfully written the file, so we set
+     "status" to a value which indicates success. */
+  status = 0;
+  
+  for (y = 0; y < height; y++) {
+    png_free(png_ptr, row_pointers[y]);
+  }
+  png_free(png_ptr, row_pointers);
+  
+ png_failure:
+ png_create_info_struct_failed:
+  png_destroy_write_struct (&png_ptr, &info_ptr);
+ png_create_write_struct_failed:
+  fclose (fp);
+ fopen_failed:
+  return status;
+}
+
+
+int write_QOI(const char *path, const unsigned char *pixels_rgb, int width, int height, thread_arg_t *pool) {
+  /* Writes the frame in the Quite OK Image format (https://qoiformat.org/),
+     which for our black screens of flat disks is about as small as PNG and
+     many times faster to make.  The bands are encoded by the calling thread
+     and the workers in pool, if there is one. */
+  static const unsigned char end_marker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+  unsigned char header[QOI_HEADER_SIZE];
+  size_t thread_count;
+  size_t band_count;
+  size_t rows_max;
+  size_t i;
+  FILE *file;
+  int status = 0;
+
+  thread_count = pool && pool->threaded ? pool->worker_count + 1 : 1;
+  band_count = thread_count * QOI_BANDS_PER_THREAD;
+  if (band_count > QOI_BAND_MAX) {
+    band_count = QOI_BAND_MAX;
+  }
+  if (band_count > (size_t) height) {
+    band_count = height;
+  }
+
+  /* Nothing takes more than 4 bytes a pixel, but a band's first one takes 5. */
+  rows_max = (height + band_count - 1) / band_count;
+  if (qoi_encoder.band_count != band_count || qoi_encoder.band_capacity != 4 * width * rows_max + 1) {
+    qoi_encoder.band_count = band_count;
+    qoi_encoder.band_capacity = 4 * width * rows_max + 1;
+    qoi_encoder.out = my_realloc(qoi_encoder.out, band_count * qoi_encoder.band_capacity);
+  }
+  qoi_encoder.pixels = pixels_rgb;
+  qoi_encoder.width = width;
+  qoi_encoder.height = height;
+  qoi_encoder.next_band = 0;
+
+  if (thread_count > 1) {
+    run_pool_job(pool, qoi_encode_bands);
+  } else {
+    qoi_encode_bands(pool);
+  }
+
+  memcpy(header, "qoif", 4);
+  qoi_put_u32(header + 4, width);
+  qoi_put_u32(header + 8, height);
+  header[12] = 3;  /* RGB */
+  header[13] = 0;  /* sRGB */
+
+  file = fopen(path, "wb");
+  if (!file) {
+    fprintf(stderr, "Couldn't create %s: ", path);
+    perror(NULL);
+    return -1;
+  }
+  if (fwrite(header, sizeof(header), 1, file) != 1) {
+    status = -1;
+  }
+  for (i = 0;  i < band_count && status == 0;  ++i) {
+    if (fwrite(qoi_encoder.out + i * qoi_encoder.band_capacity, 1, qoi_encoder.band_sizes[i], file) !=
+        qoi_encoder.band_sizes[i]) {
+      status = -1;
+    }
+  }
+  if (status == 0 && fwrite(end_marker, sizeof(end_marker), 1, file) != 1) {
+    status = -1;
+  }
+  if (fclose(file) != 0) {
+    status = -1;
+  }
+  if (status < 0) {
+    fprintf(stderr, "Couldn't write %s: ", path);
+    perror(NULL);
+  }
+
+  return status;
+}
+
+
+void qoi_encode_bands(thread_arg_t *pool) {
+  /* Takes bands until there are none left.  Run by the main thread and any
+     workers in pool alike. */
+  size_t band;
+
+  while ((band = __sync_fetch_and_add(&qoi_encoder.next_band, 1)) < qoi_encoder.band_count) {
+    qoi_encoder.band_sizes[band] = qoi_encode_band(qoi_encoder.out + band * qoi_encoder.band_capacity,
+                                                   qoi_encoder.height * band / qoi_encoder.band_count,
+                                                   qoi_encoder.height * (band + 1) / qoi_encoder.band_count);
+  }
+}
+
+
+size_t qoi_encode_band(unsigned char *out, int first_row, int end_row) {
+  /* Encodes rows first_row up to end_row, counting from the top, and returns
+     how many bytes that took.  Colors are packed as 0xAARRGGBB.  The one
+     before the band is taken to be transparent, which no pixel is, so the
+     first pixel can't be a run, a difference or a color in the index. */
+  const int width = qoi_encoder.width;
+  uint32_t index[64];
+  const unsigned char *rgb;
+  unsigned char *start = out;
+  uint32_t prev, pixel;
+  signed char r_diff, g_diff, b_diff;
+  signed char rg_diff, bg_diff;
+  unsigned run = 0;
+  unsigned hash;
+  int row, column;
+
+  memset(index, 0, sizeof(index));
+  prev = 0;
+
+  for (row = first_row;  row < end_row;  ++row) {
+    rgb = qoi_encoder.pixels + 3 * (size_t) width * (qoi_encoder.height - 1 - row);
+    for (column = 0;  column < width;  ++column, rgb += 3) {
+      pixel = 0xff000000u | (uint32_t) rgb[0] << 16 | (uint32_t) rgb[1] << 8 | rgb[2];
+
+      if (pixel == prev) {
+        if (++run == QOI_RUN_MAX) {
+          *out++ = QOI_OP_RUN | (run - 1);
+          run = 0;
+        }
+        continue;
+      }
+
+      if (run) {
+        *out++ = QOI_OP_RUN | (run - 1);
+        run = 0;
+      }
+
+      hash = (rgb[0] * 3 + rgb[1] * 5 + rgb[2] * 7 + 255 * 11) % 64;
+      if (index[hash] == pixel) {
+        *out++ = QOI_OP_INDEX | hash;
+        prev = pixel;
+        continue;
+      }
+      index[hash] = pixel;
+
+      if (!(prev >> 24)) {
+        *out++ = QOI_OP_RGBA;
+        *out++ = rgb[0];
+        *out++ = rgb[1];
+        *out++ = rgb[2];
+        *out++ = 255;
+        prev = pixel;
+        continue;
+      }
+
+      r_diff = (signed char) (rgb[0] - (unsigned char) (prev >> 16));
+      g_diff = (signed char) (rgb[1] - (unsigned char) (prev >> 8));
+      b_diff = (signed char) (rgb[2] - (unsigned char) prev);
+      rg_diff = r_diff - g_diff;
+      bg_diff = b_diff - g_diff;
+
+      if (r_diff >= -2 && r_diff <= 1 && g_diff >= -2 && g_diff <= 1 && b_diff >= -2 && b_diff <= 1) {
+        *out++ = QOI_OP_DIFF | (r_diff + 2) << 4 | (g_diff + 2) << 2 | (b_diff + 2);
+      } else if (g_diff >= -32 && g_diff <= 31 && rg_diff >= -8 && rg_diff <= 7 && bg_diff >= -8 && bg_diff <= 7) {
+        *out++ = QOI_OP_LUMA | (g_diff + 32);
+        *out++ = (rg_diff + 8) << 4 | (bg_diff + 8);
+      } else {
+        *out++ = QOI_OP_RGB;
+        *out++ = rgb[0];
+        *out++ = rgb[1];
+        *out++ = rgb[2];
+      }
+      prev = pixel;
+    }
+  }
+
+  if (run) {
+    *out++ = QOI_OP_RUN | (run - 1);
+  }
+
+  return out - start;
+}
+
+
+void qoi_put_u32(unsigned char *out, uint32_t value) {
+  out[0] = value >> 24;
+  out[1] = value >> 16;
+  out[2] = value >> 8;
+  out[3] = value;
+}
+
+
+int read_QOI(const char *path, unsigned char **pixels_rgb, int *width, int *height) {
+  /* Reads any RGB or RGBA QOI file into RGB pixels, bottom row first, as
+     write_PNG() takes them.  Alpha is dropped. */
+  unsigned char index[64][4];
+  unsigned char pixel[4] = {0, 0, 0, 255};
+  unsigned char *data;
+  unsigned char *rgb;
+  unsigned char op;
+  struct stat buf;
+  size_t size, pos;
+  size_t pixel_count;
+  size_t i;
+  unsigned run = 0;
+  signed char g_diff;
+  FILE *file;
+  int row, column;
+
+  file = fopen(path, "rb");
+  if (!file || fstat(fileno(file), &buf) < 0) {
+    fprintf(stderr, "Couldn't open %s: ", path);
+    perror(NULL);
+    if (file) {
+      fclose(file);
+    }
+    return -1;
+  }
+  size = buf.st_size;
+  data = my_malloc(size ? size : 1);
+  if (fread(data, 1, size, file) != size) {
+    fprintf(stderr, "Couldn't read %s: ", path);
+    perror(NULL);
+    fclose(file);
+    free(data);
+    return -1;
+  }
+  fclose(file);
+
+  if (size < QOI_HEADER_SIZE + 8 || memcmp(data, "qoif", 4) != 0 || data[12] < 3 || data[12] > 4) {
+    fprintf(stderr, "%s isn't a QOI file.\n", path);
+    free(data);
+    return -1;
+  }
+  *width = (int) ((uint32_t) data[4] << 24 | data[5] << 16 | data[6] << 8 | data[7]);
+  *height = (int) ((uint32_t) data[8] << 24 | data[9] << 16 | data[10] << 8 | data[11]);
+  if (*width <= 0 || *height <= 0 || (size_t) *width * *height > 400000000) {
+    fprintf(stderr, "%s is too big.\n", path);
+    free(data);
+    return -1;
+  }
+
+  pixel_count = (size_t) *width * *height;
+  *pixels_rgb = my_malloc(3 * pixel_count);
+  memset(index, 0, sizeof(index));
+  pos = QOI_HEADER_SIZE;
+  size -= 8;  /* the end marker */
+
+  for (i = 0;  i < pixel_count;  ++i) {
+    if (run) {
+      --run;
+    } else {
+      if (pos >= size) {
+        goto cut_short;
+      }
+      op = data[pos++];
+      if (op == QOI_OP_RGB) {
+        if (pos + 3 > size) {
+          goto cut_short;
+        }
+        memcpy(pixel, data + pos, 3);
+        pos += 3;
+      } else if (op == QOI_OP_RGBA) {
+        if (pos + 4 > size) {
+          goto cut_short;
+        }
+        memcpy(pixel, data + pos, 4);
+        pos += 4;
+      } else if ((op & QOI_MASK_2) == QOI_OP_INDEX) {
+        memcpy(pixel, index[op], 4);
+      } else if ((op & QOI_MASK_2) == QOI_OP_DIFF) {
+        pixel[0] += ((op >> 4) & 3) - 2;
+        pixel[1] += ((op >> 2) & 3) - 2;
+        pixel[2] += (op & 3) - 2;
+      } else if ((op & QOI_MASK_2) == QOI_OP_LUMA) {
+        if (pos + 1 > size) {
+          goto cut_short;
+        }
+        g_diff = (signed char) ((op & 0x3f) - 32);
+        pixel[0] += g_diff - 8 + (data[pos] >> 4);
+        pixel[1] += g_diff;
+        pixel[2] += g_diff - 8 + (data[pos] & 0x0f);
+        ++pos;
+      } else {
+        run = op & 0x3f;
+      }
+    }
+    memcpy(index[(pixel[0] * 3 + pixel[1] * 5 + pixel[2] * 7 + pixel[3] * 11) % 64], pixel, 4);
+
+    row = *height - 1 - (int) (i / *width);
+    column = (int) (i % *width);
+    rgb = *pixels_rgb + 3 * ((size_t) row * *width + column);
+    memcpy(rgb, pixel, 3);
+  }
+
+  free(data);
+
+  return 0;
+
+cut_short:
+  fprintf(stderr, "%s is cut short.\n", path);
+  free(data);
+  free(*pixels_rgb);
+  return -1;
+}
+
+
+int convert_QOI_frames(const char *dir) {
+  /* Writes a PNG next to every QOI frame in the directory, for tools that
+     can't read QOI. */
+  char path[PATH_MAX];
+  unsigned char *pixels;
+  struct dirent *entry;
+  size_t converted = 0;
+  size_t len;
+  int width, height;
+  int status = 0;
+  DIR *frames;
+
+  frames = opendir(dir);
+  if (!frames) {
+    fprintf(stderr, "Couldn't open directory %s: ", dir);
+    perror(NULL);
+    return -1;
+  }
+
+  while (status == 0 && (entry = readdir(frames)) != NULL) {
+    len = strlen(entry->d_name);
+    if (len < 4 || strcmp(entry->d_name + len - 4, ".qoi") != 0) {
+      continue;
+    }
+    if (snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= (int) sizeof(path)) {
+      fprintf(stderr, "The path of %s is too long.\n", entry->d_name);
+      status = -1;
+      break;
+    }
+    if (read_QOI(path, &pixels, &width, &height) < 0) {
+      status = -1;
+      break;
+    }
+    strcpy(path + strlen(path) - 4, ".png");
+    if (write_PNG(path, (char *) pixels, width, height) < 0) {
+      fprintf(stderr, "Couldn't write %s.\n", path);
+      status = -1;
+    }
+    free(pixels);
+    ++converted;
+  }
+
+  closedir(frames);
+  if (status == 0) {
+    fprintf(stderr, "Converted %lu frames.\n", converted);
+  }
+
+  return status;
+}
+#endif
+
+
+void tick_planets(thread_arg_t *thread_arg) {
+  double start;
+
+  if (thread_arg->neighbors) {
+    ++thread_arg->neighbors->ticks;
+  }
+
+  if (physics->reorder_interval && thread_arg->tick % physics->reorder_interval == 0) {
+    start = trace_begin();
+    reorder_planets(thread_arg->planets, thread_arg->neighbors);
+    thread_arg->candidates_valid = 0;
+    trace_end("reorder", start, thread_arg->planets->size);
+  }
+
+  if (thread_arg->partitioned && thread_arg->tick % REHOME_INTERVAL == 0) {
+    rehome_planets(thread_arg);
+  }
+
+  if (!physics->swept_collisions) {
+    start = phase_begin();
+    if (thread_arg->neighbors) {
+      neighbor_list_update(thread_arg->neighbors, thread_arg->planets, forces_single_writer(thread_arg));
+    }
+    stats_add_collision_passes(resolve_collisions(thread_arg));
+    phase_end(PHASE_COLLISION, start);
+  }
+
+  start = phase_begin();
+  if (thread_arg->neighbors) {
+    neighbor_list_update(thread_arg->neighbors, thread_arg->planets, forces_single_writer(thread_arg));
+  }
+  thread_arg->measuring_energy = energy_interval && thread_arg->tick % energy_interval == 0;
+  /* With neighbor lists, every candidate pair has to be within the cutoff
+     to be looked at. */
+  thread_arg->fusing = !physics->swept_collisions && !thread_arg->single_precision && !thread_arg->fixed_point &&
+                       (!thread_arg->neighbors || physics->force_cutoff >= 2.0 * radius_for_mass(MASS_MAX) + COLLISION_SKIN);
+  calculate_forces(thread_arg);
+  thread_arg->candidates_valid = thread_arg->fusing;
+  thread_arg->fusing = 0;
+  phase_end(PHASE_FORCE, start);
+
+  if (thread_arg->measuring_energy) {
+    if (energy_monitor_sample(thread_arg->tick, thread_arg->planets) < 0) {
+      quitting = 1;
+    }
+    thread_arg->measuring_energy = 0;
+  }
+
+  if (!physics->swept_collisions) {
+    start = phase_begin();
+    /* The candidates still hold if no two planets closed in by more than the skin. */
+    if (move_planets(thread_arg->planets) > 0.25 * COLLISION_SKIN * COLLISION_SKIN) {
+      thread_arg->candidates_valid = 0;
+    }
+    if (thread_arg->single_precision) {
+      round_to_float(thread_arg->planets);
+    }
+    if (thread_arg->fixed_point) {
+      round_to_fixed(thread_arg->planets);
+    }
+    if (physics->open_world) {
+      remove_escaped_planets(thread_arg);
+    }
+    phase_end(PHASE_MOVE, start);
+    return;
+  }
+
+  /* Velocities are fixed for the rest of the tick, so every planet moves in a
+     straight line and we can find exactly when pairs touch along the way. */
+  start = phase_begin();
+  accelerate_planets(thread_arg->planets);
+  phase_end(PHASE_MOVE, start);
+
+  start = phase_begin();
+  stats_add_collision_passes(resolve_swept_collisions(thread_arg->planets, thread_arg->neighbors, thread_arg->tick));
+  phase_end(PHASE_COLLISION, start);
+
+  start = phase_begin();
+  drift_planets(thread_arg->planets);
+  if (thread_arg->single_precision) {
+    round_to_float(thread_arg->planets);
+  }
+  if (thread_arg->fixed_point) {
+    round_to_fixed(thread_arg->planets);
+  }
+  if (physics->open_world) {
+    remove_escaped_planets(thread_arg);
+  }
+  phase_end(PHASE_MOVE, start);
+}
+
+
+size_t resolve_collisions(thread_arg_t *thread_arg) {
+  /* Returns the number of detection passes that were needed.  The groups are
+     resolved as tasks, shared out among the force workers. */
+  planet_list_t *planets = thread_arg->planets;
+  neighbor_list_t *neighbors = thread_arg->neighbors;
+  planet_list_t *collision_lists;
+  size_t list_capacity;
+  planet_list_t new_planets;
+  size_t collision_count;
+  size_t col_it;
+
+  list_init(&new_planets);
+
+  /* There can't be more groups than planets.  Every list is left empty
+     after each pass, so only the part added when growing needs clearing. */
+  list_capacity = planets->size;
+  collision_lists = calloc(list_capacity ? list_capacity : 1, sizeof(*collision_lists));
+  if (!collision_lists) {
+    perror("calloc()");
+    exit(1);
+  }
+
+  for (col_it = 0;  col_it < COLLISION_ITERATION_MAX;  ++col_it) {
+    collision_count = 0;
+
+    if (planets->size > list_capacity) {
+      collision_lists = my_realloc(collision_lists, planets->size * sizeof(*collision_lists));
+      memset(collision_lists + list_capacity, 0, (planets->size - list_capacity) * sizeof(*collision_lists));
+      list_capacity = planets->size;
+    }
+
+    if (thread_arg->candidates_valid) {
+      /* The force pass already found every pair that could overlap. */
+      find_candidate_collisions(thread_arg, collision_lists, &collision_count);
+      thread_arg->candidates_valid = 0;
+    } else {
+      find_collision_groups(planets, neighbors, &new_planets, collision_lists, &collision_count);
+    }
+    list_delete(&new_planets);
+
+    if (collision_count && neighbors) {
+      /* Planets are about to be freed and created, so the lists are stale. */
+      neighbors->valid = 0;
+    }
+
+    run_task_round(thread_arg, collision_lists, collision_count, &new_planets);
+
+    if (!new_planets.size) {
+      break;
+    }
+  }
+
+  list_delete(&new_planets);
+  free(collision_lists);
+
+  return col_it < COLLISION_ITERATION_MAX ? col_it + 1 : COLLISION_ITERATION_MAX;
+}
+
+
+planet_t *resolve_collision_group(planet_list_t *planets, planet_list_t *collision, planet_list_t *new_planets, size_t tick, planet_list_t *dead) {
+  /* We need to merge all the planets involved in the collision into a single planet
+     with the same mass and momentum as the entire group, located at the group's
+     center of mass.  Returns the merged planet, which is also on new_planets if it
+     had to be split.  The planets merged away are freed, unless a dead list is
+     given to hold them, in which case they are only retired. */
+  planet_node_t *node;
+  planet_t *planet;
+
+  planet = merge_collision_group(collision);
+  if (!planet) {
+    return NULL;
+  }
+
+  list_remove_all(planets, collision);
+  if (dead) {
+    for (node = collision->first;  node;  node = node->next) {
+      ++node->planet->generation;
+      list_add(dead, node->planet);
+    }
+  } else {
+    delete_planets(collision);
+  }
+
+  if (planet->mass > MASS_MAX) {
+    /* It's too big!  We have to break it up. */
+    split_planet(planets, planet, new_planets, tick, NULL);
+  }
+
+  return planet;
+}
+
+
+planet_t *merge_collision_group(planet_list_t *collision) {
+  /* Turns the first planet of the group into the merged one, taking it off
+     the group.  The rest are left on the group, and on the world, for the
+     caller to dispose of. */
+  planet_node_t *node;
+  planet_t *planet;
+
+  double total_x_pos, total_y_pos;
+  double total_x_vel, total_y_vel;
+  double total_mass;
+
+  double hue;
+  size_t hue_tick;
+
+  double x_pos, y_pos;
+  double x_vel, y_vel;
+
+  double first_x, first_y;
+
+  double energy_before = 0.0;
+
+  if (!collision->size) {
+    return NULL;
+  }
+
+  if (energy_interval) {
+    energy_before = group_energy(collision);
+  }
+
+  total_x_pos = total_y_pos = 0.0;
+  total_x_vel = total_y_vel = 0.0;
+  total_mass = 0.0;
+
+  find_oldest_hue(collision, &hue, &hue_tick);
+
+  first_x = collision->first->planet->x_pos;
+  first_y = collision->first->planet->y_pos;
+
+  for (node = collision->first;  node;  node = node->next) {
+    planet = node->planet;
+
+    x_pos = planet->x_pos;
+    y_pos = planet->y_pos;
+
+    if (!physics->open_world) {
+      if (x_pos - first_x > 0.5 * WORLD_WIDTH) {
+        x_pos -= WORLD_WIDTH;
+      }
+      if (first_x - x_pos > 0.5 * WORLD_WIDTH) {
+        x_pos += WORLD_WIDTH;
+      }
+      if (y_pos - first_y > 0.5 * WORLD_HEIGHT) {
+        y_pos -= WORLD_HEIGHT;
+      }
+      if (first_y - y_pos > 0.5 * WORLD_HEIGHT) {
+        y_pos += WORLD_HEIGHT;
+      }
+    }
+
+    total_x_pos += x_pos * planet->mass;
+    total_y_pos += y_pos * planet->mass;
+
+    total_x_vel += planet->x_vel * planet->mass;
+    total_y_vel += planet->y_vel * planet->mass;
+
+    total_mass += planet->mass;
+
+    if ((hue == -1.0) || (planet->hue_tick > hue_tick && rand_normal() < 0.35)) {
+      hue = planet->hue;
+      hue_tick = planet->hue_tick;
+    }
+  }
+
+  x_pos = total_x_pos / total_mass;
+  y_pos = total_y_pos / total_mass;
+  if (!physics->open_world) {
+    x_pos = mod_double(x_pos, 0, WORLD_WIDTH);
+    y_pos = mod_double(y_pos, 0, WORLD_HEIGHT);
+  }
+
+  x_vel = total_x_vel / total_mass;
+  y_vel = total_y_vel / total_mass;
+
+  planet = list_remove_first(collision);
+
+  planet_init(planet, x_pos, y_pos, x_vel, y_vel, total_mass, hue, hue_tick);
+
+  if (energy_interval) {
+    collision_energy_add(0.5 * total_mass * (x_vel * x_vel + y_vel * y_vel) - energy_before);
+  }
+
+  return planet;
+}
+
+
+void run_task_round(thread_arg_t *pool, planet_list_t *collision_lists, size_t collision_count, planet_list_t *new_planets) {
+  /* Resolves every group as a task, then commits them all in group order.
+     The seeds are handed out here, so the outcome is the same however the
+     tasks get scheduled, and with or without threads. */
+  planet_node_t *node;
+  task_t **tasks;
+  size_t i;
+
+  if (!collision_count) {
+    return;
+  }
+
+  if (pool->deque_count != pool->worker_count + 1) {
+    task_deques_delete(pool);
+    task_deques_init(pool, pool->worker_count + 1);
+  }
+
+  tasks = my_malloc(collision_count * sizeof(*tasks));
+  pool->tasks_outstanding = collision_count;
+  for (i = 0;  i < collision_count;  ++i) {
+    tasks[i] = task_new(pool, &collision_lists[i], NULL, pool->tick, rand_r(&rand_seed));
+    /* Deal them out, so the workers needn't all steal from us to start. */
+    task_push(&pool->deques[i % pool->deque_count], tasks[i]);
+  }
+
+  task_index = pool->worker_count;
+
+  if (pool->threaded && pool->worker_count) {
+    run_pool_job(pool, run_tasks);
+  } else {
+    run_tasks(pool);
+  }
+
+  /* What's left on the groups was merged away.  It all comes off the world
+     in one walk, rather than one walk per group. */
+  for (i = 0;  i < collision_count;  ++i) {
+    for (node = collision_lists[i].first;  node;  node = node->next) {
+      node->planet->collision_list = COLLISION_LIST_DEAD;
+    }
+  }
+  list_remove_dead(pool->planets);
+
+  for (i = 0;  i < collision_count;  ++i) {
+    task_commit(tasks[i], pool->planets, new_planets);
+    list_delete(&collision_lists[i]);
+  }
+
+  free(tasks);
+}
+
+
+task_t *task_new(thread_arg_t *pool, planet_list_t *group, planet_t *planet, size_t tick, unsigned seed) {
+  task_t *task;
+
+  task = my_malloc(sizeof(*task));
+  task->pool = pool;
+  task->group = group;
+  task->planet = planet;
+  task->tick = tick;
+  task->seed = seed;
+  list_init(&task->born);
+  list_init(&task->split);
+  task->energy = 0.0;
+  task->first_child = NULL;
+  task->last_child = NULL;
+  task->next_sibling = NULL;
+
+  return task;
+}
+
+
+void task_run(task_t *task) {
+  unsigned saved_seed;
+  size_t saved_id;
+  planet_t *planet;
+
+  /* The task's own stream, ids that get replaced when it's committed, and
+     energy that's only added to collision_energy then. */
+  saved_seed = rand_seed;
+  saved_id = next_planet_id;
+  rand_seed = task->seed;
+  running_task = task;
+
+  if (task->group) {
+    planet = merge_collision_group(task->group);
+  } else {
+    planet = task->planet;
+  }
+
+  if (planet && (!task->group || planet->mass > MASS_MAX)) {
+    split_planet(&task->born, planet, &task->split, task->tick, task);
+  }
+
+  running_task = NULL;
+  rand_seed = saved_seed;
+  next_planet_id = saved_id;
+}
+
+
+void task_spawn(task_t *parent, planet_t *planet) {
+  /* Hands a planet that's still too big to a task of its own, which the
+     other workers are free to steal. */
+  task_t *task;
+
+  task = task_new(parent->pool, NULL, planet, parent->tick, rand_r(&rand_seed));
+
+  if (parent->last_child) {
+    parent->last_child->next_sibling = task;
+  } else {
+    parent->first_child = task;
+  }
+  parent->last_child = task;
+
+  __sync_fetch_and_add(&parent->pool->tasks_outstanding, 1);
+  task_push(&parent->pool->deques[task_index], task);
+}
+
+
+void task_commit(task_t *task, planet_list_t *planets, planet_list_t *new_planets) {
+  /* Adds what the task and its children made to the world, and frees them
+     and what the task merged away, which is already off the world. */
+  planet_node_t *node;
+  task_t *child;
+  task_t *next;
+
+  if (task->group) {
+    delete_planets(task->group);
+  }
+
+  collision_energy += task->energy;
+  for (node = task->born.first;  node;  node = node->next) {
+    node->planet->id = next_planet_id;
+    next_planet_id += planet_id_stride;
+  }
+  list_move_all(planets, &task->born);
+  list_move_all(new_planets, &task->split);
+
+  for (child = task->first_child;  child;  child = next) {
+    next = child->next_sibling;
+    task_commit(child, planets, new_planets);
+  }
+
+  free(task);
+}
+
+
+void run_tasks(thread_arg_t *pool) {
+  /* Works through our own deque, newest first, then steals the oldest tasks
+     from the others, until every task of the round is done. */
+  task_t *task;
+  size_t i;
+
+  for (;;) {
+    task = task_pop(&pool->deques[task_index]);
+    for (i = 1;  !task && i < pool->deque_count;  ++i) {
+      task = task_steal(&pool->deques[(task_index + i) % pool->deque_count]);
+    }
+
+    if (task) {
+      task_run(task);
+      /* Only now, after its children have been counted in. */
+      __sync_fetch_and_sub(&pool->tasks_outstanding, 1);
+    } else if (!pool->tasks_outstanding) {
+      return;
+    } else {
+      sched_yield();
+    }
+  }
+}
+
+
+void run_pool_job(thread_arg_t *pool, void (*job)(thread_arg_t *pool)) {
+  /* Has the workers, wherever they're waiting, join the main thread in
+     job(), and returns once every one of them is out of it again. */
+  pthread_mutex_lock(&pool->mutex);
+    pool->job = job;
+    ++pool->task_round;
+    pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+
+  job(pool);
+
+  pthread_mutex_lock(&pool->mutex);
+    pool->job = NULL;
+    while (pool->task_workers > 0) {
+      pthread_cond_wait(&pool->cond, &pool->mutex);
+    }
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+
+void task_deques_init(thread_arg_t *pool, size_t count) {
+  size_t i;
+
+  pool->deques = my_malloc(count * sizeof(*pool->deques));
+  pool->deque_count = count;
+
+  for (i = 0;  i < count;  ++i) {
+    pool->deques[i].capacity = 64;
+    pool->deques[i].tasks = my_malloc(pool->deques[i].capacity * sizeof(*pool->deques[i].tasks));
+    pool->deques[i].top = 0;
+    pool->deques[i].bottom = 0;
+    pthread_mutex_init(&pool->deques[i].mutex, 0);
+  }
+}
+
+
+void task_deques_delete(thread_arg_t *pool) {
+  size_t i;
+
+  for (i = 0;  i < pool->deque_count;  ++i) {
+    free(pool->deques[i].tasks);
+    pthread_mutex_destroy(&pool->deques[i].mutex);
+  }
+
+  free(pool->deques);
+  pool->deques = NULL;
+  pool->deque_count = 0;
+}
+
+
+void task_push(task_deque_t *deque, task_t *task) {
+  pthread_mutex_lock(&deque->mutex);
+    if (deque->bottom == deque->capacity) {
+      deque->capacity *= 2;
+      deque->tasks = my_realloc(deque->tasks, deque->capacity * sizeof(*deque->tasks));
+    }
+    deque->tasks[deque->bottom++] = task;
+  pthread_mutex_unlock(&deque->mutex);
+}
+
+
+task_t *task_pop(task_deque_t *deque) {
+  task_t *task = NULL;
+
+  pthread_mutex_lock(&deque->mutex);
+    if (deque->bottom > deque->top) {
+      task = deque->tasks[--deque->bottom];
+    }
+    if (deque->bottom == deque->top) {
+      deque->top = deque->bottom = 0;
+    }
+  pthread_mutex_unlock(&deque->mutex);
+
+  return task;
+}
+
+
+task_t *task_steal(task_deque_t *deque) {
+  task_t *task = NULL;
+
+  pthread_mutex_lock(&deque->mutex);
+    if (deque->bottom > deque->top) {
+      task = deque->tasks[deque->top++];
+    }
+    if (deque->bottom == deque->top) {
+      deque->top = deque->bottom = 0;
+    }
+  pthread_mutex_unlock(&deque->mutex);
+
+  return task;
+}
+
+
+void find_oldest_hue(const planet_list_t *planets, double *hue, size_t *hue_tick) {
+  const planet_node_t *node;
+  const planet_t *planet;
+
+  *hue_tick = (size_t) -1;
+
+  for (node = planets->first;  node;  node = node->next) {
+    planet = node->planet;
+
+    if (planet->hue_tick < *hue_tick) {
+      *hue = planet->hue;
+      *hue_tick = planet->hue_tick;
+    }
+  }
+}
+
+
+void split_planet(planet_list_t *planets, planet_t *planet, planet_list_t *new_planets, size_t tick, task_t *spawner) {
+  /* With a spawner, children that are still too big are split by tasks of
+     their own rather than recursively.  Where the children go is worked
+     out for all of them first, in a loop of nothing but table lookups and
+     arithmetic, and then they're made. */
+  size_t child_count;
+  size_t i;
+
+  size_t angle_step;
+  double rotate_cos, rotate_sin;
+  double x_dir, y_dir;
+
+  double distance;
+
+  double radius;
+
+  double x_pos, y_pos;
+  double x_vel, y_vel;
+
+  double child_x_pos[SPLIT_COUNT_MAX], child_y_pos[SPLIT_COUNT_MAX];
+  double child_x_vel[SPLIT_COUNT_MAX], child_y_vel[SPLIT_COUNT_MAX];
+  double child_mass;
+  double child_hue;
+  size_t child_hue_tick;
+
+  double this_child_hue;
+  size_t this_child_hue_tick;
+
+  double speed;
+
+  double energy;
+
+  child_count = SPLIT_COUNT_MIN + (size_t) ((SPLIT_COUNT_MAX - SPLIT_COUNT_MIN + 1) * rand_normal());
+  child_mass = planet->mass / child_count;
+  child_hue = planet->hue;
+  child_hue_tick = planet->hue_tick;
+
+  /* The children are spread evenly around a circle with a random orientation. */
+  angle_step = (size_t) (SPLIT_ANGLE_STEPS * rand_normal());
+  rotate_cos = split_angle_cos[angle_step];
+  rotate_sin = split_angle_sin[angle_step];
+
+  radius = radius_for_mass(child_mass);
+
+  distance = sqrt((radius + 5.0) / (1 - split_cos[child_count][1]));
+
+  x_pos = planet->x_pos;
+  y_pos = planet->y_pos;
+  x_vel = planet->x_vel;
+  y_vel = planet->y_vel;
+
+  energy = calculate_split_energy(child_mass, child_count, distance, SPLIT_DISTANCE);
+
+  /*
+   * e = 1/2 m * v^2
+   * 2e = m * v^2
+   * v^2 = 2e / m
+   * v = sqrt(2e / m)
+   */
+  speed = sqrt(2 * energy / child_mass);
+
+  if (energy_interval) {
+    /* Each child gets the same kick away from the others, so together they
+       keep the parent's momentum and gain count times the kick's energy. */
+    collision_energy_add(child_count * energy + split_potential(child_mass, child_count, distance, radius));
+  }
+
+  for (i = 0;  i < child_count;  ++i) {
+    x_dir = rotate_cos * split_cos[child_count][i] - rotate_sin * split_sin[child_count][i];
+    y_dir = rotate_sin * split_cos[child_count][i] + rotate_cos * split_sin[child_count][i];
+
+    child_x_pos[i] = x_pos + distance * x_dir;
+    child_y_pos[i] = y_pos + distance * y_dir;
+
+    child_x_vel[i] = x_vel + speed * (x_dir * split_move_cos - y_dir * split_move_sin);
+    child_y_vel[i] = y_vel + speed * (y_dir * split_move_cos + x_dir * split_move_sin);
+  }
+
+  for (i = 0;  i < child_count;  ++i) {
+    this_child_hue = child_hue;
+    this_child_hue_tick = child_hue_tick;
+
+    if (rand_normal() < 0.0005) {
+      this_child_hue = 360.0 * rand_normal();
+      this_child_hue_tick = tick;
+    }
+
+    if (!i) {
+      planet_init(planet, child_x_pos[i], child_y_pos[i], child_x_vel[i], child_y_vel[i], child_mass, this_child_hue, this_child_hue_tick);
+    } else {
+      planet = planet_new(child_x_pos[i], child_y_pos[i], child_x_vel[i], child_y_vel[i], child_mass, this_child_hue, this_child_hue_tick);
+      list_add(planets, planet);
+    }
+
+    list_add(new_planets, planet);
+
+    if (planet->mass > MASS_MAX) {
+      /* It's too big!  We have to break it up. */
+      if (spawner) {
+        task_spawn(spawner, planet);
+      } else {
+        split_planet(planets, planet, new_planets, tick, NULL);
+      }
+    }
+  }
+}
+
+
+double calculate_split_energy(double mass, size_t count, double r1, double r2) {
+  double constant;
+
+  constant = 0.5 * G * mass * mass * (1/r1 - 1/r2);
+
+  return constant * split_energy_sums[count];
+}
+
+
+double split_energy_sum(size_t count) {
+  /* The part of the split energy that depends only on the number of children. */
+  double sum;
+  double alpha;
+  double alpha_diff;
+  size_t i;
+
+  sum = 0.0;
+
+  alpha_diff = 2 * M_PI / count;
+
+  for (i = 1;  i < count;  ++i) {
+    alpha = i * alpha_diff;
+    sum += sin(0.5 * alpha) / (1 - cos(alpha));
+  }
+
+  return sum;
+}
+
+
+void delete_planets(planet_list_t *planets) {
+  planet_node_t *node;
+
+  for (node = planets->first;  node;  node = node->next) {
+    free(node->planet);
+  }
+}
+
+
+void find_collision_groups(planet_list_t *planets, neighbor_list_t *neighbors, planet_list_t *new_planets, planet_list_t *collision_lists, size_t *collision_count) {
+  if (physics->open_world) {
+    find_collision_groups_kernel(planets, neighbors, new_planets, collision_lists, collision_count, 1);
+  } else {
+    find_collision_groups_kernel(planets, neighbors, new_planets, collision_lists, collision_count, 0);
+  }
+}
+
+
+BOUNDARY_KERNEL void find_collision_groups_kernel(planet_list_t *planets, neighbor_list_t *neighbors, planet_list_t *new_planets,
+                                                  planet_list_t *collision_lists, size_t *collision_count, const int open) {
+  planet_node_t *node_a;
+  planet_node_t *node_b;
+
+  planet_t *planet_a;
+  planet_t *planet_b;
+
+  size_t i, j;
+
+  if (neighbors && neighbors->valid && !new_planets->size) {
+    /* Anything close enough to collide is on the neighbor lists. */
+    for (i = 0;  i < neighbors->body_count;  ++i) {
+      planet_a = neighbors->bodies[i];
+      for (j = neighbors->start[i];  j < neighbors->start[i + 1];  ++j) {
+        planet_b = neighbors->neighbors[j];
+
+        if (planet_a->collision_list == COLLISION_LIST_NONE ||
+            planet_a->collision_list != planet_b->collision_list) {
+          resolve_collision_pair(planet_a, planet_b, collision_lists, collision_count, open);
+        }
+      }
+    }
+    return;
+  }
+
+  if (new_planets->size && find_new_planet_collisions(planets, new_planets, collision_lists, collision_count, open)) {
+    return;
+  }
+
+  for (node_a = new_planets->size ? new_planets->first : planets->first;  node_a;  node_a = node_a->next) {
+    planet_a = node_a->planet;
+    for (node_b = new_planets->size ? planets->first : node_a->next;  node_b;  node_b = node_b->next) {
+      planet_b = node_b->planet;
+
+      if (planet_a == planet_b) {
+        continue;
+      }
+
+      if (planet_a->collision_list == COLLISION_LIST_NONE ||
+          planet_a->collision_list != planet_b->collision_list) {
+        resolve_collision_pair(planet_a, planet_b, collision_lists, collision_count, open);
+      }
+    }
+  }
+}
+
+
+BOUNDARY_KERNEL int find_new_planet_collisions(planet_list_t *planets, planet_list_t *new_planets,
+                                               planet_list_t *collision_lists, size_t *collision_count, const int open) {
+  /* Checks each new planet against only the planets in the 3x3 cells around
+     it, in a grid of cells at least as wide as the biggest two planets can
+     be apart and still overlap, and with no more cells than planets.  So a
+     pass after a split costs about as much as one walk through the list,
+     however many children it made.  Returns 0, having checked nothing, if
+     a periodic world would be fewer than three cells across. */
+  const double margin = open ? physics->open_margin : 0.0;
+  const double grid_width = WORLD_WIDTH + 2.0 * margin;
+  const double grid_height = WORLD_HEIGHT + 2.0 * margin;
+  planet_node_t *node;
+  planet_t **bodies;
+  planet_t *planet_a;
+  planet_t *planet_b;
+  size_t *cell_first;
+  size_t *cell_next;
+  double largest_radius;
+  double cell_size;
+  size_t n;
+  size_t x_cells, y_cells;
+  size_t cx, cy;
+  size_t dx, dy;
+  size_t cell;
+  size_t i, j;
+
+  n = planets->size;
+  if (!n) {
+    return 1;
+  }
+
+  largest_radius = 0.0;
+  for (node = planets->first;  node;  node = node->next) {
+    if (node->planet->radius > largest_radius) {
+      largest_radius = node->planet->radius;
+    }
+  }
+
+  cell_size = fmax(2.0 * largest_radius, sqrt(grid_width * grid_height / n));
+  x_cells = (size_t) (grid_width / cell_size);
+  y_cells = (size_t) (grid_height / cell_size);
+  if (!open && (x_cells < 3 || y_cells < 3)) {
+    return 0;
+  }
+  x_cells = x_cells ? x_cells : 1;
+  y_cells = y_cells ? y_cells : 1;
+
+  bodies = my_malloc(n * sizeof(*bodies));
+  cell_next = my_malloc(n * sizeof(*cell_next));
+  cell_first = my_malloc(x_cells * y_cells * sizeof(*cell_first));
+  for (cell = 0;  cell < x_cells * y_cells;  ++cell) {
+    cell_first[cell] = n;
+  }
+
+  for (i = 0, node = planets->first;  node;  ++i, node = node->next) {
+    bodies[i] = node->planet;
+  }
+  /* Backwards, so each cell lists its planets in list order. */
+  for (i = n;  i-- > 0;  ) {
+    cx = neighbor_cell(bodies[i]->x_pos + margin, grid_width, x_cells);
+    cy = neighbor_cell(bodies[i]->y_pos + margin, grid_height, y_cells);
+    cell = cy * x_cells + cx;
+    cell_next[i] = cell_first[cell];
+    cell_first[cell] = i;
+  }
+
+  for (node = new_planets->first;  node;  node = node->next) {
+    planet_a = node->planet;
+    cx = neighbor_cell(planet_a->x_pos + margin, grid_width, x_cells);
+    cy = neighbor_cell(planet_a->y_pos + margin, grid_height, y_cells);
+
+    for (dy = 0;  dy < 3;  ++dy) {
+      if (open && (cy + dy < 1 || cy + dy > y_cells)) {
+        continue;
+      }
+      for (dx = 0;  dx < 3;  ++dx) {
+        if (open && (cx + dx < 1 || cx + dx > x_cells)) {
+          continue;
+        }
+        cell = ((cy + y_cells + dy - 1) % y_cells) * x_cells + (cx + x_cells + dx - 1) % x_cells;
+        for (j = cell_first[cell];  j < n;  j = cell_next[j]) {
+          planet_b = bodies[j];
+          if (planet_a == planet_b) {
+            continue;
+          }
+
+          if (planet_a->collision_list == COLLISION_LIST_NONE ||
+              planet_a->collision_list != planet_b->collision_list) {
+            resolve_collision_pair(planet_a, planet_b, collision_lists, collision_count, open);
+          }
+        }
+      }
+    }
+  }
+
+  free(bodies);
+  free(cell_next);
+  free(cell_first);
+
+  return 1;
+}
+
+
+BOUNDARY_KERNEL void resolve_collision_pair(planet_t *p1, planet_t *p2, planet_list_t *collision_lists, size_t *collision_count, const int open) {
+  double x_diff, y_diff;
+  double distance_squared;
+
+  separation(p1, p2, &x_diff, &y_diff, open);
+
+  distance_squared = x_diff * x_diff + y_diff * y_diff;
+
+  if (distance_squared < p1->radius_squared + p2->radius_squared) {
+    /* Collision! */
+    /* We've got to figure out which collision list to put it on. */
+    if (p1->collision_list == COLLISION_LIST_NONE) {
+      if (p2->collision_list == COLLISION_LIST_NONE) {
+        /* It's a new collision group. */
+        list_add(&collision_lists[*collision_count], p1);
+        list_add(&collision_lists[*collision_count], p2);
+        p1->collision_list = *collision_count;
+        p2->collision_list = *collision_count;
+        ++*collision_count;
+      } else {
+        /* p2 is already involved in a collision, while p1 is not,
+           so we just add p1 to p2's collision list. */
+        list_add(&collision_lists[p2->collision_list], p1);
+        p1->collision_list = p2->collision_list;
+      }
+    } else {
+      if (p2->collision_list == COLLISION_LIST_NONE) {
+        /* p1 is already involved in a collision, while p2 is not,
+           so we just add p2 to p1's collision list. */
+        list_add(&collision_lists[p1->collision_list], p2);
+        p2->collision_list = p1->collision_list;
+      } else {
+        /* Both planets are already involed in two different collision lists.
+           We have to merge the two lists into one. */
+        merge_collision_lists(collision_lists, p1->collision_list, p2->collision_list);
+      }
+    }
+  }
+}
+
+
+void find_candidate_collisions(thread_arg_t *thread_arg, planet_list_t *collision_lists, size_t *collision_count) {
+  /* Checks the pairs the force pass found, sorted into list order first,
+     so the groups come out numbered the same however the planets were
+     shared out among the threads. */
+  candidate_pair_t *pairs;
+  size_t count;
+  size_t i;
+
+  count = 0;
+  for (i = 0;  i < thread_arg->candidate_buffer_count;  ++i) {
+    count += thread_arg->candidates[i].size;
+  }
+  if (!count) {
+    return;
+  }
+
+  pairs = my_malloc(count * sizeof(*pairs));
+  count = 0;
+  for (i = 0;  i < thread_arg->candidate_buffer_count;  ++i) {
+    memcpy(pairs + count, thread_arg->candidates[i].pairs, thread_arg->candidates[i].size * sizeof(*pairs));
+    count += thread_arg->candidates[i].size;
+  }
+  qsort(pairs, count, sizeof(*pairs), compare_candidates);
+
+  if (physics->open_world) {
+    find_candidate_collisions_kernel(pairs, count, collision_lists, collision_count, 1);
+  } else {
+    find_candidate_collisions_kernel(pairs, count, collision_lists, collision_count, 0);
+  }
+
+  free(pairs);
+}
+
+
+BOUNDARY_KERNEL void find_candidate_collisions_kernel(const candidate_pair_t *pairs, size_t count,
+                                                      planet_list_t *collision_lists, size_t *collision_count, const int open) {
+  size_t i;
+
+  for (i = 0;  i < count;  ++i) {
+    if (pairs[i].a->collision_list == COLLISION_LIST_NONE ||
+        pairs[i].a->collision_list != pairs[i].b->collision_list) {
+      resolve_collision_pair(pairs[i].a, pairs[i].b, collision_lists, collision_count, open);
+    }
+  }
+}
+
+
+int compare_candidates(const void *a, const void *b) {
+  const candidate_pair_t *pair_a = a;
+  const candidate_pair_t *pair_b = b;
+
+  if (pair_a->a->index != pair_b->a->index) {
+    return pair_a->a->index < pair_b->a->index ? -1 : 1;
+  }
+  if (pair_a->b->index != pair_b->b->index) {
+    return pair_a->b->index < pair_b->b->index ? -1 : 1;
+  }
+  return 0;
+}
+
+
+void merge_collision_lists(planet_list_t *collision_lists, size_t list_a, size_t list_b) {
+  planet_node_t *node;
+  planet_node_t *b_last;
+
+  b_last = NULL;
+
+  for (node = collision_lists[list_b].first;  node;  b_last = node, node = node->next) {
+    node->planet->collision_list = list_a;
+  }
+
+  b_last->next = collision_lists[list_a].first;
+  collision_lists[list_a].first = collision_lists[list_b].first;
+  collision_lists[list_a].size += collision_lists[list_b].size;
+
+  list_init(&collision_lists[list_b]);
+}
+
+
+size_t resolve_swept_collisions(planet_list_t *planets, neighbor_list_t *neighbors, size_t tick) {
+  /* Planets are at their positions for the start of the tick and will move in
+     straight lines at their current velocities.  Contacts are handled in the
+     order they happen.  Whatever a contact produces is moved back along its
+     own velocity to where it would have been at the start of the tick, so that
+     every planet can keep being treated the same way, and then checked for
+     contacts during the rest of the tick.  Returns 1, the number of passes,
+     for the statistics. */
+  event_queue_t queue;
+  collision_event_t event;
+  planet_list_t collision;
+  planet_list_t new_planets;
+  planet_list_t dead;
+  planet_node_t *node;
+  planet_t *merged;
+  size_t handled = 0;
+
+  event_queue_init(&queue);
+  list_init(&new_planets);
+  list_init(&dead);
+
+  find_first_contacts(planets, neighbors, &queue);
+
+  while (handled < COLLISION_EVENT_MAX && event_queue_pop(&queue, &event)) {
+    if (event.a->generation != event.a_generation || event.b->generation != event.b_generation) {
+      /* One of them has already hit something else. */
+      continue;
+    }
+    ++handled;
+
+    list_init(&collision);
+    list_add(&collision, event.a);
+    list_add(&collision, event.b);
+
+    /* Merge them where they touch. */
+    planets_advance(&collision, event.time);
+    merged = resolve_collision_group(planets, &collision, &new_planets, tick, &dead);
+    list_delete(&collision);
+
+    if (!new_planets.size) {
+      list_add(&new_planets, merged);
+    }
+    planets_advance(&new_planets, -event.time);
+
+    for (node = new_planets.first;  node;  node = node->next) {
+      queue_contacts_with(planets, node->planet, event.time, &queue);
+    }
+    list_delete(&new_planets);
+  }
+
+  if (handled && neighbors) {
+    neighbors->valid = 0;
+  }
+
+  delete_planets(&dead);
+  list_delete(&dead);
+  event_queue_delete(&queue);
+
+  return 1;
+}
+
+
+void find_first_contacts(planet_list_t *planets, neighbor_list_t *neighbors, event_queue_t *queue) {
+  planet_node_t *node_a;
+  planet_node_t *node_b;
+  size_t i, j;
+
+  if (neighbors && neighbors->valid) {
+    for (i = 0;  i < neighbors->body_count;  ++i) {
+      for (j = neighbors->start[i];  j < neighbors->start[i + 1];  ++j) {
+        queue_contact(queue, neighbors->bodies[i], neighbors->neighbors[j], 0.0);
+      }
+    }
+    return;
+  }
+
+  for (node_a = planets->first;  node_a;  node_a = node_a->next) {
+    for (node_b = node_a->next;  node_b;  node_b = node_b->next) {
+      queue_contact(queue, node_a->planet, node_b->planet, 0.0);
+    }
+  }
+}
+
+
+void queue_contacts_with(planet_list_t *planets, planet_t *planet, double start, event_queue_t *queue) {
+  planet_node_t *node;
+
+  for (node = planets->first;  node;  node = node->next) {
+    if (node->planet != planet) {
+      queue_contact(queue, planet, node->planet, start);
+    }
+  }
+}
+
+
+void queue_contact(event_queue_t *queue, planet_t *a, planet_t *b, double start) {
+  /* Queues the first time at or after start (as a fraction of the tick) that
+     the two planets are close enough to collide, if that happens this tick.
+     Collisions use the same distance as resolve_collision_pair(). */
+  const double tick_duration = 1.0 / (FRAMES_PER_SECOND * physics->ticks_per_frame);
+  collision_event_t event;
+  double b_x, b_y;
+  double x_diff, y_diff;
+  double x_vel_diff, y_vel_diff;
+  double qa, qb, qc;
+  double discriminant;
+  double time;
+
+  position_mod(a, b, &b_x, &b_y);
+
+  x_vel_diff = (b->x_vel - a->x_vel) * tick_duration;
+  y_vel_diff = (b->y_vel - a->y_vel) * tick_duration;
+
+  x_diff = b_x - a->x_pos + x_vel_diff * start;
+  y_diff = b_y - a->y_pos + y_vel_diff * start;
+
+  /* Solve |diff + vel_diff * t|^2 = r1^2 + r2^2 for the earlier root. */
+  qc = x_diff * x_diff + y_diff * y_diff - (a->radius_squared + b->radius_squared);
+
+  if (qc < 0.0) {
+    time = start;
+  } else {
+    qa = x_vel_diff * x_vel_diff + y_vel_diff * y_vel_diff;
+    qb = 2.0 * (x_diff * x_vel_diff + y_diff * y_vel_diff);
+
+    if (qb >= 0.0 || qa == 0.0) {
+      /* Not approaching each other. */
+      return;
+    }
+
+    discriminant = qb * qb - 4.0 * qa * qc;
+    if (discriminant < 0.0) {
+      /* They pass without touching. */
+      return;
+    }
+
+    time = start + (-qb - sqrt(discriminant)) / (2.0 * qa);
+    if (time > 1.0) {
+      return;
+    }
+  }
+
+  event.time = time;
+  event.a = a;
+  event.b = b;
+  event.a_generation = a->generation;
+  event.b_generation = b->generation;
+
+  event_queue_push(queue, &event);
+}
+
+
+void planets_advance(planet_list_t *planets, double time) {
+  /* Moves the planets along their velocities by the given fraction of a tick,
+     which may be negative.  Positions aren't wrapped. */
+  const double tick_duration = 1.0 / (FRAMES_PER_SECOND * physics->ticks_per_frame);
+  planet_node_t *node;
+  planet_t *planet;
+
+  for (node = planets->first;  node;  node = node->next) {
+    planet = node->planet;
+    planet->x_pos += planet->x_vel * time * tick_duration;
+    planet->y_pos += planet->y_vel * time * tick_duration;
+  }
+}
+
+
+void event_queue_init(event_queue_t *queue) {
+  queue->events = NULL;
+  queue->size = 0;
+  queue->capacity = 0;
+}
+
+
+void event_queue_delete(event_queue_t *queue) {
+  free(queue->events);
+  event_queue_init(queue);
+}
+
+
+void event_queue_push(event_queue_t *queue, const collision_event_t *event) {
+  size_t i;
+  size_t parent;
+
+  if (queue->size == queue->capacity) {
+    queue->capacity = queue->capacity ? 2 * queue->capacity : 64;
+    queue->events = my_realloc(queue->events, queue->capacity * sizeof(queue->events[0]));
+  }
+
+  for (i = queue->size++;  i > 0;  i = parent) {
+    parent = (i - 1) / 2;
+    if (queue->events[parent].time <= event->time) {
+      break;
+    }
+    queue->events[i] = queue->events[parent];
+  }
+  queue->events[i] = *event;
+}
+
+
+int event_queue_pop(event_queue_t *queue, collision_event_t *event) {
+  collision_event_t *last;
+  size_t i;
+  size_t child;
+
+  if (!queue->size) {
+    return 0;
+  }
+
+  *event = queue->events[0];
+
+  last = &queue->events[--queue->size];
+  for (i = 0;  (child = 2 * i + 1) < queue->size;  i = child) {
+    if (child + 1 < queue->size && queue->events[child + 1].time < queue->events[child].time) {
+      ++child;
+    }
+    if (last->time <= queue->events[child].time) {
+      break;
+    }
+    queue->events[i] = queue->events[child];
+  }
+  queue->events[i] = *last;
+
+  return 1;
+}
+
+
+void calculate_forces(thread_arg_t *thread_arg) {
+  planet_node_t *node;
+  double start;
+
+  if (thread_arg->single_precision) {
+    float_bodies_update(&thread_arg->floats, thread_arg->planets);
+  }
+  if (thread_arg->fixed_point) {
+    fixed_bodies_update(&thread_arg->fixed, thread_arg->planets);
+  }
+
+  if (thread_arg->fusing) {
+    candidate_buffers_reset(thread_arg);
+  }
+
+  if (!thread_arg->threaded) {
+    for (node = thread_arg->planets->first;  node != thread_arg->planet_node_end;  node = node->next) {
+      calculate_planet_forces(thread_arg, node);
+    }
+    return;
+  }
+
+  if (thread_arg->partitioned) {
+    run_partitioned(thread_arg, 0);
+    return;
+  }
+
+  thread_arg->working_planet_count = thread_arg->planets->size;
+  thread_arg_reset_planet_node(thread_arg);
+
+  if (thread_arg->main_helps) {
+    node = NULL;
+    while ((node = thread_arg_take_planet_node(thread_arg, node != NULL))) {
+      calculate_planet_forces(thread_arg, node);
+    }
+  }
+
+  start = trace_begin();
+  thread_arg_wait_till_zero_working(thread_arg);
+  trace_end("barrier", start, thread_arg->planets->size);
+}
+
+
+void run_partitioned(thread_arg_t *thread_arg, int rehoming) {
+  /* Has every worker, and the main thread if it helps, do its own slice,
+     and waits for them all. */
+  double start;
+
+  partition_planets(thread_arg, thread_arg->worker_count + thread_arg->main_helps);
+
+  pthread_mutex_lock(&thread_arg->mutex);
+    thread_arg->rehoming = rehoming;
+    thread_arg->working_planet_count = thread_arg->worker_count;
+    ++thread_arg->round;
+    pthread_cond_broadcast(&thread_arg->cond);
+  pthread_mutex_unlock(&thread_arg->mutex);
+
+  if (thread_arg->main_helps) {
+    process_slice(thread_arg, thread_arg->worker_count);
+  }
+
+  start = trace_begin();
+  thread_arg_wait_till_zero_working(thread_arg);
+  trace_end("barrier", start, thread_arg->planets->size);
+}
+
+
+void partition_planets(thread_arg_t *thread_arg, size_t slice_count) {
+  /* Cuts the list into slices of about equal work.  In the all-pairs
+     pass each planet is paired with the ones after it, so the work falls
+     off along the list; otherwise every planet counts the same. */
+  const size_t count = thread_arg->planets->size;
+  const int triangular = !thread_arg->neighbors && !thread_arg->single_precision && !thread_arg->fixed_point &&
+                         !forces_single_writer(thread_arg);
+  planet_node_t *node;
+  double total, done;
+  size_t slice;
+  size_t i;
+
+  total = triangular ? 0.5 * count * (count + 1) : count;
+
+  node = thread_arg->planets->first;
+  done = 0.0;
+  slice = 0;
+  thread_arg->slices[0] = node;
+  for (i = 0;  i < count;  ++i, node = node->next) {
+    while (slice + 1 < slice_count && done >= total * (slice + 1) / slice_count) {
+      thread_arg->slices[++slice] = node;
+    }
+    done += triangular ? count - i : 1;
+  }
+  while (slice < slice_count) {
+    thread_arg->slices[++slice] = node;
+  }
+}
+
+
+void process_slice(thread_arg_t *thread_arg, size_t index) {
+  planet_node_t *node;
+  planet_t *planet;
+
+  for (node = thread_arg->slices[index];  node != thread_arg->slices[index + 1];  node = node->next) {
+    if (thread_arg->rehoming) {
+      planet = my_malloc(sizeof(*planet));
+      *planet = *node->planet;
+      free(node->planet);
+      node->planet = planet;
+    } else {
+      trace_count_work();
+      calculate_planet_forces(thread_arg, node);
+    }
+  }
+}
+
+
+void rehome_planets(thread_arg_t *thread_arg) {
+  /* Each worker copies its slice of the planets into fresh allocations,
+     which it touches first, so that with first-touch placement they end
+     up in memory local to the worker.  Malloc gives each thread its own
+     arena, so the copies don't land on pages another worker touched.
+     Every planet moves, so the neighbor lists are rebuilt. */
+  double start;
+
+  start = trace_begin();
+  run_partitioned(thread_arg, 1);
+  trace_end("rehome", start, thread_arg->planets->size);
+
+  if (thread_arg->neighbors) {
+    thread_arg->neighbors->valid = 0;
+  }
+  thread_arg->candidates_valid = 0;
+}
+
+
+void calculate_planet_forces(thread_arg_t *thread_arg, planet_node_t *node) {
+  if (physics->open_world) {
+    calculate_planet_forces_kernel(thread_arg, node, 1);
+  } else {
+    calculate_planet_forces_kernel(thread_arg, node, 0);
+  }
+}
+
+
+BOUNDARY_KERNEL void calculate_planet_forces_kernel(thread_arg_t *thread_arg, planet_node_t *node, const int open) {
+  /* When measuring, each pair's potential energy goes to the planet that
+     the pair is worked out for, which is only ever touched by one thread. */
+  planet_node_t *node_b;
+  planet_t *planet_a;
+  neighbor_list_t *neighbors;
+  double *potential = NULL;
+  candidate_buffer_t *candidates = NULL;
+  double cutoff_squared;
+  double x_force, y_force;
+  double x_sum = 0.0, y_sum = 0.0;
+  size_t i;
+
+  planet_a = node->planet;
+  neighbors = thread_arg->neighbors;
+
+  if (thread_arg->fusing) {
+    candidates = &thread_arg->candidates[task_index];
+  }
+
+  if (thread_arg->measuring_energy) {
+    planet_a->energy = 0.5 * planet_a->mass * (planet_a->x_vel * planet_a->x_vel + planet_a->y_vel * planet_a->y_vel);
+    potential = &planet_a->energy;
+  }
+
+  /* measuring is passed as a literal, like open, so the loop that isn't
+     measuring has nothing of it left in it. */
+  if (thread_arg->single_precision) {
+    if (potential) {
+      *potential += calculate_planet_forces_float(&thread_arg->floats, planet_a, open, 1);
+    } else {
+      calculate_planet_forces_float(&thread_arg->floats, planet_a, open, 0);
+    }
+    return;
+  }
+
+  if (thread_arg->fixed_point) {
+    if (potential) {
+      *potential += calculate_planet_forces_fixed(&thread_arg->fixed, planet_a, 1);
+    } else {
+      calculate_planet_forces_fixed(&thread_arg->fixed, planet_a, 0);
+    }
+    return;
+  }
+
+  if (!forces_single_writer(thread_arg)) {
+    if (neighbors) {
+      cutoff_squared = physics->force_cutoff * physics->force_cutoff;
+      for (i = neighbors->start[planet_a->index];  i < neighbors->start[planet_a->index + 1];  ++i) {
+        calculate_force_pair(planet_a, neighbors->neighbors[i], cutoff_squared, potential, candidates, open);
+      }
+      return;
+    }
+
+    for (node_b = node->next;  node_b;  node_b = node_b->next) {
+      calculate_force_pair(planet_a, node_b->planet, HUGE_VAL, potential, candidates, open);
+    }
+    return;
+  }
+
+  /* With several threads, a pair's force can't be added to the other
+     planet too, as another thread may be adding to it at the same moment.
+     So this planet goes through the planets before it as well, working
+     each pair out just as the earlier planet would and taking its side of
+     it, and adds the lot up in the same order one thread would.  The
+     earlier planet keeps the pair's potential and candidate. */
+  if (neighbors) {
+    cutoff_squared = physics->force_cutoff * physics->force_cutoff;
+    for (i = neighbors->earlier_start[planet_a->index];  i < neighbors->earlier_start[planet_a->index + 1];  ++i) {
+      if (pair_force(neighbors->earlier[i], planet_a, cutoff_squared, NULL, NULL, open, &x_force, &y_force)) {
+        x_sum -= x_force;
+        y_sum -= y_force;
+      }
+    }
+    for (i = neighbors->start[planet_a->index];  i < neighbors->start[planet_a->index + 1];  ++i) {
+      if (pair_force(planet_a, neighbors->neighbors[i], cutoff_squared, potential, candidates, open, &x_force, &y_force)) {
+        x_sum += x_force;
+        y_sum += y_force;
+      }
+    }
+  } else {
+    for (node_b = thread_arg->planets->first;  node_b != node;  node_b = node_b->next) {
+      if (pair_force(node_b->planet, planet_a, HUGE_VAL, NULL, NULL, open, &x_force, &y_force)) {
+        x_sum -= x_force;
+        y_sum -= y_force;
+      }
+    }
+    for (node_b = node->next;  node_b;  node_b = node_b->next) {
+      if (pair_force(planet_a, node_b->planet, HUGE_VAL, potential, candidates, open, &x_force, &y_force)) {
+        x_sum += x_force;
+        y_sum += y_force;
+      }
+    }
+  }
+
+  planet_add_force(planet_a, x_sum, y_sum);
+}
+
+
+int forces_single_writer(const thread_arg_t *thread_arg) {
+  /* Whether more than one thread works out the double precision forces,
+     so that each planet has to add up its own. */
+  return thread_arg->threaded && thread_arg->worker_count + thread_arg->main_helps > 1;
+}
+
+
+BOUNDARY_KERNEL void calculate_force_pair(planet_t *p1, planet_t *p2, double max_distance_squared, double *potential,
+                                          candidate_buffer_t *candidates, const int open) {
+  double x_force, y_force;
+
+  if (pair_force(p1, p2, max_distance_squared, potential, candidates, open, &x_force, &y_force)) {
+    planet_add_force(p1, x_force, y_force);
+    planet_add_force(p2, -x_force, -y_force);
+  }
+}
+
+
+BOUNDARY_KERNEL int pair_force(planet_t *p1, planet_t *p2, double max_distance_squared, double *potential,
+                               candidate_buffer_t *candidates, const int open, double *x_force, double *y_force) {
+  /* Works out the force p2 pulls p1 with, returning 0 if there's none.
+     With a potential to add to, the pair's potential energy is added to it,
+     less what it would be at the cutoff, as that's the potential the cut
+     off force actually conserves.  Overlapping planets don't attract, so
+     theirs stays what it was when they touched.  With candidates to add
+     to, a pair that could overlap by the next tick is added. */
+  double reach;
+  double distance_squared;
+  double x_diff, y_diff;
+  double distance;
+  double force_magnitude;
+  double force_ratio;
+
+  separation(p1, p2, &x_diff, &y_diff, open);
+
+  distance_squared = x_diff * x_diff + y_diff * y_diff;
+  if (distance_squared >= max_distance_squared) {
+    return 0;
+  }
+
+  if (candidates) {
+    reach = p1->radius + p2->radius + COLLISION_SKIN;
+    if (distance_squared < reach * reach) {
+      candidate_add(candidates, p1, p2);
+    }
+  }
+
+  distance = sqrt(distance_squared);
+
+  if (distance < p1->radius + p2->radius) {
+    if (potential) {
+      distance = p1->radius + p2->radius;
+      *potential -= G * p1->mass * p2->mass / distance * (1.0 - distance / sqrt(max_distance_squared));
+    }
+    return 0;
+  }
+
+  force_magnitude = G * p1->mass * p2->mass / distance_squared;
+
+  force_ratio = force_magnitude / distance;
+
+  *x_force = force_ratio * x_diff;
+  *y_force = force_ratio * y_diff;
+
+  if (potential) {
+    *potential -= force_magnitude * distance * (1.0 - distance / sqrt(max_distance_squared));
+  }
+
+  return 1;
+}
+
+
+void candidate_buffers_reset(thread_arg_t *thread_arg) {
+  /* Empties a buffer for each thread, and numbers the planets in list
+     order for sorting the candidates, if the neighbor lists haven't. */
+  planet_node_t *node;
+  size_t count;
+  size_t i;
+
+  count = thread_arg->worker_count + 1;
+  if (thread_arg->candidate_buffer_count != count) {
+    candidate_buffers_delete(thread_arg);
+    thread_arg->candidates = calloc(count, sizeof(*thread_arg->candidates));
+    if (!thread_arg->candidates) {
+      perror("calloc()");
+      exit(1);
+    }
+    thread_arg->candidate_buffer_count = count;
+  }
+
+  for (i = 0;  i < count;  ++i) {
+    thread_arg->candidates[i].size = 0;
+  }
+
+  if (!thread_arg->neighbors) {
+    for (i = 0, node = thread_arg->planets->first;  node;  ++i, node = node->next) {
+      node->planet->index = i;
+    }
+  }
+
+  task_index = thread_arg->worker_count;
+}
+
+
+void candidate_buffers_delete(thread_arg_t *thread_arg) {
+  size_t i;
+
+  for (i = 0;  i < thread_arg->candidate_buffer_count;  ++i) {
+    free(thread_arg->candidates[i].pairs);
+  }
+
+  free(thread_arg->candidates);
+  thread_arg->candidates = NULL;
+  thread_arg->candidate_buffer_count = 0;
+  thread_arg->candidates_valid = 0;
+}
+
+
+void candidate_add(candidate_buffer_t *buffer, planet_t *a, planet_t *b) {
+  if (buffer->size == buffer->capacity) {
+    buffer->capacity = buffer->capacity ? 2 * buffer->capacity : 64;
+    buffer->pairs = my_realloc(buffer->pairs, buffer->capacity * sizeof(*buffer->pairs));
+  }
+
+  buffer->pairs[buffer->size].a = a;
+  buffer->pairs[buffer->size].b = b;
+  ++buffer->size;
+}
+
+
+void float_bodies_update(float_bodies_t *floats, planet_list_t *planets) {
+  planet_node_t *node;
+  planet_t *planet;
+  size_t i;
+
+  if (planets->size > floats->capacity) {
+    floats->capacity = 2 * planets->size;
+    floats->x_pos = my_realloc(floats->x_pos, floats->capacity * sizeof(floats->x_pos[0]));
+    floats->y_pos = my_realloc(floats->y_pos, floats->capacity * sizeof(floats->y_pos[0]));
+    floats->mass = my_realloc(floats->mass, floats->capacity * sizeof(floats->mass[0]));
+    floats->radius = my_realloc(floats->radius, floats->capacity * sizeof(floats->radius[0]));
+  }
+
+  for (i = 0, node = planets->first;  node;  ++i, node = node->next) {
+    planet = node->planet;
+    planet->index = i;
+    floats->x_pos[i] = (float) planet->x_pos;
+    floats->y_pos[i] = (float) planet->y_pos;
+    floats->mass[i] = (float) planet->mass;
+    floats->radius[i] = (float) planet->radius;
+  }
+  floats->size = i;
+}
+
+
+void float_bodies_delete(float_bodies_t *floats) {
+  free(floats->x_pos);
+  free(floats->y_pos);
+  free(floats->mass);
+  free(floats->radius);
+  memset(floats, 0, sizeof(*floats));
+}
+
+
+BOUNDARY_KERNEL double calculate_planet_forces_float(const float_bodies_t *floats, planet_t *planet, const int open, const int measuring) {
+  /* Unlike the double precision pass, this goes through every other planet
+     rather than only the ones after this one, and only adds to this planet's
+     force.  That costs twice the arithmetic, but each planet's sum has a
+     single writer and the loop is simple enough to vectorize.  Each pair is
+     worked out in floats; the sums are kept in doubles.  When measuring, it
+     returns this planet's half of the potential energy of every pair it's
+     in, summed in the same loop. */
+  const float half_width = (float) (0.5 * WORLD_WIDTH);
+  const float half_height = (float) (0.5 * WORLD_HEIGHT);
+  const float width = (float) WORLD_WIDTH;
+  const float height = (float) WORLD_HEIGHT;
+  const size_t self = planet->index;
+  const float x = floats->x_pos[self];
+  const float y = floats->y_pos[self];
+  const float mass_g = (float) G * floats->mass[self];
+  const float radius = floats->radius[self];
+  double x_force = 0.0;
+  double y_force = 0.0;
+  double potential = 0.0;
+  float x_diff, y_diff;
+  float distance_squared;
+  float touching;
+  float inverse_distance;
+  float force_ratio;
+  size_t i;
+
+  for (i = 0;  i < floats->size;  ++i) {
+    x_diff = floats->x_pos[i] - x;
+    y_diff = floats->y_pos[i] - y;
+
+    if (!open) {
+      x_diff -= x_diff > half_width ? width : 0.0f;
+      x_diff += x_diff < -half_width ? width : 0.0f;
+      y_diff -= y_diff > half_height ? height : 0.0f;
+      y_diff += y_diff < -half_height ? height : 0.0f;
+    }
+
+    distance_squared = x_diff * x_diff + y_diff * y_diff;
+    touching = radius + floats->radius[i];
+
+    /* Overlapping planets (including this one itself) don't attract, but
+       hold the potential energy they had when they touched. */
+    if (distance_squared < touching * touching) {
+      if (measuring && i != self) {
+        potential -= floats->mass[i] / touching;
+      }
+      continue;
+    }
+
+    inverse_distance = 1.0f / sqrtf(distance_squared);
+    force_ratio = mass_g * floats->mass[i] * inverse_distance * inverse_distance * inverse_distance;
+
+    x_force += force_ratio * x_diff;
+    y_force += force_ratio * y_diff;
+    if (measuring) {
+      potential -= floats->mass[i] * inverse_distance;
+    }
+  }
+
+  planet_add_force(planet, x_force, y_force);
+
+  return 0.5 * G * floats->mass[self] * potential;
+}
+
+
+void fixed_bodies_update(fixed_bodies_t *fixed, planet_list_t *planets) {
+  planet_node_t *node;
+  planet_t *planet;
+  size_t i;
+
+  if (planets->size > fixed->capacity) {
+    fixed->capacity = 2 * planets->size;
+    fixed->x_pos = my_realloc(fixed->x_pos, fixed->capacity * sizeof(fixed->x_pos[0]));
+    fixed->y_pos = my_realloc(fixed->y_pos, fixed->capacity * sizeof(fixed->y_pos[0]));
+    fixed->mass = my_realloc(fixed->mass, fixed->capacity * sizeof(fixed->mass[0]));
+    fixed->radius = my_realloc(fixed->radius, fixed->capacity * sizeof(fixed->radius[0]));
+  }
+
+  for (i = 0, node = planets->first;  node;  ++i, node = node->next) {
+    planet = node->planet;
+    planet->index = i;
+    fixed->x_pos[i] = fixed_from_double(planet->x_pos, WORLD_WIDTH);
+    fixed->y_pos[i] = fixed_from_double(planet->y_pos, WORLD_HEIGHT);
+    fixed->mass[i] = planet->mass;
+    fixed->radius[i] = planet->radius;
+  }
+  fixed->size = i;
+}
+
+
+void fixed_bodies_delete(fixed_bodies_t *fixed) {
+  free(fixed->x_pos);
+  free(fixed->y_pos);
+  free(fixed->mass);
+  free(fixed->radius);
+  memset(fixed, 0, sizeof(*fixed));
+}
+
+
+BOUNDARY_KERNEL double calculate_planet_forces_fixed(const fixed_bodies_t *fixed, planet_t *planet, const int measuring) {
+  /* Goes through every other planet like the single precision pass does,
+     but in doubles, and likewise sums the potential energy when measuring.
+     The difference of two fixed-point positions, read as signed, is already
+     the way to the nearest wrapped copy, so the loop has no comparisons but
+     the one for overlapping. */
+  const double x_unit = WORLD_WIDTH / FIXED_ONE;
+  const double y_unit = WORLD_HEIGHT / FIXED_ONE;
+  const size_t self = planet->index;
+  const uint32_t x = fixed->x_pos[self];
+  const uint32_t y = fixed->y_pos[self];
+  const double mass_g = G * fixed->mass[self];
+  const double radius = fixed->radius[self];
+  double x_force = 0.0;
+  double y_force = 0.0;
+  double potential = 0.0;
+  double x_diff, y_diff;
+  double distance_squared;
+  double touching;
+  double inverse_distance;
+  double force_ratio;
+  size_t i;
+
+  for (i = 0;  i < fixed->size;  ++i) {
+    x_diff = (int32_t) (fixed->x_pos[i] - x) * x_unit;
+    y_diff = (int32_t) (fixed->y_pos[i] - y) * y_unit;
+
+    distance_squared = x_diff * x_diff + y_diff * y_diff;
+    touching = radius + fixed->radius[i];
+
+    /* Overlapping planets (including this one itself) don't attract, but
+       hold the potential energy they had when they touched. */
+    if (distance_squared < touching * touching) {
+      if (measuring && i != self) {
+        potential -= fixed->mass[i] / touching;
+      }
+      continue;
+    }
+
+    inverse_distance = 1.0 / sqrt(distance_squared);
+    force_ratio = mass_g * fixed->mass[i] * inverse_distance * inverse_distance * inverse_distance;
+
+    x_force += force_ratio * x_diff;
+    y_force += force_ratio * y_diff;
+    if (measuring) {
+      potential -= fixed->mass[i] * inverse_distance;
+    }
+  }
+
+  planet_add_force(planet, x_force, y_force);
+
+  return 0.5 * G * fixed->mass[self] * potential;
+}
+
+
+int energy_monitor_sample(size_t tick, const planet_list_t *planets) {
+  /* Sums what the force pass left in each planet's energy, and prints it
+     and how far it, the momentum and the mass have drifted as a CSV line.
+     The energy drift leaves out what merging and splitting changed.
+     Returns -1 once any of them drifts further than -X allows. */
+  energy_monitor_t *monitor = &energy_monitor;
+  const planet_node_t *node;
+  const planet_t *planet;
+  double kinetic = 0.0;
+  double energy = 0.0;
+  double mass = 0.0;
+  double x_momentum = 0.0, y_momentum = 0.0;
+  double momentum_scale = 0.0;
+  double energy_drift, momentum_drift, mass_drift;
+  int rebased = 0;
+
+  for (node = planets->first;  node;  node = node->next) {
+    planet = node->planet;
+    kinetic += 0.5 * planet->mass * (planet->x_vel * planet->x_vel + planet->y_vel * planet->y_vel);
+    energy += planet->energy;
+    mass += planet->mass;
+    x_momentum += planet->mass * planet->x_vel;
+    y_momentum += planet->mass * planet->y_vel;
+    momentum_scale += planet->mass * hypot(planet->x_vel, planet->y_vel);
+  }
+
+  if (!monitor->samples) {
+    printf("tick,bodies,kinetic,potential,total,collision_energy,energy_drift,momentum_drift,mass_drift,rebased\n");
+    monitor->mass = mass;
+    monitor->x_momentum = x_momentum;
+    monitor->y_momentum = y_momentum;
+    monitor->momentum_scale = momentum_scale;
+  }
+  if (!monitor->samples || monitor->cutoff != physics->force_cutoff) {
+    monitor->cutoff = physics->force_cutoff;
+    monitor->energy = energy - collision_energy;
+    monitor->energy_scale = kinetic + fabs(energy - kinetic);
+    rebased = monitor->samples > 0;
+  }
+  ++monitor->samples;
+
+  energy_drift = monitor->energy_scale > 0.0 ? fabs(energy - collision_energy - monitor->energy) / monitor->energy_scale : 0.0;
+  momentum_drift = monitor->momentum_scale > 0.0 ?
+                   hypot(x_momentum - monitor->x_momentum, y_momentum - monitor->y_momentum) / monitor->momentum_scale : 0.0;
+  mass_drift = monitor->mass > 0.0 ? fabs(mass - monitor->mass) / monitor->mass : 0.0;
+
+  printf("%lu,%lu,%.10g,%.10g,%.10g,%.10g,%g,%g,%g,%d\n", tick, planets->size, kinetic, energy - kinetic, energy,
+         collision_energy, energy_drift, momentum_drift, mass_drift, rebased);
+
+  if (energy_drift > monitor->worst_energy_drift) {
+    monitor->worst_energy_drift = energy_drift;
+  }
+  if (momentum_drift > monitor->worst_momentum_drift) {
+    monitor->worst_momentum_drift = momentum_drift;
+  }
+  if (mass_drift > monitor->worst_mass_drift) {
+    monitor->worst_mass_drift = mass_drift;
+  }
+
+  if (energy_drift_limit > 0.0 &&
+      (energy_drift > energy_drift_limit || momentum_drift > energy_drift_limit || mass_drift > energy_drift_limit)) {
+    fprintf(stderr, "Stopping at tick %lu:  drifted past %g (energy %g, momentum %g, mass %g).\n",
+            tick, energy_drift_limit, energy_drift, momentum_drift, mass_drift);
+    monitor->tripped = 1;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+double group_energy(const planet_list_t *group) {
+  /* The kinetic energy of a collision group, and the potential energy
+     between its planets. */
+  const planet_node_t *node;
+  const planet_node_t *other;
+  planet_t *planet;
+  double energy = 0.0;
+
+  for (node = group->first;  node;  node = node->next) {
+    planet = node->planet;
+    energy += 0.5 * planet->mass * (planet->x_vel * planet->x_vel + planet->y_vel * planet->y_vel);
+    for (other = node->next;  other;  other = other->next) {
+      energy += pair_potential(planet, other->planet);
+    }
+  }
+
+  return energy;
+}
+
+
+double pair_potential(planet_t *p1, planet_t *p2) {
+  /* As calculate_force_pair() works it out. */
+  double p2_x, p2_y;
+  double distance;
+
+  position_mod(p1, p2, &p2_x, &p2_y);
+  distance = hypot(p2_x - p1->x_pos, p2_y - p1->y_pos);
+
+  if (physics->force_cutoff > 0.0 && distance >= physics->force_cutoff) {
+    return 0.0;
+  }
+  if (distance < p1->radius + p2->radius) {
+    distance = p1->radius + p2->radius;
+  }
+
+  return -G * p1->mass * p2->mass * (1.0 / distance - (physics->force_cutoff > 0.0 ? 1.0 / physics->force_cutoff : 0.0));
+}
+
+
+double split_potential(double mass, size_t count, double distance, double radius) {
+  /* The potential energy between count planets of this mass and radius,
+     spread evenly around a circle of radius distance, as split_planet()
+     places them. */
+  double separation;
+  double potential = 0.0;
+  size_t i;
+
+  for (i = 1;  i < count;  ++i) {
+    separation = distance * sqrt(2.0 - 2.0 * split_cos[count][i]);
+    if (physics->force_cutoff > 0.0 && separation >= physics->force_cutoff) {
+      continue;
+    }
+    if (separation < 2.0 * radius) {
+      separation = 2.0 * radius;
+    }
+    potential -= 1.0 / separation - (physics->force_cutoff > 0.0 ? 1.0 / physics->force_cutoff : 0.0);
+  }
+
+  /* Every pair was counted from both ends. */
+  return 0.5 * count * G * mass * mass * potential;
+}
+
+
+void collision_energy_add(double energy) {
+  /* Merges and splits run on several threads at once, so inside a task the
+     energy waits in it, to be added when the tasks are committed in the
+     same order every run, whichever thread finished first. */
+  if (running_task) {
+    running_task->energy += energy;
+  } else {
+    collision_energy += energy;
+  }
+}
+
+
+void energy_monitor_report(void) {
+  if (!energy_monitor.samples) {
+    return;
+  }
+
+  fprintf(stderr, "Energy monitor: %lu samples, worst drift %g in energy, %g in momentum and %g in mass.\n",
+          energy_monitor.samples, energy_monitor.worst_energy_drift, energy_monitor.worst_momentum_drift,
+          energy_monitor.worst_mass_drift);
+}
+
+
+int state_hash_open(const char *path, unsigned seed) {
+  hash_header_t header;
+
+  state_hash.log = fopen(path, "wb");
+  if (!state_hash.log) {
+    fprintf(stderr, "Couldn't create hash log %s: ", path);
+    perror(NULL);
+    return -1;
+  }
+  state_hash.path = path;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, STATE_HASH_MAGIC, sizeof(header.magic));
+  header.seed = seed;
+  if (fwrite(&header, sizeof(header), 1, state_hash.log) != 1) {
+    fprintf(stderr, "Couldn't write hash log %s: ", path);
+    perror(NULL);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+void state_hash_close(void) {
+  if (state_hash.log) {
+    if (fclose(state_hash.log) != 0) {
+      fprintf(stderr, "Couldn't write hash log %s: ", state_hash.path);
+      perror(NULL);
+    }
+    state_hash.log = NULL;
+  }
+  free(state_hash.bodies);
+  state_hash.bodies = NULL;
+  state_hash.capacity = 0;
+}
+
+
+int state_hash_record(size_t tick, const planet_list_t *planets) {
+  /* Logs the hash of every planet as the tick left it, and of the world. */
+  hash_tick_t record;
+  planet_node_t *node;
+  hash_body_t *body;
+
+  if (planets->size > state_hash.capacity) {
+    state_hash.capacity = planets->size;
+    state_hash.bodies = my_realloc(state_hash.bodies, state_hash.capacity * sizeof(*state_hash.bodies));
+  }
+
+  record.tick = tick;
+  record.count = planets->size;
+  record.hash = 0;
+  body = state_hash.bodies;
+  for (node = planets->first;  node;  node = node->next) {
+    body->id = node->planet->id;
+    body->hash = planet_hash(node->planet);
+    record.hash += body->hash;
+    ++body;
+  }
+
+  if (fwrite(&record, sizeof(record), 1, state_hash.log) != 1 ||
+      fwrite(state_hash.bodies, sizeof(*state_hash.bodies), record.count, state_hash.log) != record.count) {
+    fprintf(stderr, "Couldn't write hash log %s: ", state_hash.path);
+    perror(NULL);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+uint64_t planet_hash(const planet_t *planet) {
+  /* Every bit of the state that carries over to the next tick counts, so
+     only runs that are exactly the same hash the same. */
+  uint64_t hash;
+
+  hash = hash_mix(planet->id, planet->x_pos);
+  hash = hash_mix(hash, planet->y_pos);
+  hash = hash_mix(hash, planet->x_vel);
+  hash = hash_mix(hash, planet->y_vel);
+  hash = hash_mix(hash, planet->mass);
+  hash = hash_mix(hash, planet->hue);
+
+  return hash;
+}
+
+
+uint64_t hash_mix(uint64_t hash, double value) {
+  /* The finalizer of MurmurHash3, over the hash so far and the value's bits. */
+  uint64_t bits;
+
+  memcpy(&bits, &value, sizeof(bits));
+  hash ^= bits;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+
+  return hash;
+}
+
+
+int compare_body_ids(const void *a, const void *b) {
+  const hash_body_t *body_a = a;
+  const hash_body_t *body_b = b;
+
+  return (body_a->id > body_b->id) - (body_a->id < body_b->id);
+}
+
+
+int read_hash_tick(FILE *file, const char *path, hash_tick_t *tick, hash_body_t **bodies, size_t *capacity) {
+  /* Returns 1 for a tick, 0 at the end of the log, and -1 if it's cut short. */
+  if (fread(tick, sizeof(*tick), 1, file) != 1) {
+    if (ferror(file)) {
+      fprintf(stderr, "Couldn't read hash log %s: ", path);
+      perror(NULL);
+      return -1;
+    }
+    return 0;
+  }
+
+  if (tick->count > *capacity) {
+    *capacity = tick->count;
+    *bodies = my_realloc(*bodies, *capacity * sizeof(**bodies));
+  }
+  if (fread(*bodies, sizeof(**bodies), tick->count, file) != tick->count) {
+    fprintf(stderr, "Hash log %s ends in the middle of tick %lu.\n", path, (unsigned long) tick->tick);
+    return -1;
+  }
+
+  return 1;
+}
+
+
+int run_hash_compare(const char *path_a, const char *path_b) {
+  /* Returns 0 if the two logs are the same, 1 at the first tick where they
+     differ, after naming the first planet, by id, that differs there, or
+     -1 if either can't be read. */
+  const char *paths[2];
+  FILE *files[2];
+  hash_header_t headers[2];
+  hash_tick_t ticks[2];
+  hash_body_t *bodies[2] = {NULL, NULL};
+  size_t capacities[2] = {0, 0};
+  int more[2];
+  size_t same_ticks = 0;
+  size_t i, j;
+  int status = -1;
+  int run;
+
+  paths[0] = path_a;
+  paths[1] = path_b;
+  files[0] = files[1] = NULL;
+
+  for (run = 0;  run < 2;  ++run) {
+    files[run] = fopen(paths[run], "rb");
+    if (!files[run]) {
+      fprintf(stderr, "Couldn't open hash log %s: ", paths[run]);
+      perror(NULL);
+      goto done;
+    }
+    if (fread(&headers[run], sizeof(headers[run]), 1, files[run]) != 1 ||
+        memcmp(headers[run].magic, STATE_HASH_MAGIC, sizeof(headers[run].magic)) != 0) {
+      fprintf(stderr, "%s isn't a hash log.\n", paths[run]);
+      goto done;
+    }
+  }
+
+  if (headers[0].seed != headers[1].seed) {
+    fprintf(stderr, "The runs were started from different seeds, %lu and %lu.\n",
+            (unsigned long) headers[0].seed, (unsigned long) headers[1].seed);
+  }
+
+  for (;;) {
+    for (run = 0;  run < 2;  ++run) {
+      more[run] = read_hash_tick(files[run], paths[run], &ticks[run], &bodies[run], &capacities[run]);
+      if (more[run] < 0) {
+        goto done;
+      }
+    }
+
+    if (!more[0] || !more[1]) {
+      break;
+    }
+
+    if (ticks[0].tick == ticks[1].tick && ticks[0].count == ticks[1].count && ticks[0].hash == ticks[1].hash) {
+      ++same_ticks;
+      continue;
+    }
+
+    status = 1;
+    if (ticks[0].tick != ticks[1].tick) {
+      fprintf(stderr, "The logs are out of step:  %s has tick %lu where %s has tick %lu.\n",
+              paths[0], (unsigned long) ticks[0].tick, paths[1], (unsigned long) ticks[1].tick);
+      goto done;
+    }
+
+    printf("The runs diverge at tick %lu, with %lu and %lu planets.\n",
+           (unsigned long) ticks[0].tick, (unsigned long) ticks[0].count, (unsigned long) ticks[1].count);
+
+    /* Walks both in id order to the first planet they don't agree on. */
+    qsort(bodies[0], ticks[0].count, sizeof(*bodies[0]), compare_body_ids);
+    qsort(bodies[1], ticks[1].count, sizeof(*bodies[1]), compare_body_ids);
+    for (i = j = 0;  i < ticks[0].count && j < ticks[1].count;  ++i, ++j) {
+      if (bodies[0][i].id != bodies[1][j].id || bodies[0][i].hash != bodies[1][j].hash) {
+        break;
+      }
+    }
+
+    if (i < ticks[0].count && j < ticks[1].count && bodies[0][i].id == bodies[1][j].id) {
+      printf("Planet %lu is the first that differs.\n", (unsigned long) bodies[0][i].id);
+    } else if (j == ticks[1].count || (i < ticks[0].count && bodies[0][i].id < bodies[1][j].id)) {
+      printf("Planet %lu is the first that's only in %s.\n", (unsigned long) bodies[0][i].id, paths[0]);
+    } else {
+      printf("Planet %lu is the first that's only in %s.\n", (unsigned long) bodies[1][j].id, paths[1]);
+    }
+    goto done;
+  }
+
+  status = 0;
+  if (more[0] || more[1]) {
+    printf("The runs are the same for the %lu ticks they both have; %s goes on longer.\n",
+           same_ticks, paths[more[0] ? 0 : 1]);
+  } else {
+    printf("The runs are the same for all %lu ticks.\n", same_ticks);
+  }
+
+done:
+  for (run = 0;  run < 2;  ++run) {
+    if (files[run]) {
+      fclose(files[run]);
+    }
+    free(bodies[run]);
+  }
+
+  return status;
+}
+
+
+void round_to_float(planet_list_t *planets) {
+  /* Single precision mode only keeps as much of the state as a float holds. */
+  planet_node_t *node;
+  planet_t *planet;
+
+  for (node = planets->first;  node;  node = node->next) {
+    planet = node->planet;
+    planet->x_pos = (float) planet->x_pos;
+    planet->y_pos = (float) planet->y_pos;
+    planet->x_vel = (float) planet->x_vel;
+    planet->y_vel = (float) planet->y_vel;
+  }
+}
+
+
+void round_to_fixed(planet_list_t *planets) {
+  /* Fixed-point mode keeps positions on its grid, so the force pass sees
+     exactly where every planet is.  Velocities stay doubles. */
+  planet_node_t *node;
+  planet_t *planet;
+
+  for (node = planets->first;  node;  node = node->next) {
+    planet = node->planet;
+    planet->x_pos = fixed_from_double(planet->x_pos, WORLD_WIDTH) * (WORLD_WIDTH / FIXED_ONE);
+    planet->y_pos = fixed_from_double(planet->y_pos, WORLD_HEIGHT) * (WORLD_HEIGHT / FIXED_ONE);
+  }
+}
+
+
+uint32_t fixed_from_double(double value, double size) {
+  /* The nearest grid point, wrapped into the world by dropping all but the
+     low 32 bits, however far outside it the value is. */
+  return (uint32_t) llrint(value * (FIXED_ONE / size));
+}
+
+
+void position_mod(planet_t *p1, planet_t *p2, double *p2_x, double *p2_y) {
+  /* Where p2 is, as seen from p1:  the nearest of its wrapped copies. */
+  double x_diff, y_diff;
+
+  if (physics->open_world) {
+    separation(p1, p2, &x_diff, &y_diff, 1);
+  } else {
+    separation(p1, p2, &x_diff, &y_diff, 0);
+  }
+
+  *p2_x = p1->x_pos + x_diff;
+  *p2_y = p1->y_pos + y_diff;
+}
+
+
+BOUNDARY_KERNEL void separation(const planet_t *p1, const planet_t *p2, double *x_diff, double *y_diff, const int open) {
+  /* The shortest way from p1 to p2.  Both are inside a periodic world, so
+     the nearest copy of p2 is at most one world away, and the comparisons
+     pick it without branching. */
+  double x, y;
+
+  x = p2->x_pos - p1->x_pos;
+  y = p2->y_pos - p1->y_pos;
+
+  if (!open) {
+    x -= WORLD_WIDTH * ((x > 0.5 * WORLD_WIDTH) - (x < -0.5 * WORLD_WIDTH));
+    y -= WORLD_HEIGHT * ((y > 0.5 * WORLD_HEIGHT) - (y < -0.5 * WORLD_HEIGHT));
+  }
+
+  *x_diff = x;
+  *y_diff = y;
+}
+
+
+double move_planets(planet_list_t *planets) {
+  accelerate_planets(planets);
+  return drift_planets(planets);
+}
+
+
+void accelerate_planets(planet_list_t *planets) {
+  planet_node_t *node;
+  planet_t *planet;
+  double x_accel, y_accel;
+
+  for (node = planets->first;  node;  node = node->next) {
+    planet = node->planet;
+    x_accel = planet->x_force / planet->mass / (FRAMES_PER_SECOND * physics->ticks_per_frame);
+    y_accel = planet->y_force / planet->mass / (FRAMES_PER_SECOND * physics->ticks_per_frame);
+
+    planet->x_vel += x_accel;
+    planet->y_vel += y_accel;
+
+    planet->x_force = 0.0;
+    planet->y_force = 0.0;
+  }
+}
+
+
+double drift_planets(planet_list_t *planets) {
+  /* Returns the square of the furthest any planet moved. */
+  if (physics->open_world) {
+    return drift_planets_kernel(planets, 1);
+  }
+  return drift_planets_kernel(planets, 0);
+}
+
+
+BOUNDARY_KERNEL double drift_planets_kernel(planet_list_t *planets, const int open) {
+  /* A tick moves a planet far less than the size of the world, so wrapping
+     takes at most one step back in from each side. */
+  planet_node_t *node;
+  planet_t *planet;
+  double x_step, y_step;
+  double step_squared;
+  double largest = 0.0;
+
+  for (node = planets->first;  node;  node = node->next) {
+    planet = node->planet;
+
+    x_step = planet->x_vel / (FRAMES_PER_SECOND * physics->ticks_per_frame);
+    y_step = planet->y_vel / (FRAMES_PER_SECOND * physics->ticks_per_frame);
+    planet->x_pos += x_step;
+    planet->y_pos += y_step;
+
+    step_squared = x_step * x_step + y_step * y_step;
+    largest = step_squared > largest ? step_squared : largest;
+
+    if (!open) {
+      planet->x_pos += WORLD_WIDTH * (planet->x_pos < 0.0);
+      planet->x_pos -= WORLD_WIDTH * (planet->x_pos >= WORLD_WIDTH);
+      planet->y_pos += WORLD_HEIGHT * (planet->y_pos < 0.0);
+      planet->y_pos -= WORLD_HEIGHT * (planet->y_pos >= WORLD_HEIGHT);
+    }
+  }
+
+  return largest;
+}
+
+
+void remove_escaped_planets(thread_arg_t *thread_arg) {
+  /* Frees the planets that have gone past the margin of an open world. */
+  planet_list_t *planets = thread_arg->planets;
+  planet_node_t *node;
+  planet_node_t *prev;
+  planet_node_t *next;
+  planet_t *planet;
+  size_t removed = 0;
+
+  prev = NULL;
+  for (node = planets->first;  node;  node = next) {
+    next = node->next;
+    planet = node->planet;
+    if (planet->x_pos >= -physics->open_margin && planet->x_pos <= WORLD_WIDTH + physics->open_margin &&
+        planet->y_pos >= -physics->open_margin && planet->y_pos <= WORLD_HEIGHT + physics->open_margin) {
+      prev = node;
+      continue;
+    }
+
+    if (prev) {
+      prev->next = next;
+    } else {
+      planets->first = next;
+    }
+    --planets->size;
+    free(planet);
+    free(node);
+    ++removed;
+  }
+
+  if (removed) {
+    if (thread_arg->neighbors) {
+      thread_arg->neighbors->valid = 0;
+    }
+    thread_arg->candidates_valid = 0;
+    __sync_fetch_and_add(&escaped_count, removed);
+  }
+}
+
+
+double mod_double(double value, double min, double max) {
+  /* However far out value is, in one step rather than a loop that could
+     run for ever.  value must be finite. */
+  const double diff = max - min;
+
+  if (value >= min && value < max) {
+    return value;
+  }
+
+  value -= diff * floor((value - min) / diff);
+  /* Rounding can land a hair outside, on either side. */
+  if (value < min || value >= max) {
+    value = min;
+  }
+
+  return value;
+}
+
+
+void neighbor_list_init(neighbor_list_t *list) {
+  memset(list, 0, sizeof(*list));
+}
+
+
+void neighbor_list_delete(neighbor_list_t *list) {
+  free(list->bodies);
+  free(list->x_ref);
+  free(list->y_ref);
+  free(list->start);
+  free(list->neighbors);
+  free(list->earlier_start);
+  free(list->earlier);
+  free(list->cell_first);
+  free(list->cell_next);
+  neighbor_list_init(list);
+}
+
+
+void neighbor_list_update(neighbor_list_t *list, planet_list_t *planets, int transposed) {
+  if (list->valid && list->transposed == transposed && !neighbor_list_moved_too_far(list)) {
+    return;
+  }
+
+  list->transposed = transposed;
+  neighbor_list_build(list, planets);
+}
+
+
+int neighbor_list_moved_too_far(const neighbor_list_t *list) {
+  const double limit_squared = 0.25 * NEIGHBOR_SKIN * NEIGHBOR_SKIN;
+  const planet_t *planet;
+  double x_diff, y_diff;
+  size_t i;
+
+  for (i = 0;  i < list->body_count;  ++i) {
+    planet = list->bodies[i];
+
+    x_diff = fabs(planet->x_pos - list->x_ref[i]);
+    y_diff = fabs(planet->y_pos - list->y_ref[i]);
+
+    if (!physics->open_world && x_diff > 0.5 * WORLD_WIDTH) {
+      x_diff = WORLD_WIDTH - x_diff;
+    }
+    if (!physics->open_world && y_diff > 0.5 * WORLD_HEIGHT) {
+      y_diff = WORLD_HEIGHT - y_diff;
+    }
+
+    if (x_diff * x_diff + y_diff * y_diff > limit_squared) {
+      return 1;
+    }
   }
-  if (errno == ERANGE || (size_t) count != count) {
-    fprintf(stderr, "Tick count %s too large!\n", spec);
+
+  return 0;
+}
+
+
+void neighbor_list_build(neighbor_list_t *list, planet_list_t *planets) {
+  /* Bins the planets into a grid of cells at least as wide as the list's
+     reach, so each planet only needs checking against the 3x3 cells around
+     it.  The grid wraps like the world does.  With fewer than three cells
+     across, the wrapped cells would repeat, so every pair is checked instead.
+     An open world's grid doesn't wrap, and covers the margin as well. */
+  const double reach = physics->force_cutoff + NEIGHBOR_SKIN;
+  const double reach_squared = reach * reach;
+  const double margin = physics->open_world ? physics->open_margin : 0.0;
+  const double grid_width = WORLD_WIDTH + 2.0 * margin;
+  const double grid_height = WORLD_HEIGHT + 2.0 * margin;
+  const size_t cells_min = physics->open_world ? 1 : 3;
+  planet_node_t *node;
+  planet_t *planet;
+  size_t n;
+  size_t i, j;
+  size_t count;
+  size_t x_cells, y_cells;
+  size_t cx, cy;
+  size_t dx, dy;
+  size_t cell;
+
+  n = planets->size;
+
+  if (n > list->body_capacity) {
+    list->body_capacity = 2 * n;
+    list->bodies = my_realloc(list->bodies, list->body_capacity * sizeof(list->bodies[0]));
+    list->x_ref = my_realloc(list->x_ref, list->body_capacity * sizeof(list->x_ref[0]));
+    list->y_ref = my_realloc(list->y_ref, list->body_capacity * sizeof(list->y_ref[0]));
+    list->start = my_realloc(list->start, (list->body_capacity + 1) * sizeof(list->start[0]));
+    list->earlier_start = my_realloc(list->earlier_start, (list->body_capacity + 1) * sizeof(list->earlier_start[0]));
+    list->cell_next = my_realloc(list->cell_next, list->body_capacity * sizeof(list->cell_next[0]));
+  }
+
+  for (i = 0, node = planets->first;  node;  ++i, node = node->next) {
+    planet = node->planet;
+    planet->index = i;
+    list->bodies[i] = planet;
+    list->x_ref[i] = planet->x_pos;
+    list->y_ref[i] = planet->y_pos;
+  }
+  list->body_count = n;
+
+  x_cells = (size_t) (grid_width / reach);
+  y_cells = (size_t) (grid_height / reach);
+
+  count = 0;
+
+  if (x_cells < cells_min || y_cells < cells_min) {
+    for (i = 0;  i < n;  ++i) {
+      list->start[i] = count;
+      for (j = i + 1;  j < n;  ++j) {
+        neighbor_list_add(list, &count, list->bodies[i], list->bodies[j], reach_squared);
+      }
+    }
+  } else {
+    if (x_cells * y_cells > list->cell_capacity) {
+      list->cell_capacity = x_cells * y_cells;
+      list->cell_first = my_realloc(list->cell_first, list->cell_capacity * sizeof(list->cell_first[0]));
+    }
+    for (cell = 0;  cell < x_cells * y_cells;  ++cell) {
+      list->cell_first[cell] = n;
+    }
+
+    for (i = n;  i-- > 0;  ) {
+      planet = list->bodies[i];
+      cx = neighbor_cell(planet->x_pos + margin, grid_width, x_cells);
+      cy = neighbor_cell(planet->y_pos + margin, grid_height, y_cells);
+      cell = cy * x_cells + cx;
+      list->cell_next[i] = list->cell_first[cell];
+      list->cell_first[cell] = i;
+    }
+
+    for (i = 0;  i < n;  ++i) {
+      list->start[i] = count;
+      planet = list->bodies[i];
+      cx = neighbor_cell(planet->x_pos + margin, grid_width, x_cells);
+      cy = neighbor_cell(planet->y_pos + margin, grid_height, y_cells);
+
+      for (dy = 0;  dy < 3;  ++dy) {
+        if (physics->open_world && (cy + dy < 1 || cy + dy > y_cells)) {
+          continue;
+        }
+        for (dx = 0;  dx < 3;  ++dx) {
+          if (physics->open_world && (cx + dx < 1 || cx + dx > x_cells)) {
+            continue;
+          }
+          cell = ((cy + y_cells + dy - 1) % y_cells) * x_cells + (cx + x_cells + dx - 1) % x_cells;
+          for (j = list->cell_first[cell];  j < n;  j = list->cell_next[j]) {
+            if (j > i) {
+              neighbor_list_add(list, &count, planet, list->bodies[j], reach_squared);
+            }
+          }
+        }
+      }
+    }
+  }
+  list->start[n] = count;
+
+  if (list->transposed) {
+    /* A counting sort of every pair by its later planet, going through
+       the earlier ones in order.  cell_next is free by now, to keep each
+       planet's place. */
+    if (count > list->earlier_capacity) {
+      list->earlier_capacity = list->neighbor_capacity;
+      list->earlier = my_realloc(list->earlier, list->earlier_capacity * sizeof(list->earlier[0]));
+    }
+    memset(list->earlier_start, 0, (n + 1) * sizeof(list->earlier_start[0]));
+    for (i = 0;  i < count;  ++i) {
+      ++list->earlier_start[list->neighbors[i]->index + 1];
+    }
+    for (i = 0;  i < n;  ++i) {
+      list->earlier_start[i + 1] += list->earlier_start[i];
+      list->cell_next[i] = list->earlier_start[i];
+    }
+    for (i = 0;  i < n;  ++i) {
+      for (j = list->start[i];  j < list->start[i + 1];  ++j) {
+        list->earlier[list->cell_next[list->neighbors[j]->index]++] = list->bodies[i];
+      }
+    }
+  }
+
+  list->valid = 1;
+  ++list->rebuilds;
+  list->neighbor_total += count;
+  list->body_total += n;
+}
+
+
+size_t neighbor_cell(double offset, double extent, size_t cells) {
+  /* The cell along one axis of the grid that a position, offset from the
+     grid's edge, falls in.  Anything off the grid goes in the nearest cell. */
+  double scaled;
+
+  scaled = offset / extent * cells;
+  if (scaled < 0.0) {
     return 0;
   }
-  if ((count * factor) / factor != count) {
-    fprintf(stderr, "Tick count too large!\n");
+  if (scaled >= cells) {
+    return cells - 1;
+  }
+
+  return (size_t) scaled;
+}
+
+
+void neighbor_list_add(neighbor_list_t *list, size_t *count, planet_t *a, planet_t *b, double reach_squared) {
+  double b_x, b_y;
+  double x_diff, y_diff;
+
+  position_mod(a, b, &b_x, &b_y);
+
+  x_diff = b_x - a->x_pos;
+  y_diff = b_y - a->y_pos;
+
+  if (x_diff * x_diff + y_diff * y_diff >= reach_squared) {
+    return;
+  }
+
+  if (*count == list->neighbor_capacity) {
+    list->neighbor_capacity = list->neighbor_capacity ? 2 * list->neighbor_capacity : 1024;
+    list->neighbors = my_realloc(list->neighbors, list->neighbor_capacity * sizeof(list->neighbors[0]));
+  }
+
+  list->neighbors[(*count)++] = b;
+}
+
+
+void neighbor_list_report(const neighbor_list_t *list) {
+  if (!list->rebuilds) {
+    return;
+  }
+
+  /* Each pair is stored once, but is a neighbor of both planets. */
+  fprintf(stderr, "Neighbor lists: %.1f neighbors per planet, rebuilt %lu times in %lu ticks (every %.1f ticks).\n",
+          list->body_total ? 2.0 * list->neighbor_total / list->body_total : 0.0,
+          list->rebuilds, list->ticks, (double) list->ticks / list->rebuilds);
+}
+
+
+void reorder_planets(planet_list_t *planets, neighbor_list_t *neighbors) {
+  /* Merges and splits leave the list in no particular order, with each
+     planet and node wherever malloc() happened to put it.  This sorts the
+     planets along a Z-order curve and then moves them, and the list nodes,
+     so that walking the list also walks memory from low to high addresses.
+     The planets are moved by copying, so anything pointing at a planet
+     now points at a different one:  the neighbor lists are rebuilt. */
+  planet_node_t **nodes;
+  planet_t **slots;
+  planet_t *contents;
+  uint32_t *keys;
+  size_t *order;
+  planet_node_t *node;
+  size_t count;
+  size_t i;
+
+  count = planets->size;
+  if (count < 2) {
+    return;
+  }
+
+  nodes = my_malloc(count * sizeof(*nodes));
+  slots = my_malloc(count * sizeof(*slots));
+  contents = my_malloc(count * sizeof(*contents));
+  keys = my_malloc(count * sizeof(*keys));
+  order = my_malloc(count * sizeof(*order));
+
+  for (node = planets->first, i = 0;  node;  node = node->next, ++i) {
+    nodes[i] = node;
+    slots[i] = node->planet;
+    keys[i] = morton_code(node->planet);
+    order[i] = i;
+  }
+
+  radix_sort(keys, order, count);
+
+  for (i = 0;  i < count;  ++i) {
+    contents[i] = *slots[order[i]];
+  }
+
+  qsort(slots, count, sizeof(*slots), compare_addresses);
+  qsort(nodes, count, sizeof(*nodes), compare_addresses);
+
+  for (i = 0;  i < count;  ++i) {
+    *slots[i] = contents[i];
+    nodes[i]->planet = slots[i];
+    nodes[i]->next = i + 1 < count ? nodes[i + 1] : NULL;
+  }
+  planets->first = nodes[0];
+
+  if (neighbors) {
+    neighbors->valid = 0;
+  }
+
+  free(nodes);
+  free(slots);
+  free(contents);
+  free(keys);
+  free(order);
+}
+
+
+uint32_t morton_code(const planet_t *planet) {
+  /* Interleaves 16 bits of each coordinate, x in the even bits.  An open
+     world's curve covers its margin too. */
+  const double margin = physics->open_world ? physics->open_margin : 0.0;
+  double x_scaled, y_scaled;
+  uint32_t x, y;
+
+  x_scaled = (planet->x_pos + margin) / (WORLD_WIDTH + 2.0 * margin) * 65536.0;
+  y_scaled = (planet->y_pos + margin) / (WORLD_HEIGHT + 2.0 * margin) * 65536.0;
+
+  x = x_scaled > 0.0 ? (uint32_t) fmin(x_scaled, 65535.0) : 0;
+  y = y_scaled > 0.0 ? (uint32_t) fmin(y_scaled, 65535.0) : 0;
+
+  return spread_bits(x) | (spread_bits(y) << 1);
+}
+
+
+uint32_t spread_bits(uint32_t value) {
+  /* Moves bit i of a 16-bit value to bit 2i. */
+  value = (value | (value << 8)) & 0x00ff00ff;
+  value = (value | (value << 4)) & 0x0f0f0f0f;
+  value = (value | (value << 2)) & 0x33333333;
+  value = (value | (value << 1)) & 0x55555555;
+
+  return value;
+}
+
+
+void radix_sort(uint32_t *keys, size_t *order, size_t count) {
+  /* Sorts keys, and order along with them, a byte at a time from the least
+     significant, which keeps equal keys in their original order. */
+  uint32_t *keys_out;
+  size_t *order_out;
+  uint32_t *swap_keys;
+  size_t *swap_order;
+  size_t counts[256];
+  size_t total, digit_count;
+  size_t i;
+  unsigned shift;
+
+  keys_out = my_malloc(count * sizeof(*keys_out));
+  order_out = my_malloc(count * sizeof(*order_out));
+
+  for (shift = 0;  shift < 32;  shift += 8) {
+    memset(counts, 0, sizeof(counts));
+    for (i = 0;  i < count;  ++i) {
+      ++counts[(keys[i] >> shift) & 0xff];
+    }
+
+    total = 0;
+    for (i = 0;  i < 256;  ++i) {
+      digit_count = counts[i];
+      counts[i] = total;
+      total += digit_count;
+    }
+
+    for (i = 0;  i < count;  ++i) {
+      keys_out[counts[(keys[i] >> shift) & 0xff]] = keys[i];
+      order_out[counts[(keys[i] >> shift) & 0xff]++] = order[i];
+    }
+
+    swap_keys = keys;  keys = keys_out;  keys_out = swap_keys;
+    swap_order = order;  order = order_out;  order_out = swap_order;
+  }
+
+  /* After an even number of passes the result is back in the caller's arrays. */
+  free(keys_out);
+  free(order_out);
+}
+
+
+int compare_addresses(const void *a, const void *b) {
+  const char *p1 = *(char * const *) a;
+  const char *p2 = *(char * const *) b;
+
+  return p1 < p2 ? -1 : p1 > p2;
+}
+
+
+void pacing_init(pacing_t *pacing) {
+  memset(pacing, 0, sizeof(*pacing));
+
+  pacing->woke = monotonic_time();
+  pacing->deadline = pacing->woke + 1.0 / FRAMES_PER_SECOND;
+}
+
+
+void pacing_wait(pacing_t *pacing) {
+  /* Sleeps until the frame's deadline, then sets the next one a frame
+     later.  Deadlines are absolute, so the time it takes to wake up doesn't
+     pile up from frame to frame.  A frame that finishes late but within a
+     frame of its deadline only shortens the next wait; one later than that
+     gives up on the missed deadlines instead of rushing to make them up. */
+  const double interval = 1.0 / FRAMES_PER_SECOND;
+  double now;
+  double busy;
+
+  now = monotonic_time();
+  busy = (now - pacing->woke) / interval;
+
+  ++pacing->frames;
+  pacing->busy_total += busy;
+  if (busy > pacing->busy_max) {
+    pacing->busy_max = busy;
+  }
+  pacing->busy_average += 0.1 * (busy - pacing->busy_average);
+
+  if (now > pacing->deadline) {
+    ++pacing->missed;
+  } else {
+    sleep_until(pacing->deadline);
+  }
+
+  pacing->deadline += interval;
+  if (now > pacing->deadline) {
+    pacing->deadline = now + interval;
+  }
+
+  pacing->woke = monotonic_time();
+}
+
+
+void pacing_adapt(pacing_t *pacing, planets_context_t *context) {
+  /* Steps the load down a level as soon as frames are nearly over budget,
+     and back up once they have had room to spare for a while.  Each change
+     is given a few frames to show its effect before the next. */
+  const size_t level_count = sizeof(pacing_levels) / sizeof(pacing_levels[0]);
+
+  ++pacing->frames_since_change;
+  if (pacing->frames_since_change < PACING_SETTLE_FRAMES) {
+    return;
+  }
+
+  if (pacing->busy_average < PACING_BUSY_LOW) {
+    ++pacing->calm_frames;
+  } else {
+    pacing->calm_frames = 0;
+  }
+
+  if (pacing->busy_average > PACING_BUSY_HIGH && pacing->level + 1 < level_count) {
+    pacing_set_level(pacing, pacing->level + 1, context);
+  } else if (pacing->calm_frames >= PACING_CALM_FRAMES && pacing->level > 0) {
+    pacing_set_level(pacing, pacing->level - 1, context);
+  }
+}
+
+
+void pacing_set_level(pacing_t *pacing, size_t level, planets_context_t *context) {
+  const pacing_level_t *old = &pacing_levels[pacing->level];
+  const pacing_level_t *new = &pacing_levels[level];
+  planets_config_t config = context->thread_arg.config;
+
+  ticks_per_frame = new->ticks_per_frame;
+  circle_step = new->circle_step;
+  config.ticks_per_frame = new->ticks_per_frame;
+
+  /* The cutoff is only the pacing's to change if -c hasn't already set
+     one, and never changes the single precision or fixed-point forces. */
+  if (!config.single_precision && !config.fixed_point && (config.force_cutoff == 0.0 || old->force_cutoff > 0.0)) {
+    config.force_cutoff = new->force_cutoff;
+  }
+
+  planets_configure(context, &config);
+
+  pacing->level = level;
+  pacing->frames_since_change = 0;
+  pacing->calm_frames = 0;
+  ++pacing->level_changes;
+  if (level > pacing->deepest_level) {
+    pacing->deepest_level = level;
+  }
+}
+
+
+void pacing_report(const pacing_t *pacing) {
+  if (!pacing->frames) {
+    return;
+  }
+
+  fprintf(stderr, "Frames: %lu, missed deadlines: %lu (%.1f%%), busy %.0f%% of the budget on average and %.0f%% at most.\n",
+          pacing->frames, pacing->missed, 100.0 * pacing->missed / pacing->frames,
+          100.0 * pacing->busy_total / pacing->frames, 100.0 * pacing->busy_max);
+  if (pacing->level_changes) {
+    fprintf(stderr, "The load was changed %lu times, at most down to level %lu of %lu.\n",
+            pacing->level_changes, pacing->deepest_level, sizeof(pacing_levels) / sizeof(pacing_levels[0]) - 1);
+  }
+}
+
+
+void sleep_until(double deadline) {
+  struct timespec when;
+
+  when.tv_sec = (time_t) deadline;
+  when.tv_nsec = (long) ((deadline - when.tv_sec) * 1e9);
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL) == EINTR);
+}
+
+
+double monotonic_time(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+
+double phase_begin(void) {
+  /* With statistics and tracing disabled this is only a flag test:  no clock is read. */
+  return (stats_enabled || tracing) ? monotonic_time() : 0.0;
+}
+
+
+void phase_end(phase_t phase, double start) {
+  double now;
+
+  if (!(stats_enabled || tracing)) {
+    return;
+  }
+
+  now = monotonic_time();
+
+  if (stats_enabled) {
+    frame_stats.current[phase] += now - start;
+  }
+  if (tracing) {
+    trace_add(phase_names[phase], start, now, TRACE_NO_COUNT);
+  }
+}
+
+
+void stats_add_collision_passes(size_t passes) {
+  if (stats_enabled) {
+    frame_stats.current_passes += passes;
+  }
+}
+
+
+int stats_open_log(const char *path) {
+  size_t len;
+  int phase;
+
+  frame_stats.log = fopen(path, "w");
+  if (frame_stats.log == NULL) {
+    fprintf(stderr, "Couldn't open statistics log %s: ", path);
+    perror(NULL);
+    return -1;
+  }
+
+  len = strlen(path);
+  frame_stats.log_json = len >= 5 && strcmp(path + len - 5, ".json") == 0;
+
+  if (!frame_stats.log_json) {
+    fputs("frame,tick,bodies,collision_passes_mean,collision_passes_max", frame_stats.log);
+    for (phase = 0;  phase < PHASE_COUNT;  ++phase) {
+      fprintf(frame_stats.log, ",%s_mean_ms,%s_p50_ms,%s_p99_ms,%s_max_ms",
+              phase_names[phase], phase_names[phase], phase_names[phase], phase_names[phase]);
+    }
+    fputc('\n', frame_stats.log);
+  }
+
+  stats_enabled = 1;
+
+  return 0;
+}
+
+
+void stats_close_log(void) {
+  if (frame_stats.log) {
+    fclose(frame_stats.log);
+    frame_stats.log = NULL;
+  }
+}
+
+
+void stats_end_frame(size_t tick, size_t body_count) {
+  /* Moves the totals of the frame just finished into the rolling window,
+     evicting the oldest frame from the histograms once the window is full. */
+  size_t slot;
+  int phase;
+
+  slot = frame_stats.next_sample;
+
+  for (phase = 0;  phase < PHASE_COUNT;  ++phase) {
+    if (frame_stats.sample_count == STATS_WINDOW) {
+      --frame_stats.histogram[phase][stats_bucket(frame_stats.samples[phase][slot])];
+    }
+    frame_stats.samples[phase][slot] = frame_stats.current[phase];
+    ++frame_stats.histogram[phase][stats_bucket(frame_stats.current[phase])];
+    frame_stats.current[phase] = 0.0;
+  }
+
+  frame_stats.pass_samples[slot] = frame_stats.current_passes;
+  frame_stats.current_passes = 0;
+
+  frame_stats.next_sample = (slot + 1) % STATS_WINDOW;
+  if (frame_stats.sample_count < STATS_WINDOW) {
+    ++frame_stats.sample_count;
+  }
+
+  ++frame_stats.frame;
+
+  if (frame_stats.log && frame_stats.frame % STATS_LOG_INTERVAL == 0) {
+    stats_write_log(tick, body_count);
+  }
+}
+
+
+size_t stats_bucket(double seconds) {
+  /* Buckets are a quarter octave wide, starting at one microsecond. */
+  double micros;
+  size_t bucket;
+
+  micros = seconds * 1e6;
+  if (micros < 1.0) {
     return 0;
   }
-  return count * factor;
+
+  bucket = 1 + (size_t) (STATS_BUCKETS_PER_OCTAVE * log2(micros));
+
+  return bucket < STATS_BUCKET_COUNT ? bucket : STATS_BUCKET_COUNT - 1;
+}
+
+
+double stats_bucket_limit(size_t bucket) {
+  /* Upper bound of a bucket, in seconds. */
+  return pow(2.0, (double) bucket / STATS_BUCKETS_PER_OCTAVE) * 1e-6;
+}
+
+
+double stats_mean(phase_t phase) {
+  double total = 0.0;
+  size_t i;
+
+  if (!frame_stats.sample_count) {
+    return 0.0;
+  }
+
+  for (i = 0;  i < frame_stats.sample_count;  ++i) {
+    total += frame_stats.samples[phase][i];
+  }
+
+  return total / frame_stats.sample_count;
 }
 
 
-int prepare_anim_dir(anim_spec_t anim) {
-  int err;
+double stats_max(phase_t phase) {
+  double max = 0.0;
+  size_t i;
 
-  if (file_exists(anim.dir)) {
-    fprintf(stderr, "%s already exists.\n", anim.dir);
-    return -1;
+  for (i = 0;  i < frame_stats.sample_count;  ++i) {
+    if (frame_stats.samples[phase][i] > max) {
+      max = frame_stats.samples[phase][i];
+    }
   }
 
-  if ((err = mkdir(anim.dir, 0777)) != 0) {
-    fprintf(stderr, "Couldn't create directory %s: ", anim.dir);
-    perror(NULL);
-    return -1;
-  }
-  return 0;
+  return max;
 }
 
 
-int file_exists(const char *path) {
-  struct stat buf;
-  return stat(path, &buf) == 0;
+double stats_percentile(phase_t phase, double fraction) {
+  size_t wanted;
+  size_t seen = 0;
+  size_t bucket;
+
+  wanted = (size_t) ceil(fraction * frame_stats.sample_count);
+  if (wanted == 0) {
+    return 0.0;
+  }
+
+  for (bucket = 0;  bucket < STATS_BUCKET_COUNT;  ++bucket) {
+    seen += frame_stats.histogram[phase][bucket];
+    if (seen >= wanted) {
+      /* The bucket only bounds the value, so don't report past the real maximum. */
+      return bucket ? fmin(stats_bucket_limit(bucket), stats_max(phase)) : 0.0;
+    }
+  }
+
+  return stats_max(phase);
 }
 
 
-int run_simulation(anim_spec_t anim) {
-  struct timeval start_time;
-  SDL_Event event;
+void stats_passes(double *mean, size_t *max) {
+  size_t total = 0;
   size_t i;
-  pthread_list_t threads;
-  thread_arg_t thread_arg;
-  size_t anim_frame = 1;
-  planet_list_t planets;
 
-  initialize_planets(&planets);
+  *max = 0;
 
-  thread_arg_init(&thread_arg, &planets);
-  if (start_threads(&threads, &thread_arg) < 0) {
-    return -1;
+  for (i = 0;  i < frame_stats.sample_count;  ++i) {
+    total += frame_stats.pass_samples[i];
+    if (frame_stats.pass_samples[i] > *max) {
+      *max = frame_stats.pass_samples[i];
+    }
   }
 
-  for (thread_arg.tick = 0;  !quitting;  ) {
-    gettimeofday(&start_time, NULL);
+  *mean = frame_stats.sample_count ? (double) total / frame_stats.sample_count : 0.0;
+}
 
-    display_planets(&planets);
 
-    if (anim.dir) {
-      if (write_anim_frame(anim, anim_frame) == -1) {
-        break;
-      }
-      ++anim_frame;
-      if (anim_frame > anim.frame_count) {
-        break;
-      }
-    }
+void stats_write_log(size_t tick, size_t body_count) {
+  FILE *log = frame_stats.log;
+  double passes_mean;
+  size_t passes_max;
+  int phase;
 
-    for (i = 0;  i < TICKS_PER_FRAME;  ++i) {
-      tick_planets(&thread_arg);
-      ++thread_arg.tick;
-    }
+  stats_passes(&passes_mean, &passes_max);
 
-    while (SDL_PollEvent(&event)) {
-      handle_sdl_event(&event);
+  if (frame_stats.log_json) {
+    fprintf(log, "{\"frame\":%lu,\"tick\":%lu,\"bodies\":%lu,\"collision_passes\":{\"mean\":%.3f,\"max\":%lu},\"phases\":{",
+            frame_stats.frame, tick, body_count, passes_mean, passes_max);
+    for (phase = 0;  phase < PHASE_COUNT;  ++phase) {
+      fprintf(log, "%s\"%s\":{\"mean_ms\":%.4f,\"p50_ms\":%.4f,\"p99_ms\":%.4f,\"max_ms\":%.4f}",
+              phase ? "," : "", phase_names[phase],
+              1e3 * stats_mean(phase), 1e3 * stats_percentile(phase, 0.5),
+              1e3 * stats_percentile(phase, 0.99), 1e3 * stats_max(phase));
     }
-
-    if (!anim.dir) {
-      wait_for_next_tick(&start_time);
+    fputs("}}\n", log);
+  } else {
+    fprintf(log, "%lu,%lu,%lu,%.3f,%lu", frame_stats.frame, tick, body_count, passes_mean, passes_max);
+    for (phase = 0;  phase < PHASE_COUNT;  ++phase) {
+      fprintf(log, ",%.4f,%.4f,%.4f,%.4f",
+              1e3 * stats_mean(phase), 1e3 * stats_percentile(phase, 0.5),
+              1e3 * stats_percentile(phase, 0.99), 1e3 * stats_max(phase));
     }
+    fputc('\n', log);
   }
 
-  stop_threads(&threads, &thread_arg);
-
-  return 0;
+  fflush(log);
 }
 
 
-int start_threads(pthread_list_t *threads, thread_arg_t *arg) {
-  size_t thread_count;
-  size_t i;
+int telemetry_start(const char *path) {
+  struct sockaddr_un addr;
+  struct stat buf;
 
-  thread_count = (size_t) get_nprocs();
-  if (pthread_list_init(threads, thread_count) < 0) {
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Telemetry socket path %s is too long.\n", path);
     return -1;
   }
-  arg->running = 1;
+  strcpy(addr.sun_path, path);
 
-  for (i = 0;  i < thread_count;  ++i) {
-    pthread_create(&threads->array[i], 0, t_planet_ticker, arg);
+  telemetry.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (telemetry.listen_fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  /* A socket left behind by an earlier run would make bind() fail, but
+     one that a running instance still answers on is left alone. */
+  if (stat(path, &buf) == 0 && S_ISSOCK(buf.st_mode)) {
+    if (connect(telemetry.listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+      fprintf(stderr, "Another run is already serving telemetry on %s.\n", path);
+      close(telemetry.listen_fd);
+      return -1;
+    }
+    if (errno == ECONNREFUSED) {
+      unlink(path);
+    }
+    /* A socket that tried to connect can't listen, so start over. */
+    close(telemetry.listen_fd);
+    telemetry.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (telemetry.listen_fd < 0) {
+      perror("socket");
+      return -1;
+    }
+  }
+  if (bind(telemetry.listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(telemetry.listen_fd, 8) < 0) {
+    fprintf(stderr, "Couldn't listen on %s: ", path);
+    perror(NULL);
+    close(telemetry.listen_fd);
+    return -1;
   }
 
+  /* The phase timings come from the statistics. */
+  stats_enabled = 1;
+
+  telemetry.sequence = 0;
+  memset(&telemetry.data, 0, sizeof(telemetry.data));
+  telemetry.start = monotonic_time();
+  telemetry.path = path;
+
+  pthread_create(&telemetry.thread, 0, t_telemetry_server, NULL);
+
   return 0;
 }
 
 
-void stop_threads(pthread_list_t *threads, thread_arg_t *arg) {
-  size_t i;
+void telemetry_stop(void) {
+  /* Shutting the listening socket down wakes the server out of accept(). */
+  shutdown(telemetry.listen_fd, SHUT_RDWR);
+  pthread_join(telemetry.thread, 0);
+  close(telemetry.listen_fd);
+  unlink(telemetry.path);
+  telemetry.path = NULL;
+}
 
-  thread_arg_stop_running(arg);
 
-  for (i = 0;  i < threads->size;  ++i) {
-    pthread_join(threads->array[i], 0);
-  }
+void telemetry_publish(size_t tick, size_t frame, size_t frame_count, const planet_list_t *planets) {
+  telemetry_data_t data;
+  const planet_node_t *node;
+  int phase;
 
-  pthread_list_delete(threads);
-}
+  data.tick = tick;
+  data.frame = frame;
+  data.frame_count = frame_count;
+  data.bodies = planets->size;
 
+  data.mass = 0.0;
+  for (node = planets->first;  node;  node = node->next) {
+    data.mass += node->planet->mass;
+  }
+  total_momentum(planets, &data.x_momentum, &data.y_momentum);
 
-int pthread_list_init(pthread_list_t *list, size_t size) {
-  list->array = calloc(size, sizeof(list->array[0]));
-  if (list->array == NULL) {
-    perror("calloc()");
-    return -1;
+  for (phase = 0;  phase < PHASE_COUNT;  ++phase) {
+    data.phase_ms[phase] = 1e3 * stats_mean(phase);
   }
-  list->size = size;
-  return 0;
+
+  data.exported_frames = exported_frames;
+  data.exported_bytes = exported_bytes;
+  data.uptime = monotonic_time() - telemetry.start;
+
+  ++telemetry.sequence;
+  __sync_synchronize();
+  telemetry.data = data;
+  __sync_synchronize();
+  ++telemetry.sequence;
 }
 
 
-void pthread_list_delete(pthread_list_t *list) {
-  free(list->array);
-  list->array = 0;
-  list->size = 0;
+void telemetry_read(telemetry_data_t *data) {
+  unsigned sequence;
+
+  do {
+    while ((sequence = telemetry.sequence) & 1) {
+      sched_yield();
+    }
+    __sync_synchronize();
+    *data = telemetry.data;
+    __sync_synchronize();
+  } while (telemetry.sequence != sequence);
 }
 
 
-void *t_planet_ticker(void *void_arg) {
-  thread_arg_t *arg;
-  planet_node_t *node = NULL;
+void *t_telemetry_server(void *unused) {
+  /* Answers every connection with the latest snapshot and hangs up. */
+  telemetry_data_t data;
+  char line[1024];
+  int len;
+  int fd;
 
-  arg = (thread_arg_t *) void_arg;
+  trace_register_thread("telemetry", 0);
 
-  while (arg->running) {
-    node = thread_arg_get_planet_node(arg, node != NULL);
-    if (node) {
-      calculate_planet_forces(node);
+  for (;;) {
+    fd = accept(telemetry.listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      break;
     }
+
+    telemetry_read(&data);
+    len = telemetry_format(&data, line, sizeof(line));
+    if (send(fd, line, len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+      perror("telemetry send");
+    }
+    close(fd);
   }
 
   return 0;
 }
 
 
-int handle_sdl_event(SDL_Event *event) {
-  switch (event->type) {
-    case SDL_QUIT:
-      quitting = 1;
-      break;
+int telemetry_format(const telemetry_data_t *data, char *buf, size_t size) {
+  double seconds;
+  size_t len;
+  int phase;
 
-    case SDL_KEYDOWN:
-      handle_key_press_event(&event->key.keysym);
-      break;
+  seconds = data->uptime > 0.0 ? data->uptime : 1.0;
 
-    default:
-      break;
+  len = snprintf(buf, size, "{\"tick\":%lu,\"frame\":%lu,\"frame_count\":%lu,\"bodies\":%lu,"
+                 "\"mass\":%.6f,\"x_momentum\":%.6g,\"y_momentum\":%.6g,\"phases_ms\":{",
+                 data->tick, data->frame, data->frame_count, data->bodies,
+                 data->mass, data->x_momentum, data->y_momentum);
+  for (phase = 0;  phase < PHASE_COUNT && len < size;  ++phase) {
+    len += snprintf(buf + len, size - len, "%s\"%s\":%.4f", phase ? "," : "", phase_names[phase], data->phase_ms[phase]);
+  }
+  if (len < size) {
+    len += snprintf(buf + len, size - len, "},\"export\":{\"frames\":%lu,\"frames_per_second\":%.2f,\"mb_per_second\":%.3f},\"uptime\":%.1f}\n",
+                    data->exported_frames, data->exported_frames / seconds, data->exported_bytes / seconds / 1e6, data->uptime);
   }
 
-  return 0;
+  return len < size ? (int) len : (int) size - 1;
 }
 
 
-void handle_key_press_event(SDL_keysym *keysym) {
-  switch (keysym->sym) {
-    case SDLK_ESCAPE:
-      quitting = 1;
-      break;
+int run_telemetry_client(const char *path) {
+  /* Prints a line from the server once a second.  A run that has ended
+     refuses the connection, which ends the polling too. */
+  struct sockaddr_un addr;
+  char buf[1024];
+  size_t connections = 0;
+  ssize_t len;
+  int fd;
 
-    default:
-      break;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Telemetry socket path %s is too long.\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  for (;;) {
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      perror("socket");
+      return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+      close(fd);
+      if (connections) {
+        fputs("The run has ended.\n", stderr);
+        return 0;
+      }
+      fprintf(stderr, "Couldn't connect to %s: ", path);
+      perror(NULL);
+      return -1;
+    }
+    ++connections;
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+      fwrite(buf, 1, len, stdout);
+    }
+    fflush(stdout);
+    close(fd);
+
+    usleep((useconds_t) (TELEMETRY_POLL_INTERVAL * 1e6));
   }
 }
 
 
-int initialize_display(void) {
-  int screen_width, screen_height;
+int snapshot_start(const char *name, size_t capacity) {
+  snapshot_header_t *header;
+  int fd;
 
-  screen_size(&screen_width, &screen_height);
+  if (snapshot_name(snapshot_ring.name, name) < 0) {
+    return -1;
+  }
 
-  if (set_up_pixel_format() < 0) {
+  /* Memory left behind by an earlier run that didn't stop cleanly is
+     unlinked and made afresh, its viewers keeping the old one mapped, but
+     a run still publishing under the name keeps it. */
+  fd = shm_open(snapshot_ring.name, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0 && errno == EEXIST) {
+    if (!snapshot_abandoned(snapshot_ring.name)) {
+      fprintf(stderr, "Another -P run is already publishing as %s.\n", name);
+      return -1;
+    }
+    shm_unlink(snapshot_ring.name);
+    fd = shm_open(snapshot_ring.name, O_RDWR | O_CREAT | O_EXCL, 0644);
+  }
+  if (fd < 0) {
+    fprintf(stderr, "Couldn't create shared memory %s: ", snapshot_ring.name);
+    perror(NULL);
     return -1;
   }
 
-  if (create_window("Planets", screen_width, screen_height, video_flags) < 0) {
+  snapshot_ring.map_size = sizeof(*header) +
+                           SNAPSHOT_SLOT_COUNT * (sizeof(snapshot_slot_t) + capacity * sizeof(snapshot_body_t));
+  if (ftruncate(fd, snapshot_ring.map_size) < 0) {
+    perror("ftruncate");
+    close(fd);
+    shm_unlink(snapshot_ring.name);
     return -1;
   }
 
-  if (initialize_openGL(screen_width, screen_height) < 0) {
+  header = mmap(NULL, snapshot_ring.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (header == MAP_FAILED) {
+    perror("mmap");
+    shm_unlink(snapshot_ring.name);
     return -1;
   }
 
+  header->capacity = capacity;
+  header->open_world = open_world;
+  header->published = 0;
+  header->ended = 0;
+  header->publisher = getpid();
+  __sync_synchronize();
+  memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+
+  snapshot_ring.header = header;
+  snapshot_ring.truncated = 0;
+
   return 0;
 }
 
 
-void screen_size(int *w, int *h) {
-  *h = SCREEN_HEIGHT_INIT;
-  *w = (int) (WORLD_ASPECT_RATIO * *h + 0.5);
+int snapshot_abandoned(const char *shm_name) {
+  /* Whether the ring under this name was left by a run that has ended or
+     is gone, or was never finished being made. */
+  snapshot_header_t *header;
+  struct stat buf;
+  int abandoned;
+  int fd;
+
+  fd = shm_open(shm_name, O_RDONLY, 0);
+  if (fd < 0) {
+    return 0;
+  }
+  if (fstat(fd, &buf) < 0 || (size_t) buf.st_size < sizeof(*header)) {
+    close(fd);
+    return 1;
+  }
+  header = mmap(NULL, sizeof(*header), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (header == MAP_FAILED) {
+    return 0;
+  }
+
+  abandoned = memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 || header->ended ||
+              (kill((pid_t) header->publisher, 0) < 0 && errno == ESRCH);
+  munmap(header, sizeof(*header));
+
+  return abandoned;
 }
 
 
-int set_up_pixel_format(void) {
-  const SDL_VideoInfo *video_info;
+void snapshot_stop(void) {
+  /* Viewers still attached see the run has ended; new ones can't find it. */
+  snapshot_ring.header->ended = 1;
+  munmap(snapshot_ring.header, snapshot_ring.map_size);
+  snapshot_ring.header = NULL;
+  shm_unlink(snapshot_ring.name);
+}
 
-  video_flags = SDL_OPENGL;
-  video_flags |= SDL_HWPALETTE;
 
-  video_info = SDL_GetVideoInfo();
-  if (video_info == NULL) {
-    fprintf(stderr, "Failed to get video info: %s", SDL_GetError());
-    return -1;
-  }
+void snapshot_publish(size_t tick, const planet_list_t *planets) {
+  snapshot_header_t *header = snapshot_ring.header;
+  snapshot_slot_t *slot;
+  snapshot_body_t *body;
+  const planet_node_t *node;
+  const planet_t *planet;
+  size_t count = 0;
 
-  if (video_info->hw_available) {
-    video_flags |= SDL_HWSURFACE;
-  } else {
-    video_flags |= SDL_SWSURFACE;
-  }
+  slot = snapshot_slot(header, header->published % SNAPSHOT_SLOT_COUNT);
 
-  if (video_info->blit_hw) {
-    video_flags |= SDL_HWACCEL;
+  ++slot->sequence;
+  __sync_synchronize();
+
+  body = (snapshot_body_t *) (slot + 1);
+  for (node = planets->first;  node && count < header->capacity;  node = node->next, ++count) {
+    planet = node->planet;
+    body->x_pos = planet->x_pos;
+    body->y_pos = planet->y_pos;
+    body->radius = planet->radius;
+    body->mass = planet->mass;
+    body->hue = planet->hue;
+    ++body;
   }
+  slot->tick = tick;
+  slot->count = count;
 
-  SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
-  SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, SCREEN_DEPTH);
-  SDL_GL_SetAttribute(SDL_GL_STENCIL_SIZE, 0);
-  SDL_GL_SetAttribute(SDL_GL_ACCUM_RED_SIZE, 0);
-  SDL_GL_SetAttribute(SDL_GL_ACCUM_GREEN_SIZE, 0);
-  SDL_GL_SetAttribute(SDL_GL_ACCUM_BLUE_SIZE, 0);
-  SDL_GL_SetAttribute(SDL_GL_ACCUM_ALPHA_SIZE, 0);
+  __sync_synchronize();
+  ++slot->sequence;
+  __sync_synchronize();
+  ++header->published;
 
-  return 0;
+  if (node && !snapshot_ring.truncated) {
+    fprintf(stderr, "There are more planets than the %lu the viewers are shown.\n", (unsigned long) header->capacity);
+    snapshot_ring.truncated = 1;
+  }
 }
 
 
-int create_window(const char *window_name, int width, int height, int video_flags) {
-  main_window = SDL_SetVideoMode(width, height, SCREEN_DEPTH, video_flags);
-  if ( main_window == NULL ) {
-    fprintf(stderr, "Failed to create window: %s", SDL_GetError());
-    return -1;
-  }
-  SDL_WM_SetCaption(window_name, window_name);
-  return 0;
+snapshot_slot_t *snapshot_slot(snapshot_header_t *header, size_t slot) {
+  return (snapshot_slot_t *) ((char *) (header + 1) +
+                              slot * (sizeof(snapshot_slot_t) + header->capacity * sizeof(snapshot_body_t)));
 }
 
 
-int initialize_openGL(int width, int height) {
-  size_openGL_screen(width, height);
-  return 0;
-}
+int snapshot_read(snapshot_header_t *header, planet_t *planets, planet_node_t *nodes, planet_list_t *list) {
+  /* Copies the newest frame into the planets, and links as many of the
+     nodes as there are into the list.  Returns -1 if there's no frame yet. */
+  const snapshot_body_t *body;
+  snapshot_slot_t *slot;
+  uint64_t published;
+  uint64_t sequence;
+  size_t count;
+  size_t i;
 
+  do {
+    published = header->published;
+    if (!published) {
+      return -1;
+    }
+    slot = snapshot_slot(header, (published - 1) % SNAPSHOT_SLOT_COUNT);
 
-void size_openGL_screen(int width, int height) {
-  const float world_aspect = (float) (WORLD_WIDTH / WORLD_HEIGHT);
-  float screen_aspect;
-  float xscale, yscale;
+    while ((sequence = slot->sequence) & 1) {
+      sched_yield();
+    }
+    __sync_synchronize();
 
-  if ( height == 0 ) {
-    height = 1;
-  }
+    count = slot->count;
+    if (count > header->capacity) {
+      count = header->capacity;
+    }
+    body = (const snapshot_body_t *) (slot + 1);
+    for (i = 0;  i < count;  ++i, ++body) {
+      planets[i].x_pos = body->x_pos;
+      planets[i].y_pos = body->y_pos;
+      planets[i].radius = body->radius;
+      planets[i].mass = body->mass;
+      planets[i].hue = body->hue;
+    }
 
-  screen_aspect = (float) width / height;
+    __sync_synchronize();
+  } while (slot->sequence != sequence);
 
-  glViewport(0, 0, width, height);
+  for (i = 0;  i < count;  ++i) {
+    nodes[i].next = i + 1 < count ? &nodes[i + 1] : NULL;
+  }
+  list->first = count ? nodes : NULL;
+  list->size = count;
 
-  glMatrixMode(GL_MODELVIEW);
-  glLoadIdentity();
+  return 0;
+}
 
-  if (screen_aspect > world_aspect) {
-    xscale = 2.0f/(WORLD_HEIGHT*screen_aspect);
-    yscale = 2.0f/WORLD_HEIGHT;
-  } else {
-    xscale = 2.0f/WORLD_WIDTH;
-    yscale = 2.0f/(WORLD_WIDTH/screen_aspect);
+
+int snapshot_name(char *dest, const char *name) {
+  /* Shared memory names start with a slash, which the user may leave off. */
+  if (strlen(name) + 2 > NAME_MAX) {
+    fprintf(stderr, "Shared memory name %s is too long.\n", name);
+    return -1;
   }
-  glScalef(xscale, yscale, 1.0f);
-  glTranslatef(-WORLD_WIDTH/2.0f, -WORLD_HEIGHT/2.0f, 0.0f);
+  snprintf(dest, NAME_MAX, "%s%s", name[0] == '/' ? "" : "/", name);
+
+  return 0;
 }
 
 
-void initialize_planets(planet_list_t *planets) {
+#ifndef PLANETS_LIBRARY
+int run_viewer(const char *name) {
+  /* Shows the newest frame a -P run has published, once a frame, until the
+     run ends or the window is closed. */
+  char shm_name[NAME_MAX];
+  snapshot_header_t *header;
+  planet_t *planets;
+  planet_node_t *nodes;
+  planet_list_t list;
+  pacing_t pacing;
+  SDL_Event event;
+  struct stat buf;
+  uint64_t published;
+  uint64_t shown = 0;
+  size_t map_size;
   size_t i;
-  planet_t *planet;
-  double x_pos, y_pos;
-  double x_vel, y_vel;
-  double speed, angle;
-  double mass;
+  int fd;
 
-  list_init(planets);
+  if (snapshot_name(shm_name, name) < 0) {
+    return -1;
+  }
+
+  fd = shm_open(shm_name, O_RDONLY, 0);
+  if (fd < 0 || fstat(fd, &buf) < 0) {
+    fprintf(stderr, "Couldn't open shared memory %s: ", shm_name);
+    perror(NULL);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  map_size = buf.st_size;
+  header = map_size >= sizeof(*header) ? mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (header == MAP_FAILED ||
+      memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+      map_size != sizeof(*header) + SNAPSHOT_SLOT_COUNT * (sizeof(snapshot_slot_t) + header->capacity * sizeof(snapshot_body_t))) {
+    fprintf(stderr, "%s isn't a running -P simulation.\n", shm_name);
+    if (header != MAP_FAILED) {
+      munmap(header, map_size);
+    }
+    return -1;
+  }
+
+  open_world = header->open_world;
+  camera_limit();
 
-  mass = TOTAL_MASS / PLANET_COUNT_INITIAL;
+  if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+    fprintf(stderr, "SDL_Init() failed: %s\n", SDL_GetError());
+    munmap(header, map_size);
+    return -1;
+  }
+  atexit(SDL_Quit);
+  SDL_ShowCursor(SDL_DISABLE);
+  if (initialize_display() < 0) {
+    munmap(header, map_size);
+    return -1;
+  }
 
-  for (i = 0;  i < PLANET_COUNT_INITIAL;  ++i) {
-    x_pos = rand_normal() * WORLD_WIDTH;
-    y_pos = rand_normal() * WORLD_HEIGHT;
+  /* Only what drawing looks at is filled in. */
+  planets = calloc(header->capacity ? header->capacity : 1, sizeof(*planets));
+  nodes = calloc(header->capacity ? header->capacity : 1, sizeof(*nodes));
+  if (!planets || !nodes) {
+    perror("calloc()");
+    exit(1);
+  }
+  for (i = 0;  i < header->capacity;  ++i) {
+    nodes[i].planet = &planets[i];
+  }
+  list_init(&list);
 
-    speed = rand_normal() * VEL_INIT_MAX;
-    angle = rand_normal() * 2.0 * M_PI;
+  pacing_init(&pacing);
 
-    x_vel = speed * cos(angle);
-    y_vel = speed * sin(angle);
+  while (!quitting && !header->ended) {
+    published = header->published;
+    if (published != shown && snapshot_read(header, planets, nodes, &list) == 0) {
+      shown = published;
+    }
+    display_planets(&list, NULL);
 
-    planet = planet_new(x_pos, y_pos, x_vel, y_vel, mass, 0.0, 0);
-    list_add(planets, planet);
+    while (SDL_PollEvent(&event)) {
+      handle_sdl_event(&event);
+    }
+    pacing_wait(&pacing);
   }
-}
 
+  if (header->ended) {
+    fputs("The run has ended.\n", stderr);
+  }
 
-void display_planets(const planet_list_t *planets) {
-  planet_node_t *node;
+  free(planets);
+  free(nodes);
+  munmap(header, map_size);
 
-  glClear(GL_COLOR_BUFFER_BIT);
+  return 0;
+}
+#endif
 
-  for (node = planets->first;  node;  node = node->next) {
-    draw_planet(node->planet);
-  }
 
-  SDL_GL_SwapBuffers();
+void handle_quit_signal(int signum) {
+  quitting = 1;
 }
 
 
-void draw_planet(planet_t *planet) {
-  color_planet(planet);
+int trace_open(void) {
+  trace_epoch = monotonic_time();
+  tracing = 1;
 
-  draw_circle(planet->x_pos, planet->y_pos, planet->radius);
+  trace_register_thread("main", 0);
 
-  if (planet->x_pos - planet->radius < 0.0) {
-    draw_circle(planet->x_pos + WORLD_WIDTH, planet->y_pos, planet->radius);
-    if (planet->y_pos - planet->radius < 0.0) {
-      draw_circle(planet->x_pos + WORLD_WIDTH, planet->y_pos + WORLD_HEIGHT, planet->radius);
-    }
-    if (planet->y_pos + planet->radius >= WORLD_HEIGHT) {
-      draw_circle(planet->x_pos + WORLD_WIDTH, planet->y_pos - WORLD_HEIGHT, planet->radius);
-    }
-  }
-  if (planet->x_pos + planet->radius >= WORLD_WIDTH) {
-    draw_circle(planet->x_pos - WORLD_WIDTH, planet->y_pos, planet->radius);
-    if (planet->y_pos - planet->radius < 0.0) {
-      draw_circle(planet->x_pos - WORLD_WIDTH, planet->y_pos + WORLD_HEIGHT, planet->radius);
-    }
-    if (planet->y_pos + planet->radius >= WORLD_HEIGHT) {
-      draw_circle(planet->x_pos - WORLD_WIDTH, planet->y_pos - WORLD_HEIGHT, planet->radius);
-    }
-  }
-  if (planet->y_pos - planet->radius < 0.0) {
-    draw_circle(planet->x_pos, planet->y_pos + WORLD_HEIGHT, planet->radius);
-  }
-  if (planet->y_pos + planet->radius >= WORLD_HEIGHT) {
-    draw_circle(planet->x_pos, planet->y_pos - WORLD_HEIGHT, planet->radius);
-  }
+  return thread_trace_ring ? 0 : -1;
 }
 
 
-void color_planet(planet_t *planet) {
-  float value;
-  double r, g, b;
-
-  value = MIN_BRIGHTNESS + (MAX_BRIGHTNESS - MIN_BRIGHTNESS) * (planet->mass - MASS_MIN) / (MASS_MAX - MASS_MIN);
+void trace_register_thread(const char *name_format, size_t num) {
+  /* Gives the calling thread its own ring.  A num of -1 numbers threads in
+     the order they register. */
+  size_t index;
+  trace_ring_t *ring;
 
-  if (value < 0.0f) {
-    value = 0.0f;
+  if (!tracing) {
+    return;
   }
-  if (value > 2.0f) {
-    value = 2.0f;
+
+  index = __sync_fetch_and_add(&trace_ring_count, 1);
+  if (index >= TRACE_THREAD_MAX) {
+    fputs("Too many threads to trace; ignoring the rest.\n", stderr);
+    return;
   }
 
-  hue_to_rgb(planet->hue, &r, &g, &b);
-  scale_color(value, &r, &g, &b);
+  ring = &trace_rings[index];
+  ring->events = my_malloc(TRACE_RING_SIZE * sizeof(ring->events[0]));
+  ring->written = 0;
+  ring->work_count = 0;
+  snprintf(ring->thread_name, sizeof(ring->thread_name), name_format, num == (size_t) -1 ? index : num);
 
-  glColor3f((float) r, (float) g, (float) b);
+  thread_trace_ring = ring;
 }
 
 
-void hue_to_rgb(double hue, double *r, double *g, double *b) {
-  size_t step;
+double trace_begin(void) {
+  return tracing ? monotonic_time() : 0.0;
+}
 
-  while (hue < 0.0) {
-    hue += 360.0;
-  }
-  while (hue >= 360.0) {
-    hue -= 360.0;
+
+void trace_end(const char *name, double start, size_t count) {
+  if (tracing) {
+    trace_add(name, start, monotonic_time(), count);
   }
+}
 
-  step = (size_t) (hue / 60.0);
 
-  *r = *g = *b = 0.0;
+void trace_add(const char *name, double start, double end, size_t count) {
+  trace_ring_t *ring = thread_trace_ring;
+  trace_event_t *event;
 
-  switch (step) {
-    case 0:  /* 0 - 60 */
-      *r = 1.0;
-      *g = hue / 60.0;
-      break;
-    case 1: /* 60 - 120 */
-      *r = (120.0 - hue) / 60.0;
-      *g = 1.0;
-      break;
-    case 2: /* 120 - 180 */
-      *g = 1.0;
-      *b = (hue - 120.0) / 60.0;
-      break;
-    case 3: /* 180 - 240 */
-      *g = (240.0 - hue) / 60.0;
-      *b = 1.0;
-      break;
-    case 4: /* 240 - 300 */
-      *r = (hue - 240.0) / 60.0;
-      *b = 1.0;
-      break;
-    case 5:  /* 300 - 360 */
-      *r = 1.0;
-      *b = (360.0 - hue) / 60.0;
-      break;
+  if (ring == NULL) {
+    return;
   }
-}
 
+  event = &ring->events[ring->written % TRACE_RING_SIZE];
+  event->name = name;
+  event->start = start;
+  event->end = end;
+  event->count = count;
 
-void scale_color(double brightness, double *r, double *g, double *b) {
-  if (brightness < 1.0) {
-    *r *= brightness;
-    *g *= brightness;
-    *b *= brightness;
-  } else {
-    brightness = 2.0 - brightness;
-    *r = (1.0 - ((1.0 - *r) * brightness));
-    *g = (1.0 - ((1.0 - *g) * brightness));
-    *b = (1.0 - ((1.0 - *b) * brightness));
-  }
+  ++ring->written;
 }
 
 
-void draw_circle(double cx, double cy, double radius) {
-  float angle;
-  const float angle_diff = 2 * M_PI / CIRCLE_POLY_COUNT;
-  size_t i;
-  float x, y;
+void trace_count_work(void) {
+  /* Consecutive pieces of work are reported as one span, which is closed
+     when the thread next has to wait. */
+  trace_ring_t *ring = thread_trace_ring;
 
-  glBegin(GL_TRIANGLE_FAN);
-    for (angle = 0.0f, i = 0;  i < CIRCLE_POLY_COUNT;  angle += angle_diff, ++i) {
-      x = (float) (cx + radius * cos(angle));
-      y = (float) (cy + radius * sin(angle));
-      glVertex2f(x, y);
-    }
-  glEnd();
+  if (ring == NULL) {
+    return;
+  }
+
+  if (!ring->work_count) {
+    ring->work_start = monotonic_time();
+  }
+  ++ring->work_count;
 }
 
 
-int write_anim_frame(anim_spec_t anim, size_t frame_num) {
-  char frame_path[64];
-  int width, height;
+void trace_flush_work(void) {
+  trace_ring_t *ring = thread_trace_ring;
 
-  if (anim_frame_pathname(frame_path, sizeof(frame_path), frame_num, anim) == -1) {
-    return -1;
+  if (ring == NULL || !ring->work_count) {
+    return;
   }
-  screen_size(&width, &height);
-  return dump_screen_PNG(frame_path, width, height);
+
+  trace_add("work", ring->work_start, monotonic_time(), ring->work_count);
+  ring->work_count = 0;
 }
 
 
-int anim_frame_pathname(char *dest, size_t size, size_t num, anim_spec_t anim) {
-  size_t dc;
+int trace_write(const char *path) {
+  /* Must only be called once every traced thread other than this one has exited. */
+  FILE *fp;
+  trace_ring_t *ring;
+  trace_event_t *event;
+  size_t ring_count;
+  size_t tid;
+  size_t i;
+  size_t first;
 
-  dc = digit_count(anim.frame_count);
-  if (snprintf(dest, size, "%s/frame%0*lu.png", anim.dir, (int) dc, num) >= size) {
-    fputs("Buffer to small to store frame path name!\n", stderr);
+  fp = fopen(path, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "Couldn't write trace %s: ", path);
+    perror(NULL);
     return -1;
   }
-  return 0;
-}
 
+  ring_count = trace_ring_count < TRACE_THREAD_MAX ? trace_ring_count : TRACE_THREAD_MAX;
 
-int dump_screen_PNG(const char *path, int width, int height) {
-  static char *pixel_data = NULL;
+  fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", fp);
 
-  if (pixel_data == NULL) {
-    pixel_data = my_malloc(3 * width * height);
+  for (tid = 0;  tid < ring_count;  ++tid) {
+    fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%lu,\"args\":{\"name\":\"%s\"}}",
+            tid ? ",\n" : "", tid, trace_rings[tid].thread_name);
   }
 
-  glReadBuffer(GL_FRONT);
-  glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixel_data);
+  for (tid = 0;  tid < ring_count;  ++tid) {
+    ring = &trace_rings[tid];
+    first = ring->written > TRACE_RING_SIZE ? ring->written - TRACE_RING_SIZE : 0;
 
-  return write_PNG(path, pixel_data, width, height);
-}
+    for (i = first;  i < ring->written;  ++i) {
+      event = &ring->events[i % TRACE_RING_SIZE];
+      fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f",
+              event->name, tid, 1e6 * (event->start - trace_epoch), 1e6 * (event->end - event->start));
+      if (event->count != TRACE_NO_COUNT) {
+        fprintf(fp, ",\"args\":{\"count\":%lu}", event->count);
+      }
+      fputc('}', fp);
+    }
 
+    if (first) {
+      fprintf(stderr, "Trace of thread %s kept only its last %d events.\n", ring->thread_name, TRACE_RING_SIZE);
+    }
+  }
 
-size_t digit_count(size_t num) {
-  size_t count = 0;
+  fputs("\n]}\n", fp);
 
-  if (num == 0) {
-    return 1;
+  if (fclose(fp) != 0) {
+    fprintf(stderr, "Couldn't write trace %s: ", path);
+    perror(NULL);
+    return -1;
   }
 
-  while (num > 0) {
-    ++count;
-    num /= 10;
-  }
-  return count;
+  return 0;
 }
 
 
-int write_PNG(const char *path, char *pixels_rgb, int width, int height) {
-  /* Adapted from https://www.lemoda.net/c/write-png/ */
-
-  FILE * fp;
-  png_structp png_ptr = NULL;
-  png_infop info_ptr = NULL;
-  size_t y;
-  png_byte ** row_pointers = NULL;
-  /* "status" contains the return value of this function. At first
-     it is set to a value which means 'failure'. When the routine
-     has finished its work, it is set to a value which means 'success'. */
-  int status = -1;
-
-  int pixel_size = 3;
-  int depth = 8;
-  
-  fp = fopen(path, "wb");
-  if (!fp) {
-    goto fopen_failed;
-  }
+int start_ranks(dist_t *dist, int rank_count, double near_width) {
+  /* Forks the other ranks, all connected to each other.  Every process
+     returns with its own dist, so check dist->transport->rank to tell
+     which one you are. */
+  double column_width;
 
-  png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-  if (png_ptr == NULL) {
-    goto png_create_write_struct_failed;
-  }
-  
-  info_ptr = png_create_info_struct(png_ptr);
-  if (info_ptr == NULL) {
-    goto png_create_info_struct_failed;
-  }
-  
-  /* Set up error handling. */
-  if (setjmp (png_jmpbuf (png_ptr))) {
-      goto png_failure;
-  }
-  
-  png_set_IHDR (png_ptr,
-                info_ptr,
-                width,
-                height,
-                depth,
-                PNG_COLOR_TYPE_RGB,
-                PNG_INTERLACE_NONE,
-                PNG_COMPRESSION_TYPE_DEFAULT,
-                PNG_FILTER_TYPE_DEFAULT);
-  
-  /* Initialize rows of PNG. */
-  row_pointers = png_malloc(png_ptr, height * sizeof (png_byte *));
-  for (y = 0; y < height; y++) {
-      png_byte *row = png_malloc (png_ptr, sizeof (uint8_t) * width * pixel_size);
-      memcpy(row, pixels_rgb + y*width*pixel_size, width*pixel_size);
-      row_pointers[height - 1 - y] = row;
+  dist->children = my_malloc(rank_count * sizeof(*dist->children));
+  dist->transport = socket_transport_create(rank_count, dist->children);
+  if (!dist->transport) {
+    free(dist->children);
+    return -1;
   }
-  
-  /* Write the image data to "fp". */
-  png_init_io(png_ptr, fp);
-  png_set_rows(png_ptr, info_ptr, row_pointers);
-  png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
 
-  /* The routine has successfully written the file, so we set
-     "status" to a value which indicates success. */
-  status = 0;
-  
-  for (y = 0; y < height; y++) {
-    png_free(png_ptr, row_pointers[y]);
+  dist->columns = (size_t) rank_count * DIST_COLUMNS_PER_RANK;
+  column_width = WORLD_WIDTH / dist->columns;
+  dist->near_width = near_width;
+  dist->near_columns = (size_t) ceil(near_width / column_width);
+
+  list_init(&dist->ghosts);
+  dist->aggregates = my_malloc(dist->columns * DIST_AGGREGATE_ROWS * 3 * sizeof(*dist->aggregates));
+  dist->send_buffers = my_malloc(rank_count * sizeof(*dist->send_buffers));
+  memset(dist->send_buffers, 0, rank_count * sizeof(*dist->send_buffers));
+  dist->recv_buffer = NULL;
+  dist->recv_capacity = 0;
+
+  next_planet_id = dist->transport->rank;
+  planet_id_stride = rank_count;
+
+  if (dist->transport->rank != 0) {
+    /* Only rank 0 has a window, and it does all the reporting. */
+    rand_seed += dist->transport->rank;
+    stats_enabled = 0;
+    tracing = 0;
   }
-  png_free(png_ptr, row_pointers);
-  
- png_failure:
- png_create_info_struct_failed:
-  png_destroy_write_struct (&png_ptr, &info_ptr);
- png_create_write_struct_failed:
-  fclose (fp);
- fopen_failed:
-  return status;
-}
-
 
-void tick_planets(thread_arg_t *thread_arg) {
-  resolve_collisions(thread_arg->planets, thread_arg->tick);
-  calculate_forces(thread_arg);
-  move_planets(thread_arg->planets);
+  return 0;
 }
 
 
-void resolve_collisions(planet_list_t *planets, size_t tick) {
-  planet_list_t collision_lists[PLANET_COUNT_MAX];
-  planet_list_t new_planets;
-  size_t collision_count;
-  size_t i;
-  size_t col_it;
-
-  list_init(&new_planets);
-  memset(collision_lists, 0, sizeof(collision_lists));
+void stop_ranks(dist_t *dist) {
+  const int size = dist->transport->size;
+  int rank;
+  int status;
 
-  for (col_it = 0;  col_it < COLLISION_ITERATION_MAX;  ++col_it) {
-    collision_count = 0;
+  distributed_drop_ghosts(dist);
 
-    find_collision_groups(planets, &new_planets, collision_lists, &collision_count);
-    list_delete(&new_planets);
+  /* Closing our end tells any rank still waiting on us that it's over. */
+  dist->transport->close(dist->transport);
 
-    for (i = 0;  i < collision_count;  ++i) {
-      resolve_collision_group(planets, &collision_lists[i], &new_planets, tick);
-      list_delete(&collision_lists[i]);
+  for (rank = 1;  rank < size;  ++rank) {
+    if (waitpid(dist->children[rank], &status, 0) < 0) {
+      perror("waitpid");
+    } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "Rank %d failed.\n", rank);
     }
+  }
 
-    if (!new_planets.size) {
-      break;
-    }
+  for (rank = 0;  rank < size;  ++rank) {
+    free(dist->send_buffers[rank].data);
   }
+  free(dist->send_buffers);
+  free(dist->aggregates);
+  free(dist->recv_buffer);
+  free(dist->children);
 }
 
 
-void resolve_collision_group(planet_list_t *planets, planet_list_t *collision, planet_list_t *new_planets, size_t tick) {
-  /* We need to merge all the planets involved in the collision into a single planet
-     with the same mass and momentum as the entire group, located at the group's
-     center of mass. */
-  planet_node_t *node;
-  planet_t *planet;
-
-  double total_x_pos, total_y_pos;
-  double total_x_vel, total_y_vel;
-  double total_mass;
-
-  double hue;
-  size_t hue_tick;
-
-  double x_pos, y_pos;
-  double x_vel, y_vel;
-
-  double first_x, first_y;
+void distributed_tick(dist_t *dist, thread_arg_t *thread_arg) {
+  /* Every rank takes the same steps as tick_planets() on its own slab,
+     with an exchange before collisions and another before forces, since
+     collisions move mass between slabs. */
+  double start;
 
-  if (!collision->size) {
-    return;
-  }
+  start = phase_begin();
+  distributed_exchange(dist, thread_arg->planets, 0);
+  distributed_collisions(dist, thread_arg->planets, thread_arg->tick);
+  stats_add_collision_passes(1);
+  phase_end(PHASE_COLLISION, start);
 
-  total_x_pos = total_y_pos = 0.0;
-  total_x_vel = total_y_vel = 0.0;
-  total_mass = 0.0;
+  start = phase_begin();
+  distributed_exchange(dist, thread_arg->planets, 1);
+  distributed_forces(dist, thread_arg);
+  phase_end(PHASE_FORCE, start);
 
-  find_oldest_hue(collision, &hue, &hue_tick);
+  start = phase_begin();
+  move_planets(thread_arg->planets);
+  distributed_drop_ghosts(dist);
+  phase_end(PHASE_MOVE, start);
+}
 
-  first_x = collision->first->planet->x_pos;
-  first_y = collision->first->planet->y_pos;
 
-  for (node = collision->first;  node;  node = node->next) {
-    planet = node->planet;
+void distributed_exchange(dist_t *dist, planet_list_t *planets, int with_aggregates) {
+  /* Sends each rank the planets that have moved into its slab, copies of
+     the planets near its slab as ghosts, and optionally our aggregates,
+     and receives the same from it.  The rounds are arranged so that in
+     each one every rank sends to one rank and receives from another. */
+  const int rank = dist->transport->rank;
+  const int size = dist->transport->size;
+  const size_t cell_count = dist->columns * DIST_AGGREGATE_ROWS;
 
-    x_pos = planet->x_pos;
-    y_pos = planet->y_pos;
+  planet_list_t migrants;
+  planet_node_t *node;
+  planet_t *planet;
+  body_message_header_t header;
+  body_record_t record;
+  byte_buffer_t *buffer;
+  const body_record_t *records;
+  const double *cells;
+  size_t recv_len;
+  size_t i, j;
+  int peer;
+  int k;
+
+  distributed_drop_ghosts(dist);
+  list_init(&migrants);
+
+  if (with_aggregates) {
+    memset(dist->aggregates, 0, cell_count * 3 * sizeof(*dist->aggregates));
+    for (node = planets->first;  node;  node = node->next) {
+      planet = node->planet;
+      i = (planet_column(dist, planet) * DIST_AGGREGATE_ROWS + planet_row(planet)) * 3;
+      dist->aggregates[i] += planet->mass;
+      dist->aggregates[i + 1] += planet->mass * planet->x_pos;
+      dist->aggregates[i + 2] += planet->mass * planet->y_pos;
+    }
+  }
 
-    if (x_pos - first_x > 0.5 * WORLD_WIDTH) {
-      x_pos -= WORLD_WIDTH;
+  for (peer = 0;  peer < size;  ++peer) {
+    if (peer == rank) {
+      continue;
     }
-    if (first_x - x_pos > 0.5 * WORLD_WIDTH) {
-      x_pos += WORLD_WIDTH;
+    buffer = &dist->send_buffers[peer];
+    buffer->size = 0;
+
+    memset(&header, 0, sizeof(header));
+    buffer_append(buffer, &header, sizeof(header));
+
+    for (node = planets->first;  node;  node = node->next) {
+      if (planet_rank(dist, node->planet) == peer) {
+        planet_to_record(node->planet, &record);
+        buffer_append(buffer, &record, sizeof(record));
+        ++header.migrant_count;
+      }
     }
-    if (y_pos - first_y > 0.5 * WORLD_HEIGHT) {
-      y_pos -= WORLD_HEIGHT;
+    for (node = planets->first;  node;  node = node->next) {
+      if (planet_rank(dist, node->planet) != peer &&
+          column_near_rank(dist, planet_column(dist, node->planet), peer)) {
+        planet_to_record(node->planet, &record);
+        buffer_append(buffer, &record, sizeof(record));
+        ++header.ghost_count;
+      }
     }
-    if (first_y - y_pos > 0.5 * WORLD_HEIGHT) {
-      y_pos += WORLD_HEIGHT;
+    if (with_aggregates) {
+      buffer_append(buffer, dist->aggregates, cell_count * 3 * sizeof(*dist->aggregates));
+      header.aggregate_count = cell_count;
     }
 
-    total_x_pos += x_pos * planet->mass;
-    total_y_pos += y_pos * planet->mass;
-
-    total_x_vel += planet->x_vel * planet->mass;
-    total_y_vel += planet->y_vel * planet->mass;
-
-    total_mass += planet->mass;
+    memcpy(buffer->data, &header, sizeof(header));
+  }
 
-    if ((hue == -1.0) || (planet->hue_tick > hue_tick && rand_normal() < 0.35)) {
-      hue = planet->hue;
-      hue_tick = planet->hue_tick;
+  /* Planets leaving stay on as ghosts while they're near, since the
+     rank they went to will count them in collisions we also see. */
+  for (node = planets->first;  node;  node = node->next) {
+    if (planet_rank(dist, node->planet) != rank) {
+      list_add(&migrants, node->planet);
     }
   }
+  list_remove_all(planets, &migrants);
+  for (node = migrants.first;  node;  node = node->next) {
+    if (column_near_rank(dist, planet_column(dist, node->planet), rank)) {
+      node->planet->ghost = 1;
+      list_add(&dist->ghosts, node->planet);
+    } else {
+      free(node->planet);
+    }
+  }
+  list_delete(&migrants);
+
+  for (k = 1;  k < size;  ++k) {
+    peer = (rank + k) % size;
+    buffer = &dist->send_buffers[peer];
+    distributed_transfer(dist, peer, buffer->data, buffer->size, (rank - k + size) % size, &recv_len);
+
+    memcpy(&header, dist->recv_buffer, sizeof(header));
+    if (recv_len != sizeof(header) + (header.migrant_count + header.ghost_count) * sizeof(body_record_t) +
+                    header.aggregate_count * 3 * sizeof(double)) {
+      fprintf(stderr, "Rank %d got a garbled message.\n", rank);
+      exit(1);
+    }
 
-  x_pos = mod_double(total_x_pos / total_mass, 0, WORLD_WIDTH);
-  y_pos = mod_double(total_y_pos / total_mass, 0, WORLD_HEIGHT);
-
-  x_vel = total_x_vel / total_mass;
-  y_vel = total_y_vel / total_mass;
+    records = (const body_record_t *) ((const char *) dist->recv_buffer + sizeof(header));
+    for (i = 0;  i < header.migrant_count;  ++i) {
+      list_add(planets, planet_from_record(&records[i]));
+    }
+    for (;  i < header.migrant_count + header.ghost_count;  ++i) {
+      planet = planet_from_record(&records[i]);
+      planet->ghost = 1;
+      list_add(&dist->ghosts, planet);
+    }
 
-  planet = list_remove_first(collision);
+    cells = (const double *) &records[i];
+    for (j = 0;  j < header.aggregate_count * 3;  ++j) {
+      dist->aggregates[j] += cells[j];
+    }
+  }
+}
 
-  list_remove_all(planets, collision);
-  delete_planets(collision);
 
-  planet_init(planet, x_pos, y_pos, x_vel, y_vel, total_mass, hue, hue_tick);
+void distributed_drop_ghosts(dist_t *dist) {
+  /* A ghost that a collision turned into one of our own planets has
+     already been moved to the planet list, and is left alone. */
+  planet_node_t *node;
 
-  if (total_mass > MASS_MAX) {
-    /* It's too big!  We have to break it up. */
-    split_planet(planets, planet, new_planets, tick);
+  for (node = dist->ghosts.first;  node;  node = node->next) {
+    if (node->planet->ghost) {
+      free(node->planet);
+    }
   }
+  list_delete(&dist->ghosts);
 }
 
 
-void find_oldest_hue(const planet_list_t *planets, double *hue, size_t *hue_tick) {
-  const planet_node_t *node;
-  const planet_t *planet;
-
-  *hue_tick = (size_t) -1;
-
-  for (node = planets->first;  node;  node = node->next) {
-    planet = node->planet;
+void distributed_transfer(dist_t *dist, int to, const void *send_buf, size_t send_len, int from, size_t *recv_len) {
+  /* A rank can't carry on without the others, so losing one is fatal. */
+  transport_t *transport = dist->transport;
 
-    if (planet->hue_tick < *hue_tick) {
-      *hue = planet->hue;
-      *hue_tick = planet->hue_tick;
+  if (transport->exchange(transport, to, send_buf, send_len, from, &dist->recv_buffer, &dist->recv_capacity, recv_len) < 0) {
+    fprintf(stderr, "Rank %d lost contact with the other ranks.\n", transport->rank);
+    if (transport->rank != 0) {
+      _exit(1);
     }
+    exit(1);
   }
 }
 
 
-void split_planet(planet_list_t *planets, planet_t *planet, planet_list_t *new_planets, size_t tick) {
-  size_t child_count;
-  size_t i;
+int planet_rank(const dist_t *dist, const planet_t *planet) {
+  /* The rank whose slab the planet is in. */
+  return (int) (planet_column(dist, planet) / DIST_COLUMNS_PER_RANK);
+}
 
-  double angle_diff;
-  double angle;
-  double move_dir;
 
-  double distance;
+size_t planet_column(const dist_t *dist, const planet_t *planet) {
+  /* A planet just split off may not have been wrapped into the world yet,
+     so the position is wrapped before it's made unsigned. */
+  double fraction;
+  size_t column;
 
-  double radius;
+  fraction = planet->x_pos / WORLD_WIDTH;
+  fraction -= floor(fraction);
+  column = (size_t) (fraction * dist->columns);
 
-  double x_pos, y_pos;
-  double x_vel, y_vel;
+  return column < dist->columns ? column : dist->columns - 1;
+}
 
-  double child_x_pos, child_y_pos;
-  double child_x_vel, child_y_vel;
-  double child_mass;
-  double child_hue;
-  size_t child_hue_tick;
 
-  double this_child_hue;
-  size_t this_child_hue_tick;
+size_t planet_row(const planet_t *planet) {
+  /* The aggregate grid's row, wrapped the same way. */
+  double fraction;
+  size_t row;
 
-  double speed;
+  fraction = planet->y_pos / WORLD_HEIGHT;
+  fraction -= floor(fraction);
+  row = (size_t) (fraction * DIST_AGGREGATE_ROWS);
 
-  double energy;
+  return row < DIST_AGGREGATE_ROWS ? row : DIST_AGGREGATE_ROWS - 1;
+}
 
-  child_count = SPLIT_COUNT_MIN + (size_t) ((SPLIT_COUNT_MAX - SPLIT_COUNT_MIN + 1) * rand_normal());
-  child_mass = planet->mass / child_count;
-  child_hue = planet->hue;
-  child_hue_tick = planet->hue_tick;
 
-  angle_diff = 2 * M_PI / child_count;
-  angle = 2 * M_PI * rand_normal();
+int column_near_rank(const dist_t *dist, size_t column, int rank) {
+  /* Whether the column is in the rank's slab or within near_columns of it,
+     going either way around the world. */
+  size_t offset;
+  size_t after, before;
 
-  radius = radius_for_mass(child_mass);
+  offset = (column + dist->columns - (size_t) rank * DIST_COLUMNS_PER_RANK) % dist->columns;
+  if (offset < DIST_COLUMNS_PER_RANK) {
+    return 1;
+  }
 
-  distance = sqrt((radius + 5.0) / (1 - cos(angle_diff)));
+  after = offset - (DIST_COLUMNS_PER_RANK - 1);
+  before = dist->columns - offset;
 
-  x_pos = planet->x_pos;
-  y_pos = planet->y_pos;
-  x_vel = planet->x_vel;
-  y_vel = planet->y_vel;
+  return after <= dist->near_columns || before <= dist->near_columns;
+}
 
-  energy = calculate_split_energy(child_mass, child_count, distance, SPLIT_DISTANCE);
 
-  /*
-   * e = 1/2 m * v^2
-   * 2e = m * v^2
-   * v^2 = 2e / m
-   * v = sqrt(2e / m)
-   */
-  speed = sqrt(2 * energy / child_mass);
+void distributed_collisions(dist_t *dist, planet_list_t *planets, size_t tick) {
+  /* Every rank that can see a collision group sees it identically, since the
+     ghosts are exact copies, and so every one agrees on which rank owns the
+     merged planet:  the one whose slab the group's center of mass is in.
+     That rank merges the group, and the others just forget their part of
+     it.  This assumes no group reaches further than the near width, which
+     would take a chain of touching planets a good fraction of the world
+     long.  Only one pass is made, so a planet split out of a collision
+     may overlap another one until the next tick. */
+  planet_list_t *collision_lists;
+  planet_list_t everything;
+  planet_list_t new_planets;
+  planet_list_t dead;
+  planet_node_t *node;
+  planet_t *merged;
+  size_t collision_count;
+  size_t i;
 
-  move_dir = 0.0175 * (2.0 * M_PI);
+  list_init(&everything);
+  list_init(&new_planets);
+  list_init(&dead);
 
-  for (i = 0;  i < child_count;  ++i, angle += angle_diff) {
-    child_x_pos = x_pos + distance * cos(angle);
-    child_y_pos = y_pos + distance * sin(angle);
+  for (node = planets->first;  node;  node = node->next) {
+    list_add(&everything, node->planet);
+  }
+  for (node = dist->ghosts.first;  node;  node = node->next) {
+    list_add(&everything, node->planet);
+  }
 
-    child_x_vel = x_vel + speed * cos(angle + move_dir);
-    child_y_vel = y_vel + speed * sin(angle + move_dir);
+  collision_lists = calloc(everything.size ? everything.size : 1, sizeof(*collision_lists));
+  if (!collision_lists) {
+    perror("calloc()");
+    exit(1);
+  }
 
-    this_child_hue = child_hue;
-    this_child_hue_tick = child_hue_tick;
+  collision_count = 0;
+  find_collision_groups(&everything, NULL, &new_planets, collision_lists, &collision_count);
+  list_delete(&everything);
 
-    if (rand_normal() < 0.0005) {
-      this_child_hue = 360.0 * rand_normal();
-      this_child_hue_tick = tick;
+  for (i = 0;  i < collision_count;  ++i) {
+    if (!collision_lists[i].first) {
+      /* It was merged into another group. */
+      continue;
     }
-
-    if (!i) {
-      planet_init(planet, child_x_pos, child_y_pos, child_x_vel, child_y_vel, child_mass, this_child_hue, this_child_hue_tick);
-    } else {
-      planet = planet_new(child_x_pos, child_y_pos, child_x_vel, child_y_vel, child_mass, this_child_hue, this_child_hue_tick);
-      list_add(planets, planet);
+    /* In id order, so every rank merges it the same way. */
+    sort_planet_list(&collision_lists[i], compare_planet_ids);
+
+    /* The merged planet comes off the group; whatever is left on it is
+       gone from this rank, and is only marked for now, so the planet list
+       is gone through once for all the groups rather than once for each. */
+    merged = NULL;
+    if (group_owner(dist, &collision_lists[i]) == dist->transport->rank) {
+      merged = merge_collision_group(&collision_lists[i]);
+    }
+    for (node = collision_lists[i].first;  node;  node = node->next) {
+      ++node->planet->generation;
+      if (node->planet->ghost) {
+        node->planet->collision_list = COLLISION_LIST_NONE;
+      } else {
+        node->planet->collision_list = COLLISION_LIST_DEAD;
+        list_add(&dead, node->planet);
+      }
+    }
+    if (merged && merged->mass > MASS_MAX) {
+      split_planet(planets, merged, &new_planets, tick, NULL);
+    }
+    if (merged && merged->ghost) {
+      merged->ghost = 0;
+      list_add(planets, merged);
     }
+    list_delete(&collision_lists[i]);
+  }
 
-    list_add(new_planets, planet);
+  free(collision_lists);
+  list_remove_dead(planets);
 
-    if (planet->mass > MASS_MAX) {
-      /* It's too big!  We have to break it up. */
-      split_planet(planets, planet, new_planets, tick);
+  /* Retired ghosts are still on the ghost list, which frees them. */
+  for (node = dead.first;  node;  node = node->next) {
+    if (!node->planet->ghost) {
+      free(node->planet);
     }
   }
+  list_delete(&dead);
+  list_delete(&new_planets);
 }
 
 
-double calculate_split_energy(double mass, size_t count, double r1, double r2) {
-  double constant;
-  double sum;
-  double alpha;
-  double alpha_diff;
-  size_t i;
+void sort_planet_list(planet_list_t *list, int (*compare)(const void *, const void *)) {
+  planet_t **members;
+  planet_node_t *node;
+  size_t count;
 
-  constant = 0.5 * G * mass * mass * (1/r1 - 1/r2);
+  if (!list->size) {
+    return;
+  }
 
-  sum = 0.0;
+  members = my_malloc(list->size * sizeof(*members));
+  count = 0;
+  for (node = list->first;  node;  node = node->next) {
+    members[count++] = node->planet;
+  }
 
-  alpha_diff = 2 * M_PI / count;
+  qsort(members, count, sizeof(*members), compare);
 
-  for (i = 1;  i < count;  ++i) {
-    alpha = i * alpha_diff;
-    sum += sin(0.5 * alpha) / (1 - cos(alpha));
+  list_delete(list);
+  while (count) {
+    list_add(list, members[--count]);
   }
 
-  return constant * sum;
+  free(members);
 }
 
 
-void delete_planets(planet_list_t *planets) {
-  planet_node_t *node;
+int compare_planet_ids(const void *a, const void *b) {
+  const planet_t *p1 = *(planet_t * const *) a;
+  const planet_t *p2 = *(planet_t * const *) b;
 
-  for (node = planets->first;  node;  node = node->next) {
-    free(node->planet);
-  }
+  return p1->id < p2->id ? -1 : p1->id > p2->id;
 }
 
 
-void find_collision_groups(planet_list_t *planets, planet_list_t *new_planets, planet_list_t *collision_lists, size_t *collision_count) {
-  planet_node_t *node_a;
-  planet_node_t *node_b;
+int compare_planet_positions(const void *a, const void *b) {
+  const planet_t *p1 = *(planet_t * const *) a;
+  const planet_t *p2 = *(planet_t * const *) b;
 
-  planet_t *planet_a;
-  planet_t *planet_b;
+  if (p1->x_pos != p2->x_pos) {
+    return p1->x_pos < p2->x_pos ? -1 : 1;
+  }
+  return p1->y_pos < p2->y_pos ? -1 : p1->y_pos > p2->y_pos;
+}
 
-  for (node_a = new_planets->size ? new_planets->first : planets->first;  node_a;  node_a = node_a->next) {
-    planet_a = node_a->planet;
-    for (node_b = new_planets->size ? planets->first : node_a->next;  node_b;  node_b = node_b->next) {
-      planet_b = node_b->planet;
 
-      if (planet_a == planet_b) {
-        continue;
-      }
+int group_owner(const dist_t *dist, const planet_list_t *group) {
+  /* Works out the center of mass just as resolve_collision_group() does. */
+  const planet_node_t *node;
+  planet_t center;
+  double first_x;
+  double x_pos;
+  double total_x_pos;
+  double total_mass;
 
-      if (planet_a->collision_list == PLANET_COUNT_MAX ||
-          planet_a->collision_list != planet_b->collision_list) {
-        resolve_collision_pair(planet_a, planet_b, collision_lists, collision_count);
-      }
+  first_x = group->first->planet->x_pos;
+  total_x_pos = total_mass = 0.0;
+
+  for (node = group->first;  node;  node = node->next) {
+    x_pos = node->planet->x_pos;
+    if (x_pos - first_x > 0.5 * WORLD_WIDTH) {
+      x_pos -= WORLD_WIDTH;
     }
+    if (first_x - x_pos > 0.5 * WORLD_WIDTH) {
+      x_pos += WORLD_WIDTH;
+    }
+
+    total_x_pos += x_pos * node->planet->mass;
+    total_mass += node->planet->mass;
   }
+
+  center.x_pos = mod_double(total_x_pos / total_mass, 0, WORLD_WIDTH);
+
+  return planet_rank(dist, &center);
 }
 
 
-void resolve_collision_pair(planet_t *p1, planet_t *p2, planet_list_t *collision_lists, size_t *collision_count) {
-  double p2_x;
-  double p2_y;
+void distributed_forces(dist_t *dist, thread_arg_t *thread_arg) {
+  planet_list_t *planets = thread_arg->planets;
+  planet_node_t *tail;
 
-  double x_diff, y_diff;
-  double distance_squared;
+  if (!planets->size) {
+    return;
+  }
 
-  position_mod(p1, p2, &p2_x, &p2_y);
+  /* The ghosts are hung off the end of the list, so the pair loop of every
+     one of our planets takes them in, but they're never handed out. */
+  for (tail = planets->first;  tail->next;  tail = tail->next);
+  tail->next = dist->ghosts.first;
+  thread_arg->planet_node_end = dist->ghosts.first;
 
-  x_diff = p2_x - p1->x_pos;
-  y_diff = p2_y - p1->y_pos;
+  calculate_forces(thread_arg);
 
-  distance_squared = x_diff * x_diff + y_diff * y_diff;
+  tail->next = NULL;
+  thread_arg->planet_node_end = NULL;
 
-  if (distance_squared < p1->radius_squared + p2->radius_squared) {
-    /* Collision! */
-    /* We've got to figure out which collision list to put it on. */
-    if (p1->collision_list == PLANET_COUNT_MAX) {
-      if (p2->collision_list == PLANET_COUNT_MAX) {
-        /* It's a new collision group. */
-        list_add(&collision_lists[*collision_count], p1);
-        list_add(&collision_lists[*collision_count], p2);
-        p1->collision_list = *collision_count;
-        p2->collision_list = *collision_count;
-        ++*collision_count;
-      } else {
-        /* p2 is already involved in a collision, while p1 is not,
-           so we just add p1 to p2's collision list. */
-        list_add(&collision_lists[p2->collision_list], p1);
-        p1->collision_list = p2->collision_list;
+  aggregate_forces(dist, planets);
+}
+
+
+void aggregate_forces(dist_t *dist, planet_list_t *planets) {
+  /* Adds the pull of every cell too far away to have sent us ghosts, as if
+     the cell's mass were all at its center of mass. */
+  const int rank = dist->transport->rank;
+  planet_node_t *node;
+  planet_t cell;
+  size_t column, row;
+  size_t i;
+
+  memset(&cell, 0, sizeof(cell));
+
+  for (column = 0;  column < dist->columns;  ++column) {
+    if (column_near_rank(dist, column, rank)) {
+      continue;
+    }
+    for (row = 0;  row < DIST_AGGREGATE_ROWS;  ++row) {
+      i = (column * DIST_AGGREGATE_ROWS + row) * 3;
+      if (dist->aggregates[i] <= 0.0) {
+        continue;
       }
-    } else {
-      if (p2->collision_list == PLANET_COUNT_MAX) {
-        /* p1 is already involved in a collision, while p2 is not,
-           so we just add p2 to p1's collision list. */
-        list_add(&collision_lists[p1->collision_list], p2);
-        p2->collision_list = p1->collision_list;
-      } else {
-        /* Both planets are already involed in two different collision lists.
-           We have to merge the two lists into one. */
-        merge_collision_lists(collision_lists, p1->collision_list, p2->collision_list);
+
+      cell.mass = dist->aggregates[i];
+      cell.x_pos = dist->aggregates[i + 1] / cell.mass;
+      cell.y_pos = dist->aggregates[i + 2] / cell.mass;
+
+      for (node = planets->first;  node;  node = node->next) {
+        calculate_force_pair(node->planet, &cell, HUGE_VAL, NULL, NULL, 0);
       }
     }
   }
 }
 
 
-void merge_collision_lists(planet_list_t *collision_lists, size_t list_a, size_t list_b) {
+int distributed_gather(dist_t *dist, planet_list_t *planets, planet_list_t *all) {
+  /* Collects every rank's planets on rank 0, as copies on all, for display.
+     The other ranks pass NULL for all, and get -1 if rank 0 is gone. */
+  transport_t *transport = dist->transport;
+  byte_buffer_t *buffer;
   planet_node_t *node;
-  planet_node_t *b_last;
-
-  b_last = NULL;
-
-  for (node = collision_lists[list_b].first;  node;  b_last = node, node = node->next) {
-    node->planet->collision_list = list_a;
+  body_record_t record;
+  const body_record_t *records;
+  size_t recv_len;
+  size_t i;
+  int rank;
+
+  if (transport->rank != 0) {
+    buffer = &dist->send_buffers[0];
+    buffer->size = 0;
+    for (node = planets->first;  node;  node = node->next) {
+      planet_to_record(node->planet, &record);
+      buffer_append(buffer, &record, sizeof(record));
+    }
+    return transport->exchange(transport, 0, buffer->data, buffer->size, -1, NULL, NULL, NULL);
   }
 
-  b_last->next = collision_lists[list_a].first;
-  collision_lists[list_a].first = collision_lists[list_b].first;
-
-  list_init(&collision_lists[list_b]);
-}
+  list_copy(all, planets);
 
+  for (rank = 1;  rank < transport->size;  ++rank) {
+    distributed_transfer(dist, -1, NULL, 0, rank, &recv_len);
+    records = dist->recv_buffer;
+    for (i = 0;  i < recv_len / sizeof(*records);  ++i) {
+      list_add(all, planet_from_record(&records[i]));
+    }
+  }
 
-void calculate_forces(thread_arg_t *thread_arg) {
-  thread_arg->working_planet_count = thread_arg->planets->size;
-  thread_arg_reset_planet_node(thread_arg);
-  thread_arg_wait_till_zero_working(thread_arg);
+  return 0;
 }
 
 
-void calculate_planet_forces(planet_node_t *node) {
-  planet_node_t *node_b;
-  planet_t *planet_a;
-
-  planet_a = node->planet;
+void distributed_send_continue(dist_t *dist, int keep_going) {
+  char message = keep_going;
+  int rank;
 
-  for (node_b = node->next;  node_b;  node_b = node_b->next) {
-    calculate_force_pair(planet_a, node_b->planet);
+  for (rank = 1;  rank < dist->transport->size;  ++rank) {
+    distributed_transfer(dist, rank, &message, sizeof(message), -1, NULL);
   }
 }
 
 
-void calculate_force_pair(planet_t *p1, planet_t *p2) {
-  double p2_x, p2_y;
-  double distance_squared;
-  double x_diff, y_diff;
-  double distance;
-  double force_magnitude;
-  double force_ratio;
-  double x_force, y_force;
+int distributed_recv_continue(dist_t *dist) {
+  size_t recv_len;
 
-  position_mod(p1, p2, &p2_x, &p2_y);
+  if (dist->transport->exchange(dist->transport, -1, NULL, 0, 0, &dist->recv_buffer, &dist->recv_capacity, &recv_len) < 0) {
+    return 0;
+  }
+
+  return recv_len == 1 && *(char *) dist->recv_buffer;
+}
 
-  x_diff = p2_x - p1->x_pos;
-  y_diff = p2_y - p1->y_pos;
 
-  distance_squared = x_diff * x_diff + y_diff * y_diff;
-  distance = sqrt(distance_squared);
+void planet_to_record(const planet_t *planet, body_record_t *record) {
+  record->id = planet->id;
+  record->x_pos = planet->x_pos;
+  record->y_pos = planet->y_pos;
+  record->x_vel = planet->x_vel;
+  record->y_vel = planet->y_vel;
+  record->mass = planet->mass;
+  record->hue = planet->hue;
+  record->hue_tick = planet->hue_tick;
+}
 
-  if (distance < p1->radius + p2->radius) {
-    return;
-  }
 
-  force_magnitude = G * p1->mass * p2->mass / distance_squared;
+planet_t *planet_from_record(const body_record_t *record) {
+  planet_t *planet;
 
-  force_ratio = force_magnitude / distance;
+  planet = my_malloc(sizeof(*planet));
+  planet->generation = 0;
+  planet_init(planet, record->x_pos, record->y_pos, record->x_vel, record->y_vel, record->mass, record->hue, record->hue_tick);
 
-  x_force = force_ratio * x_diff;
-  y_force = force_ratio * y_diff;
+  planet->id = record->id;
+  planet->ghost = 0;
 
-  planet_add_force(p1, x_force, y_force);
-  planet_add_force(p2, -x_force, -y_force);
+  return planet;
 }
 
 
-void position_mod(planet_t *p1, planet_t *p2, double *p2_x, double *p2_y) {
-  *p2_x = p2->x_pos;
-  *p2_y = p2->y_pos;
+void buffer_append(byte_buffer_t *buffer, const void *data, size_t size) {
+  if (buffer->size + size > buffer->capacity) {
+    buffer->capacity = 2 * (buffer->size + size);
+    buffer->data = my_realloc(buffer->data, buffer->capacity);
+  }
+
+  memcpy(buffer->data + buffer->size, data, size);
+  buffer->size += size;
+}
+
 
-  if (*p2_x - p1->x_pos > 0.5 * WORLD_WIDTH) {
-    *p2_x -= WORLD_WIDTH;
+transport_t *socket_transport_create(int size, pid_t *children) {
+  /* Connects every pair of ranks with a Unix socket pair, then forks the
+     ranks.  Each one keeps only its own ends, in data, indexed by peer. */
+  int pairs[RANK_COUNT_MAX][RANK_COUNT_MAX][2];
+  transport_t *transport;
+  int *fds;
+  int rank;
+  pid_t pid;
+  int i, j;
+
+  for (i = 0;  i < size;  ++i) {
+    for (j = i + 1;  j < size;  ++j) {
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i][j]) < 0) {
+        perror("socketpair");
+        return NULL;
+      }
+    }
   }
-  if (p1->x_pos - *p2_x > 0.5 * WORLD_WIDTH) {
-    *p2_x += WORLD_WIDTH;
+
+  /* Whatever's buffered would otherwise be written again by each child. */
+  fflush(stdout);
+  fflush(stderr);
+
+  memset(children, 0, size * sizeof(*children));
+  rank = 0;
+  for (i = 1;  i < size;  ++i) {
+    pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      return NULL;
+    }
+    if (pid == 0) {
+      /* Don't outlive rank 0, however it goes. */
+      prctl(PR_SET_PDEATHSIG, SIGTERM);
+      if (getppid() == 1) {
+        _exit(1);
+      }
+      rank = i;
+      break;
+    }
+    children[i] = pid;
   }
-  if (*p2_y - p1->y_pos > 0.5 * WORLD_HEIGHT) {
-    *p2_y -= WORLD_HEIGHT;
+
+  transport = my_malloc(sizeof(*transport));
+  fds = my_malloc(size * sizeof(*fds));
+
+  for (i = 0;  i < size;  ++i) {
+    fds[i] = -1;
   }
-  if (p1->y_pos - *p2_y > 0.5 * WORLD_HEIGHT) {
-    *p2_y += WORLD_HEIGHT;
+  for (i = 0;  i < size;  ++i) {
+    for (j = i + 1;  j < size;  ++j) {
+      if (i == rank) {
+        fds[j] = pairs[i][j][0];
+        close(pairs[i][j][1]);
+      } else if (j == rank) {
+        fds[i] = pairs[i][j][1];
+        close(pairs[i][j][0]);
+      } else {
+        close(pairs[i][j][0]);
+        close(pairs[i][j][1]);
+      }
+    }
   }
-}
-
 
-void move_planets(planet_list_t *planets) {
-  planet_node_t *node;
-  planet_t *planet;
-  double x_accel, y_accel;
+  transport->rank = rank;
+  transport->size = size;
+  transport->exchange = socket_transport_exchange;
+  transport->close = socket_transport_close;
+  transport->data = fds;
 
-  for (node = planets->first;  node;  node = node->next) {
-    planet = node->planet;
-    x_accel = planet->x_force / planet->mass / (FRAMES_PER_SECOND * TICKS_PER_FRAME);
-    y_accel = planet->y_force / planet->mass / (FRAMES_PER_SECOND * TICKS_PER_FRAME);
+  return transport;
+}
 
-    planet->x_vel += x_accel;
-    planet->y_vel += y_accel;
 
-    planet->x_pos += planet->x_vel / (FRAMES_PER_SECOND * TICKS_PER_FRAME);
-    planet->y_pos += planet->y_vel / (FRAMES_PER_SECOND * TICKS_PER_FRAME);
+int socket_transport_exchange(transport_t *transport, int to, const void *send_buf, size_t send_len,
+                              int from, void **recv_buf, size_t *recv_capacity, size_t *recv_len) {
+  /* Each message goes as a 64-bit length followed by that many bytes.  The
+     sockets are only written and read as far as poll() says they're ready,
+     so a big message in each direction can't wedge both ends. */
+  const int *fds = transport->data;
+  struct pollfd polls[2];
+  uint64_t send_header;
+  uint64_t recv_header;
+  size_t sent, received;
+  size_t send_total, recv_total;
+  ssize_t count;
+  nfds_t poll_count;
+  nfds_t i;
+
+  send_header = send_len;
+  send_total = to >= 0 ? sizeof(send_header) + send_len : 0;
+  recv_total = from >= 0 ? sizeof(recv_header) : 0;
+  sent = received = 0;
+
+  while (sent < send_total || received < recv_total) {
+    poll_count = 0;
+    if (sent < send_total) {
+      polls[poll_count].fd = fds[to];
+      polls[poll_count].events = POLLOUT;
+      ++poll_count;
+    }
+    if (received < recv_total) {
+      polls[poll_count].fd = fds[from];
+      polls[poll_count].events = POLLIN;
+      ++poll_count;
+    }
 
-    planet->x_pos = mod_double(planet->x_pos, 0.0, WORLD_WIDTH);
-    planet->y_pos = mod_double(planet->y_pos, 0.0, WORLD_HEIGHT);
+    if (poll(polls, poll_count, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      return -1;
+    }
 
-    planet->x_force = 0.0;
-    planet->y_force = 0.0;
-  }
-}
+    for (i = 0;  i < poll_count;  ++i) {
+      if (!polls[i].revents) {
+        continue;
+      }
 
+      if (polls[i].events == POLLOUT) {
+        if (sent < sizeof(send_header)) {
+          count = send(polls[i].fd, (char *) &send_header + sent, sizeof(send_header) - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        } else {
+          count = send(polls[i].fd, (const char *) send_buf + sent - sizeof(send_header), send_total - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+        if (count < 0) {
+          if (errno == EAGAIN || errno == EINTR) {
+            continue;
+          }
+          perror("send");
+          return -1;
+        }
+        sent += count;
+        continue;
+      }
 
-double mod_double(double value, double min, double max) {
-  const double diff = max - min;
+      if (received < sizeof(recv_header)) {
+        count = recv(polls[i].fd, (char *) &recv_header + received, sizeof(recv_header) - received, MSG_DONTWAIT);
+      } else {
+        count = recv(polls[i].fd, (char *) *recv_buf + received - sizeof(recv_header), recv_total - received, MSG_DONTWAIT);
+      }
+      if (count < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+          continue;
+        }
+        perror("recv");
+        return -1;
+      }
+      if (count == 0) {
+        return -1;
+      }
+      received += count;
 
-  while (value < min) {
-    value += diff;
+      if (received == sizeof(recv_header)) {
+        recv_total = sizeof(recv_header) + recv_header;
+        if (recv_header > *recv_capacity) {
+          *recv_capacity = recv_header;
+          *recv_buf = my_realloc(*recv_buf, *recv_capacity);
+        }
+      }
+    }
   }
-  while (value >= max) {
-    value -= diff;
+
+  if (from >= 0) {
+    *recv_len = recv_header;
   }
 
-  return value;
+  return 0;
 }
 
 
-void wait_for_next_tick(struct timeval *start) {
-  struct timeval now;
-  struct timeval diff;
-  struct timeval interval;
-  struct timeval interval_remaining;
-
-  interval.tv_sec = 0;
-  interval.tv_usec = 1000000.0 / FRAMES_PER_SECOND;
-
-  gettimeofday(&now, NULL);
+void socket_transport_close(transport_t *transport) {
+  int *fds = transport->data;
+  int i;
 
-  timersub(&now, start, &diff);
-  timersub(&interval, &diff, &interval_remaining);
+  for (i = 0;  i < transport->size;  ++i) {
+    if (fds[i] >= 0) {
+      close(fds[i]);
+    }
+  }
 
-  select(0, NULL, NULL, NULL, &interval_remaining);
+  free(fds);
+  free(transport);
 }
 
 
@@ -1363,8 +9004,13 @@ planet_t *planet_new(double x_pos, double y_pos, double x_vel, double y_vel, dou
   planet_t *planet;
 
   planet = my_malloc(sizeof(*planet));
+  planet->generation = 0;
   planet_init(planet, x_pos, y_pos, x_vel, y_vel, mass, hue, tick);
 
+  planet->id = next_planet_id;
+  next_planet_id += planet_id_stride;
+  planet->ghost = 0;
+
   return planet;
 }
 
@@ -1385,7 +9031,9 @@ void planet_init(planet_t *planet, double x_pos, double y_pos, double x_vel, dou
   planet->hue = hue;
   planet->hue_tick = tick;
 
-  planet->collision_list = PLANET_COUNT_MAX;
+  planet->collision_list = COLLISION_LIST_NONE;
+
+  ++planet->generation;
 }
 
 
@@ -1403,7 +9051,184 @@ double radius_for_mass(double mass) {
   /* Volume of a sphere is 4/3 * PI * r^3
      r^3 = 3/4 * V/PI
   */
-  return pow(0.75 * M_1_PI * volume, 1.0/3.0);
+  return fast_cbrt(0.75 * M_1_PI * volume);
+}
+
+
+double fast_cbrt(double value) {
+  /* Dividing the exponent by three gets within a few percent of the cube
+     root, and four Newton steps take that to full double precision; three
+     would leave it a part in 10^12 off.  Only meant for positive, finite
+     values. */
+  union {
+    double d;
+    uint64_t u;
+  } bits;
+  double root;
+
+  bits.d = value;
+  bits.u = bits.u / 3 + UINT64_C(0x2a9f7893782da1ce);
+  root = bits.d;
+
+  root -= (root - value / (root * root)) * (1.0 / 3.0);
+  root -= (root - value / (root * root)) * (1.0 / 3.0);
+  root -= (root - value / (root * root)) * (1.0 / 3.0);
+  root -= (root - value / (root * root)) * (1.0 / 3.0);
+
+  return root;
+}
+
+
+void hue_to_rgb(double hue, double *r, double *g, double *b) {
+  size_t step;
+
+  while (hue < 0.0) {
+    hue += 360.0;
+  }
+  while (hue >= 360.0) {
+    hue -= 360.0;
+  }
+
+  step = (size_t) (hue / 60.0);
+
+  *r = *g = *b = 0.0;
+
+  switch (step) {
+    case 0:  /* 0 - 60 */
+      *r = 1.0;
+      *g = hue / 60.0;
+      break;
+    case 1: /* 60 - 120 */
+      *r = (120.0 - hue) / 60.0;
+      *g = 1.0;
+      break;
+    case 2: /* 120 - 180 */
+      *g = 1.0;
+      *b = (hue - 120.0) / 60.0;
+      break;
+    case 3: /* 180 - 240 */
+      *g = (240.0 - hue) / 60.0;
+      *b = 1.0;
+      break;
+    case 4: /* 240 - 300 */
+      *r = (hue - 240.0) / 60.0;
+      *b = 1.0;
+      break;
+    case 5:  /* 300 - 360 */
+      *r = 1.0;
+      *b = (360.0 - hue) / 60.0;
+      break;
+  }
+}
+
+
+void init_tables(void) {
+  double r, g, b;
+  size_t count;
+  size_t i;
+  int lod;
+
+  for (count = SPLIT_COUNT_MIN;  count <= SPLIT_COUNT_MAX;  ++count) {
+    split_energy_sums[count] = split_energy_sum(count);
+    for (i = 0;  i < count;  ++i) {
+      split_cos[count][i] = cos(2 * M_PI * i / count);
+      split_sin[count][i] = sin(2 * M_PI * i / count);
+    }
+  }
+
+  for (i = 0;  i < SPLIT_ANGLE_STEPS;  ++i) {
+    split_angle_cos[i] = cos(2 * M_PI * i / SPLIT_ANGLE_STEPS);
+    split_angle_sin[i] = sin(2 * M_PI * i / SPLIT_ANGLE_STEPS);
+  }
+
+  split_move_cos = cos(SPLIT_MOVE_ANGLE);
+  split_move_sin = sin(SPLIT_MOVE_ANGLE);
+
+  for (lod = 0;  lod < CIRCLE_LOD_COUNT;  ++lod) {
+    for (i = 0;  i < (CIRCLE_POLY_COUNT << lod);  ++i) {
+      circle_cos[lod][i] = (float) cos(2 * M_PI * i / (CIRCLE_POLY_COUNT << lod));
+      circle_sin[lod][i] = (float) sin(2 * M_PI * i / (CIRCLE_POLY_COUNT << lod));
+    }
+  }
+
+  for (i = 0;  i < HUE_TABLE_SIZE;  ++i) {
+    hue_to_rgb(360.0 * i / HUE_TABLE_SIZE, &r, &g, &b);
+    hue_rgb[i][0] = (float) r;
+    hue_rgb[i][1] = (float) g;
+    hue_rgb[i][2] = (float) b;
+  }
+}
+
+
+int check_tables(void) {
+  /* Compares what the tables and fast_cbrt() give against libm, so a bad
+     table fails loudly at startup instead of quietly changing the physics.
+     The circle tables are floats, so they only have to be as close as a
+     float can get. */
+  const double tolerance = 1e-12;
+  const double cbrt_tolerance = 1e-14;
+  const double circle_tolerance = FLT_EPSILON;
+  double mass;
+  double expected, actual;
+  double angle;
+  size_t count;
+  size_t step;
+  size_t i;
+  int lod;
+
+  for (mass = 0.5 * MASS_MIN;  mass <= 2.0 * TOTAL_MASS;  mass *= 1.01) {
+    expected = pow(0.75 * M_1_PI * mass / PLANET_DENSITY, 1.0/3.0);
+    actual = radius_for_mass(mass);
+    if (fabs(actual - expected) > cbrt_tolerance * expected) {
+      fprintf(stderr, "radius_for_mass(%g) is %.17g, but should be %.17g.\n", mass, actual, expected);
+      return -1;
+    }
+  }
+
+  for (count = SPLIT_COUNT_MIN;  count <= SPLIT_COUNT_MAX;  ++count) {
+    for (step = 0;  step < SPLIT_ANGLE_STEPS;  step += 37) {
+      for (i = 0;  i < count;  ++i) {
+        angle = 2 * M_PI * step / SPLIT_ANGLE_STEPS + 2 * M_PI * i / count;
+        actual = split_angle_cos[step] * split_cos[count][i] - split_angle_sin[step] * split_sin[count][i];
+        if (fabs(actual - cos(angle)) > tolerance) {
+          fprintf(stderr, "Split direction %lu of %lu at step %lu is off by %g.\n", i, count, step, fabs(actual - cos(angle)));
+          return -1;
+        }
+        actual = split_angle_sin[step] * split_cos[count][i] + split_angle_cos[step] * split_sin[count][i];
+        if (fabs(actual - sin(angle)) > tolerance) {
+          fprintf(stderr, "Split direction %lu of %lu at step %lu is off by %g.\n", i, count, step, fabs(actual - sin(angle)));
+          return -1;
+        }
+      }
+    }
+  }
+
+  /* sin(a/2) / (1 - cos(a)) is 1 / (2 sin(a/2)), so the sums can be
+     checked against a different formula than the one that made them. */
+  for (count = SPLIT_COUNT_MIN;  count <= SPLIT_COUNT_MAX;  ++count) {
+    expected = 0.0;
+    for (i = 1;  i < count;  ++i) {
+      expected += 0.5 / sin(M_PI * i / count);
+    }
+    if (fabs(split_energy_sums[count] - expected) > tolerance * expected) {
+      fprintf(stderr, "The split energy sum for %lu is %.17g, but should be %.17g.\n", count, split_energy_sums[count], expected);
+      return -1;
+    }
+  }
+
+  for (lod = 0;  lod < CIRCLE_LOD_COUNT;  ++lod) {
+    for (i = 0;  i < (CIRCLE_POLY_COUNT << lod);  ++i) {
+      angle = 2 * M_PI * i / (CIRCLE_POLY_COUNT << lod);
+      if (fabs(circle_cos[lod][i] - cos(angle)) > circle_tolerance ||
+          fabs(circle_sin[lod][i] - sin(angle)) > circle_tolerance) {
+        fprintf(stderr, "Circle vertex %lu of %d is off by %g.\n", i, CIRCLE_POLY_COUNT << lod,
+                fmax(fabs(circle_cos[lod][i] - cos(angle)), fabs(circle_sin[lod][i] - sin(angle))));
+        return -1;
+      }
+    }
+  }
+
+  return 0;
 }
 
 
@@ -1465,6 +9290,31 @@ void list_remove_all(planet_list_t *list, planet_list_t *removing) {
 }
 
 
+void list_remove_dead(planet_list_t *list) {
+  /* Takes the planets marked COLLISION_LIST_DEAD off the list, without
+     freeing them. */
+  planet_node_t *node;
+  planet_node_t *prev;
+  planet_node_t *next;
+
+  prev = NULL;
+  for (node = list->first;  node;  node = next) {
+    next = node->next;
+    if (node->planet->collision_list == COLLISION_LIST_DEAD) {
+      if (prev) {
+        prev->next = next;
+      } else {
+        list->first = next;
+      }
+      free(node);
+      --list->size;
+    } else {
+      prev = node;
+    }
+  }
+}
+
+
 int list_contains(planet_list_t *list, planet_t *planet) {
   planet_node_t *node;
 
@@ -1495,9 +9345,71 @@ void list_delete(planet_list_t *list) {
 }
 
 
+void list_move_all(planet_list_t *dest, planet_list_t *src) {
+  /* Moves every node onto the front of dest, leaving them in the order
+     list_add() would have, without allocating any. */
+  planet_node_t *node;
+
+  while ((node = src->first)) {
+    src->first = node->next;
+    node->next = dest->first;
+    dest->first = node;
+  }
+  dest->size += src->size;
+  src->size = 0;
+}
+
+
+void list_copy(planet_list_t *dest, const planet_list_t *src) {
+  /* Makes dest a list of copies of the planets on src, in the same order. */
+  planet_node_t **tail;
+  planet_node_t *node;
+  planet_node_t *copy;
+
+  list_init(dest);
+
+  tail = &dest->first;
+  for (node = src->first;  node;  node = node->next) {
+    copy = my_malloc(sizeof(*copy));
+    copy->planet = my_malloc(sizeof(*copy->planet));
+    *copy->planet = *node->planet;
+    copy->next = NULL;
+
+    *tail = copy;
+    tail = &copy->next;
+    ++dest->size;
+  }
+}
+
+
 void thread_arg_init(thread_arg_t *arg, planet_list_t *planets) {
   arg->planets = planets;
+  arg->neighbors = NULL;
+  planets_config_default(&arg->config);
+  arg->single_precision = 0;
+  arg->fixed_point = 0;
+  arg->measuring_energy = 0;
+  memset(&arg->floats, 0, sizeof(arg->floats));
+  memset(&arg->fixed, 0, sizeof(arg->fixed));
+  arg->fusing = 0;
+  arg->candidates = NULL;
+  arg->candidate_buffer_count = 0;
+  arg->candidates_valid = 0;
+  arg->threaded = 0;
   arg->planet_node = 0;
+  arg->planet_node_end = 0;
+  arg->worker_count = 0;
+  arg->main_helps = 0;
+  arg->partitioned = 0;
+  arg->slices = NULL;
+  arg->round = 0;
+  arg->rehoming = 0;
+  arg->deques = NULL;
+  arg->deque_count = 0;
+  arg->tasks_outstanding = 0;
+  arg->job = NULL;
+  arg->task_round = 0;
+  arg->task_workers = 0;
   pthread_mutex_init(&arg->mutex, 0);
   pthread_cond_init(&arg->cond, 0);
 }
@@ -1505,6 +9417,7 @@ void thread_arg_init(thread_arg_t *arg, planet_list_t *planets) {
 
 planet_node_t *thread_arg_get_planet_node(thread_arg_t *arg, int finished_one) {
   planet_node_t *node;
+  double start;
 
   pthread_mutex_lock(&arg->mutex);
     if (finished_one) {
@@ -1514,12 +9427,15 @@ planet_node_t *thread_arg_get_planet_node(thread_arg_t *arg, int finished_one) {
       }
     }
     if (arg->running) {
-      if (!arg->planet_node) {
+      if (!arg->planet_node && !thread_arg_join_tasks(arg)) {
+        start = trace_begin();
+        trace_flush_work();
         pthread_cond_wait(&arg->cond, &arg->mutex);
+        trace_end("wait", start, TRACE_NO_COUNT);
       }
       node = arg->planet_node;
       if (node) {
-        arg->planet_node = node->next;
+        arg->planet_node = node->next == arg->planet_node_end ? NULL : node->next;
       }
     } else {
       node = 0;
@@ -1531,9 +9447,90 @@ planet_node_t *thread_arg_get_planet_node(thread_arg_t *arg, int finished_one) {
 }
 
 
+planet_node_t *thread_arg_take_planet_node(thread_arg_t *arg, int finished_one) {
+  /* Like thread_arg_get_planet_node(), for the main thread:  it returns
+     NULL as soon as there's nothing left to hand out, instead of waiting. */
+  planet_node_t *node;
+
+  pthread_mutex_lock(&arg->mutex);
+    if (finished_one) {
+      --arg->working_planet_count;
+      if (arg->working_planet_count == 0) {
+        pthread_cond_broadcast(&arg->cond);
+      }
+    }
+    node = arg->planet_node;
+    if (node) {
+      arg->planet_node = node->next == arg->planet_node_end ? NULL : node->next;
+    }
+  pthread_mutex_unlock(&arg->mutex);
+
+  return node;
+}
+
+
+int thread_arg_wait_for_round(thread_arg_t *arg, size_t *round) {
+  /* Waits for partitioned work newer than *round.  Returns 0 once the
+     threads are stopping. */
+  int running;
+  double start;
+
+  start = trace_begin();
+  trace_flush_work();
+  pthread_mutex_lock(&arg->mutex);
+    while (arg->running && arg->round == *round) {
+      if (!thread_arg_join_tasks(arg)) {
+        pthread_cond_wait(&arg->cond, &arg->mutex);
+      }
+    }
+    *round = arg->round;
+    running = arg->running;
+  pthread_mutex_unlock(&arg->mutex);
+  trace_end("wait", start, TRACE_NO_COUNT);
+
+  return running;
+}
+
+
+int thread_arg_join_tasks(thread_arg_t *arg) {
+  /* Called by a worker holding the mutex, with nothing else to do.  Helps
+     with the collision tasks or the density view if a round of either is
+     on, returning 1 once it's done, with the mutex held again. */
+  void (*job)(thread_arg_t *pool);
+
+  if (!arg->job || task_round_seen == arg->task_round) {
+    return 0;
+  }
+
+  task_round_seen = arg->task_round;
+  job = arg->job;
+  ++arg->task_workers;
+  pthread_mutex_unlock(&arg->mutex);
+
+  job(arg);
+
+  pthread_mutex_lock(&arg->mutex);
+  if (--arg->task_workers == 0) {
+    pthread_cond_broadcast(&arg->cond);
+  }
+
+  return 1;
+}
+
+
+void thread_arg_finish_slice(thread_arg_t *arg) {
+  pthread_mutex_lock(&arg->mutex);
+    --arg->working_planet_count;
+    if (arg->working_planet_count == 0) {
+      pthread_cond_broadcast(&arg->cond);
+    }
+  pthread_mutex_unlock(&arg->mutex);
+}
+
+
 void thread_arg_reset_planet_node(thread_arg_t *arg) {
   pthread_mutex_lock(&arg->mutex);
-    arg->planet_node = arg->planets->first;
+    arg->planet_node = arg->planets->first == arg->planet_node_end ? NULL : arg->planets->first;
     pthread_cond_broadcast(&arg->cond);
   pthread_mutex_unlock(&arg->mutex);
 }
@@ -1568,3 +9565,15 @@ void *my_malloc(size_t size) {
 
   return ptr;
 }
+
+
+void *my_realloc(void *ptr, size_t size) {
+  ptr = realloc(ptr, size);
+
+  if (!ptr) {
+    perror("realloc()");
+    exit(1);
+  }
+
+  return ptr;
+}
@@ -0,0 +1,100 @@
+/* The simulation core of planets, for driving from other programs.  Build
+   libplanets.a with "make libplanets.a" and link it with -lm -lpthread.
+
+   Each context is a world of its own, with its own random stream, ids and
+   configuration.  Any number of them can be alive at once, and different
+   contexts can be stepped on different threads at the same time; one
+   context must only be used by one thread at a time.  A context steps on
+   the calling thread, unless it's configured with worker threads of its
+   own.  The default physics is the program's:  every pair of planets
+   attracts, planets that overlap merge, and the world wraps around its
+   edges.
+
+   The planets program is built from the same planets.c, and its window,
+   -P, -d, -b and -e runs all step their worlds through this interface,
+   each set up from the command line.  Only -V and the ranks of -r other
+   than the first still tick the core directly. */
+
+#ifndef PLANETS_H
+#define PLANETS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PLANETS_API __attribute__((visibility("default")))
+
+enum {
+  PLANETS_GENERATOR_UNIFORM,
+  PLANETS_GENERATOR_CLUSTERED,
+  PLANETS_GENERATOR_DISK,
+  PLANETS_GENERATOR_PLUMMER
+};
+
+
+typedef struct planets_context planets_context_t;
+
+
+typedef struct {
+  /* Start from planets_config_default(), then change what you need. */
+  double force_cutoff;  /* only planets closer than this attract; 0 for every pair */
+  int swept_collisions;  /* find when planets touch within a tick, not just whether they overlap */
+  int open_world;  /* nothing wraps around the edges */
+  double open_margin;  /* how far outside an open world planets may go before they're removed */
+  size_t reorder_interval;  /* ticks between sorting the planets into Morton order; 0 for never */
+  unsigned ticks_per_frame;  /* the program shows 60 frames a second; a tick is 1/60 s over this */
+  int single_precision;
+  int fixed_point;
+  long worker_count;  /* threads of the context's own; -1 for one per CPU, less one if main_helps */
+  int main_helps;  /* whether the stepping thread calculates forces alongside the workers */
+  int partitioned;  /* whether each worker always gets the same slice of the planets */
+} planets_config_t;
+
+
+typedef struct {
+  uint64_t id;  /* stays with the planet until it merges or splits */
+  double x_pos, y_pos;
+  double x_vel, y_vel;
+  double mass;
+  double radius;
+  double hue;  /* in degrees */
+} planets_body_t;
+
+
+/* The program's defaults:  no cutoff, overlap collisions, a wrapping world,
+   5 ticks a frame, double precision, and no worker threads. */
+PLANETS_API void planets_config_default(planets_config_t *config);
+
+/* Makes a world of count planets, laid out by one of the generators, from
+   the seed.  The same arguments always make the same world.  Returns NULL
+   if count is 0 or the generator is unknown. */
+PLANETS_API planets_context_t *planets_new(size_t count, int generator, unsigned seed);
+
+/* As planets_new(), configured.  Also returns NULL if the configuration
+   can't work:  a cutoff under twice the largest radius, or with single
+   precision or fixed point; fixed point with single precision or an open
+   world; no ticks a frame; or worker threads that couldn't be started.
+   A worker_count of 0 with main_helps runs the pool's code on the
+   stepping thread alone. */
+PLANETS_API planets_context_t *planets_new_with_config(size_t count, int generator, unsigned seed,
+                                                       const planets_config_t *config);
+
+/* Changes the configuration from the next step on.  The threads and the
+   precision are fixed when the context is made.  Returns -1, changing
+   nothing, if the new configuration changes them or can't work. */
+PLANETS_API int planets_configure(planets_context_t *context, const planets_config_t *config);
+
+PLANETS_API void planets_delete(planets_context_t *context);
+
+/* Simulates this many ticks, and returns how many the context has
+   simulated in all.  By default a tick is 1/300 s. */
+PLANETS_API size_t planets_step(planets_context_t *context, size_t ticks);
+
+/* The planets as of the last step, or as made, in no particular order.  The
+   array is filled by the first call after a step, so stepping costs nothing
+   for it.  It belongs to the context and stays as it is until the next
+   step. */
+PLANETS_API const planets_body_t *planets_bodies(planets_context_t *context, size_t *count);
+
+PLANETS_API void planets_world_size(double *width, double *height);
+
+#endif